@@ -0,0 +1,1154 @@
+/***************************************************************************************************
+MIT License - Linux Port (Akamai-Grade Reliable UDP Client)
+
+POSIX sockets version of client_win.c
+****************************************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "../common/protocol.h"
+#include "../common/batch.h"
+#include "../common/sack.h"
+#include "../common/cc.h"
+#include "../common/command.h"
+#include "../common/crc32.h"
+#include "../common/delta.h"
+#include "../common/fec.h"
+#include "../common/lz.h"
+#include "../common/filesink.h"
+#include "../common/filesrc.h"
+#include "../common/journal.h"
+#include "../common/rtt.h"
+#include "../common/stats.h"
+#include "../common/udpbatch.h"
+
+static void print_error(char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static uint32_t conn_id;   // Connection ID of the current command, stamped on every packet
+static int conn_echoed;    // The server has echoed conn_id, so packets without it are strays
+static ChecksumType csum;  // Checksum we send with, CRC-32C once the server has accepted it
+static SendBatch tx;       // Window bursts and ACKs, one sendmmsg per flush
+static RecvBatch rx;
+static LatencyStats latency;    // Of every file received, printed on exit
+static char queued[BATCH_MAX_FILES][200];  // Commands to run before reading the next one
+static unsigned queued_len, queued_next;
+
+// Random non-zero 24-bit ID so the server can tell our transfers apart
+static uint32_t new_conn_id(void) {
+    uint32_t id = ((uint32_t)rand() << 16 ^ (uint32_t)rand() << 4 ^ (uint32_t)now_us()) & 0xFFFFFF;
+    return id ? id : 1;
+}
+
+static void stamp_packet(Packet *pkt, uint32_t id, ChecksumType cs) {
+    packet_set_conn_id(&pkt->header, id);
+    if (cs == CSUM_CRC32C) pkt->header.flags |= FLAG_CRC32C;
+    pkt->header.checksum = 0;
+    pkt->header.checksum = packet_crc(pkt);
+}
+
+void send_packet(int sfd, struct sockaddr_in *addr, socklen_t addr_len, Packet *pkt) {
+    stamp_packet(pkt, conn_id, csum);
+    sendto(sfd, (char *)pkt, sizeof(PacketHeader) + pkt->header.data_len, 0, (struct sockaddr *)addr, addr_len);
+}
+
+// Like send_packet, but the packet leaves with the next send_batch_flush
+void queue_packet(int sfd, struct sockaddr_in *addr, Packet *pkt, int stable) {
+    stamp_packet(pkt, conn_id, csum);
+    send_batch_add(&tx, sfd, addr, pkt, stable);
+}
+
+// Queues a put window slot; with the file mapped only the header lives in
+// the slot and the payload is sent from the mapping, unless it was compressed
+// into the slot
+void queue_slot(int sfd, struct sockaddr_in *addr, SendSlot *slot, const FileSource *src) {
+    PacketHeader *h = &slot->pkt.header;
+    if (!src->map || (h->flags & FLAG_LZ)) {
+        queue_packet(sfd, addr, &slot->pkt, 1);
+        return;
+    }
+
+    const char *payload = src->map + (long)(h->seq_num - 1) * DATA_SIZE;
+    packet_set_conn_id(h, conn_id);
+    if (csum == CSUM_CRC32C) h->flags |= FLAG_CRC32C;
+    h->checksum = 0;
+    h->checksum = packet_crc_parts(h, payload);
+    send_batch_add_split(&tx, sfd, addr, h, payload);
+}
+
+/*---------------------------------------- Parallel get ----------------------------------------*/
+
+#define PGET_STREAMS 4              // Default number of ranges
+#define STREAM_REPLY_TRIES 5        // Commands a server may leave unanswered while sending before it counts as
+                                    // one without options
+#define STREAM_IDLE_MS 30000        // Silence after which a stream is given up, as SESSION_IDLE_MS on the server
+
+// One range of a parallel get. Every range has a socket of its own, so it is
+// a separate flow with its own window, and a server running SO_REUSEPORT
+// workers may serve the ranges from different cores.
+typedef struct {
+    int          fd;
+    struct sockaddr_in server;
+    uint32_t     conn_id;
+    int          conn_echoed;
+    ChecksumType csum;
+    Command      c;             // As requested, then as accepted
+    Packet       request;       // The command, re-sent every RTO_INITIAL_MS until the reply comes
+    uint64_t     request_us;    // When it last went out
+    unsigned     requests;      // How many times
+    uint64_t     last_rx_us;
+    int          replied;       // The server answered (or, after STREAM_REPLY_TRIES, counts as a legacy one)
+    int          done;          // All the data is in
+    RecvWindow   rw;
+    FileSink     sink;
+    AckState     as;
+    TransferStats st;
+} RangeStream;
+
+static void range_send_ack(RangeStream *r) {
+    Packet ack;
+    recv_window_build_ack(&r->rw, &ack);
+    stamp_packet(&ack, r->conn_id, r->csum);
+    send_batch_add(&tx, r->fd, &r->server, &ack, 0);
+    ack_on_sent(&r->as);
+    r->st.acks++;
+}
+
+// Sets r up to receive into fp (taken over, written from offset) and sends
+// cmd with the default options, plus range=part/parts when parts > 0.
+// Returns -1 if the stream cannot start.
+static int stream_open(RangeStream *r, const struct sockaddr_in *server, FILE *fp, const char *cmd, unsigned part,
+                       unsigned parts, long long offset, int wfd) {
+    AckPolicy immediate;
+    char text[200];
+
+    memset(r, 0, sizeof(*r));
+    r->server = *server;
+    r->csum = CSUM_CRC32;
+    r->conn_id = new_conn_id();
+    if ((r->fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        fclose(fp);
+        return -1;
+    }
+    int sock_buf = SOCKET_BUFFER_BYTES;
+    setsockopt(r->fd, SOL_SOCKET, SO_RCVBUF, &sock_buf, sizeof(sock_buf));
+    if (rx.gro) udp_gro_enable(r->fd);
+
+    if (recv_window_init(&r->rw) != 0) {
+        fclose(fp);
+        close(r->fd);
+        return -1;
+    }
+    if (file_sink_open(&r->sink, fp, &r->rw, 0, 0, wfd) != 0 || file_sink_decompress(&r->sink) != 0) {
+        file_sink_close(&r->sink);
+        recv_window_free(&r->rw);
+        close(r->fd);
+        return -1;
+    }
+    file_sink_seek(&r->sink, offset);
+    // ACK every packet until the server confirms the coalescing we asked for
+    ack_policy_default(&immediate);
+    ack_state_init(&r->as, &immediate);
+    stats_init(&r->st);
+
+    snprintf(text, sizeof(text), "%s", cmd);
+    command_parse(text, &r->c);
+    command_add_default_options(&r->c, text, sizeof(text));
+    command_add_range(&r->c, text, sizeof(text), part, parts);
+    command_add_fec(&r->c, text, sizeof(text));
+    command_add_compress(&r->c, text, sizeof(text));
+
+    Packet *pkt = &r->request;
+    strcpy(pkt->data, text);
+    pkt->header.data_len = (uint16_t)strlen(text);
+    pkt->header.flags = FLAG_SYN;
+    stamp_packet(pkt, r->conn_id, r->csum);
+    sendto(r->fd, (char *)pkt, sizeof(PacketHeader) + pkt->header.data_len, 0, (struct sockaddr *)&r->server,
+           sizeof(r->server));
+    r->request_us = r->last_rx_us = now_us();
+    r->requests = 1;
+    return 0;
+}
+
+// Until the reply comes, re-sends the command every RTO_INITIAL_MS: either it
+// or the reply was lost, and a server repeats its reply to a repeated
+// command. A server that keeps sending data through STREAM_REPLY_TRIES
+// commands without answering one ignores options, and sends the whole file.
+static void stream_resend(RangeStream *r, uint64_t now) {
+    if (r->replied || now < r->request_us + RTO_INITIAL_MS * 1000ULL) return;
+    if (r->requests >= STREAM_REPLY_TRIES && r->st.data_packets > 0) {
+        r->replied = 1;
+        r->c.parts = 0;
+        return;
+    }
+    sendto(r->fd, (char *)&r->request, sizeof(PacketHeader) + r->request.header.data_len, 0,
+           (struct sockaddr *)&r->server, sizeof(r->server));
+    r->request_us = now;
+    r->requests++;
+}
+
+// Microseconds until the stream needs stream_resend or has been idle for
+// STREAM_IDLE_MS, whichever is first
+static int64_t stream_wait_us(const RangeStream *r, uint64_t now) {
+    uint64_t deadline = r->last_rx_us + STREAM_IDLE_MS * 1000ULL;
+    uint64_t resend = r->request_us + RTO_INITIAL_MS * 1000ULL;
+    if (!r->replied && resend < deadline) deadline = resend;
+    return deadline > now ? (int64_t)(deadline - now) : 0;
+}
+
+// Opens the file (mode "wb" for the first range, "r+b" for the others) and
+// sends "get <filename> range=part/parts". Returns -1 if the range cannot start.
+static int range_open(RangeStream *r, const struct sockaddr_in *server, const char *filename, const char *mode,
+                      unsigned part, unsigned parts, long long offset, int wfd) {
+    char cmd[220];
+    FILE *fp = fopen(filename, mode);
+    if (!fp) return -1;
+    snprintf(cmd, sizeof(cmd), "get %s", filename);
+    return stream_open(r, server, fp, cmd, part, parts, offset, wfd);
+}
+
+// One datagram on the range's socket. Returns -1 once the file cannot be written.
+static int range_on_packet(RangeStream *r, Packet *in, unsigned len) {
+    if (len < sizeof(PacketHeader) || in->header.data_len > DATA_SIZE) return 0;
+    uint32_t received_crc = in->header.checksum;
+    in->header.checksum = 0;
+    if (packet_crc(in) != received_crc || !packet_in_conn(&in->header, r->conn_id, &r->conn_echoed)) return 0;
+    r->last_rx_us = now_us();
+
+    if ((in->header.flags & (FLAG_SYN | FLAG_ACK)) == (FLAG_SYN | FLAG_ACK)) {
+        if (r->replied) return 0;
+        unsigned asked = r->c.parts;
+        command_parse_reply(in, &r->c);
+        r->as.policy = r->c.ack;
+        r->csum = r->c.csum;
+        r->replied = 1;
+        if (r->c.parts != asked) {
+            r->c.parts = 0;     // Range ignored: the whole file follows
+            return 0;
+        }
+        long long offset, length;
+        command_part_range(r->c.size, r->c.part, r->c.parts, &offset, &length);
+        if (length == 0) r->done = 1;   // Nothing in this part, no data will come
+        return 0;
+    }
+    Packet rebuilt;
+    if (in->header.flags & FLAG_FEC) {
+        r->st.fec_repairs++;
+        if (!fec_rebuild(&r->rw, in, &rebuilt)) return 0;
+        r->st.fec_rebuilt++;
+        in = &rebuilt;
+    }
+    if (!(in->header.flags & FLAG_DATA)) return 0;
+
+    // Data ahead of the reply is the same either way: a stream only starts
+    // away from offset 0 once its server has confirmed ranges
+    int clean = recv_window_in_order(&r->rw, in);
+    clean &= recv_window_accept(&r->rw, in);
+    r->st.data_packets++;
+    Packet *in_order;
+    while ((in_order = recv_window_next(&r->rw)) != NULL) r->st.bytes += lz_raw_len(&in_order->header);
+    if (file_sink_deliver(&r->sink) != 0) return -1;
+    if (recv_window_done(&r->rw)) r->done = 1;
+    if (ack_on_data(&r->as, clean, r->done, now_us())) range_send_ack(r);
+    return 0;
+}
+
+// Fetches filename as `streams` ranges at once, round-robin over the server
+// ports, each written at its offset with pwrite by its own file writer. The
+// first range doubles as a probe: its reply carries the file size, and a
+// server that ignores range= gets a plain single-stream get.
+static void parallel_get(const char *filename, unsigned streams, const struct sockaddr_in *servers,
+                         unsigned nservers, int wfd) {
+    RangeStream *rs = calloc(streams, sizeof(*rs));
+    struct pollfd *pfd = calloc(streams + 1, sizeof(*pfd));
+    unsigned launched = 0;
+    int failed = 0;
+    uint64_t start = now_us();
+
+    if (!rs || !pfd || range_open(&rs[0], &servers[0], filename, "wb", 0, streams, 0, wfd) != 0) {
+        printf("Cannot start parallel get of %s\n", filename);
+        free(rs);
+        free(pfd);
+        return;
+    }
+    launched = 1;
+    journal_remove(filename);   // The file starts over, so an earlier get cannot resume
+
+    for (;;) {
+        // The size is known: start the other ranges, or fall back to one stream
+        if (launched == 1 && rs[0].replied && streams > 1) {
+            if (rs[0].c.parts != streams) {
+                printf("Server does not serve ranges, receiving %s as one stream\n", filename);
+                streams = 1;
+            } else if (file_sink_reserve(&rs[0].sink, rs[0].c.size) != 0) {
+                failed = 1;
+                break;
+            }
+            for (; launched < streams; launched++) {
+                long long offset, length;
+                command_part_range(rs[0].c.size, launched, streams, &offset, &length);
+                const struct sockaddr_in *server = &servers[launched % nservers];
+                if (range_open(&rs[launched], server, filename, "r+b", launched, streams, offset, wfd) != 0) {
+                    failed = 1;
+                    break;
+                }
+            }
+            if (failed) break;
+        }
+
+        // A stream is through once it has both its data and the reply
+        unsigned active = 0;
+        for (unsigned i = 0; i < launched; i++) active += !rs[i].done || !rs[i].replied;
+        if (!active) break;
+
+        // Wait for data or a writer; flush delayed ACKs whose timer ran out,
+        // re-send unanswered commands and give up on silent servers
+        uint64_t now = now_us();
+        int64_t wait = -1;
+        for (unsigned i = 0; i < launched && !failed; i++) {
+            if (rs[i].done && rs[i].replied) continue;
+            stream_resend(&rs[i], now);
+            int64_t w = stream_wait_us(&rs[i], now);
+            if (w == 0) {
+                printf("No answer from the server for range %u in %d s\n", i, STREAM_IDLE_MS / 1000);
+                failed = 1;
+            }
+            if (wait < 0 || w < wait) wait = w;
+        }
+        if (failed) break;
+        for (unsigned i = 0; i < launched; i++) {
+            int64_t w = ack_wait_us(&rs[i].as, now);
+            if (w == 0) range_send_ack(&rs[i]);
+            else if (w > 0 && (wait < 0 || w < wait)) wait = w;
+            pfd[i].fd = rs[i].fd;
+            pfd[i].events = POLLIN;
+        }
+        pfd[launched].fd = wfd;
+        pfd[launched].events = POLLIN;
+        send_batch_flush(&tx);
+
+        struct timespec ts = {(time_t)(wait / 1000000), (long)(wait % 1000000) * 1000};
+        int ready = ppoll(pfd, launched + 1, &ts, NULL);
+        if (ready <= 0) continue;
+
+        if (pfd[launched].revents & POLLIN) {
+            uint64_t wakeups;
+            if (read(wfd, &wakeups, sizeof(wakeups)) < 0) wakeups = 0;
+            for (unsigned i = 0; i < launched && !failed; i++) {
+                if (file_sink_progress(&rs[i].sink) != 0) failed = 1;
+                else if (file_sink_reopened(&rs[i].sink)) range_send_ack(&rs[i]);
+            }
+        }
+        for (unsigned i = 0; i < launched && !failed; i++) {
+            if (!(pfd[i].revents & POLLIN)) continue;
+            unsigned n = recv_batch_fill(&rx, rs[i].fd, MSG_DONTWAIT);
+            for (unsigned j = 0; j < n && !failed; j++) {
+                if (range_on_packet(&rs[i], rx.pkt[j], rx.len[j]) != 0) failed = 1;
+            }
+        }
+        send_batch_flush(&tx);
+        if (failed) break;
+    }
+    send_batch_flush(&tx);
+
+    // Final ACKs are out; wait for the writers before calling the file done
+    long long bytes = 0;
+    for (unsigned i = 0; i < launched; i++) {
+        char tag[32];
+        if (file_sink_close(&rs[i].sink) != 0 && !failed) failed = 1;
+        if (!failed && rs[i].sink.error) failed = 1;
+        snprintf(tag, sizeof(tag), "[range %u] ", i);
+        if (!failed) stats_print_receiver(tag, &rs[i].st, &rs[i].as.policy);
+        bytes += (long long)rs[i].st.bytes;
+        recv_window_free(&rs[i].rw);
+        close(rs[i].fd);
+    }
+    // The ranges must add up to the size the server confirmed (a server
+    // without options does not tell it)
+    if (!failed && rs[0].c.size > 0 && bytes != rs[0].c.size) {
+        printf("Received %lld of %lld bytes of %s\n", bytes, rs[0].c.size, filename);
+        failed = 1;
+    }
+    if (failed) {
+        for (unsigned i = 0; i < launched; i++) {
+            if (rs[i].sink.error) {
+                printf("Cannot write %s: %s\n", filename, strerror(rs[i].sink.error));
+                break;
+            }
+        }
+        printf("Parallel get of %s failed\n", filename);
+    } else {
+        double secs = (now_us() - start) / 1e6;
+        printf("File received successfully: %lld bytes over %u streams in %.3f s (%.2f MB/s)\n", bytes, launched, secs,
+               secs > 0 ? bytes / secs / 1e6 : 0.0);
+        latency_record(&latency, bytes, now_us() - start);
+        udp_batch_print("", &tx, &rx);
+    }
+    udp_batch_reset_counters(&tx, &rx);
+    free(rs);
+    free(pfd);
+}
+
+/*----------------------------------------- Delta put -----------------------------------------*/
+
+#define DELTA_REPLY_MS 1000         // Silence after which the signature is given up
+
+static int no_delta;                // The server never answered "sig": always put whole files
+
+// Receives the signature of the server's copy of filename into a malloc'd
+// *sig of *len bytes. Returns -1 if it did not come.
+static int fetch_signature(const char *filename, const struct sockaddr_in *server, int wfd, uint8_t **sig,
+                           size_t *len) {
+    RangeStream r;
+    char cmd[220];
+    FILE *fp = tmpfile();
+    int keep = fp ? dup(fileno(fp)) : -1;      // The sink closes fp
+    int failed = 0;
+    uint64_t last_rx = now_us();
+
+    snprintf(cmd, sizeof(cmd), "sig %s", filename);
+    if (keep < 0 || stream_open(&r, server, fp, cmd, 0, 0, 0, wfd) != 0) {
+        if (keep >= 0) close(keep);
+        else if (fp) fclose(fp);
+        return -1;
+    }
+    while (!r.done && !failed) {
+        struct pollfd pfd[2] = {{r.fd, POLLIN, 0}, {wfd, POLLIN, 0}};
+        int64_t wait = ack_wait_us(&r.as, now_us());
+        if (wait == 0) range_send_ack(&r);
+        if (wait < 0 || wait > 100000) wait = 100000;
+        send_batch_flush(&tx);
+        if (now_us() - last_rx > DELTA_REPLY_MS * 1000ULL) {
+            if (!r.replied) no_delta = 1;
+            failed = 1;
+            break;
+        }
+
+        struct timespec ts = {0, (long)wait * 1000};
+        if (ppoll(pfd, 2, &ts, NULL) <= 0) continue;
+        if (pfd[1].revents & POLLIN) {
+            uint64_t wakeups;
+            if (read(wfd, &wakeups, sizeof(wakeups)) < 0) wakeups = 0;
+            if (file_sink_progress(&r.sink) != 0) failed = 1;
+            else if (file_sink_reopened(&r.sink)) range_send_ack(&r);
+        }
+        if (pfd[0].revents & POLLIN) {
+            unsigned n = recv_batch_fill(&rx, r.fd, MSG_DONTWAIT);
+            for (unsigned i = 0; i < n && !failed; i++) {
+                if (range_on_packet(&r, rx.pkt[i], rx.len[i]) != 0) failed = 1;
+            }
+            if (n) last_rx = now_us();
+        }
+        send_batch_flush(&tx);
+    }
+    send_batch_flush(&tx);
+    if (file_sink_close(&r.sink) != 0 || r.sink.error) failed = 1;
+    recv_window_free(&r.rw);
+    close(r.fd);
+    udp_batch_reset_counters(&tx, &rx);
+
+    struct stat sb;
+    *sig = NULL;
+    *len = 0;
+    if (!failed && fstat(keep, &sb) == 0 && sb.st_size > 0) {
+        *sig = malloc((size_t)sb.st_size);
+        if (!*sig || pread(keep, *sig, (size_t)sb.st_size, 0) != sb.st_size) {
+            free(*sig);
+            *sig = NULL;
+            failed = 1;
+        } else {
+            *len = (size_t)sb.st_size;
+        }
+    }
+    close(keep);
+    return failed ? -1 : 0;
+}
+
+// The delta that turns the server's copy of filename into ours, in a temporary
+// file ready to be put, or NULL to put the whole file: the server has no copy
+// or does not answer "sig", or the delta would not be smaller
+static FILE *delta_for_put(const char *filename, const struct sockaddr_in *server, int wfd) {
+    uint8_t *sig;
+    size_t sig_len;
+    struct stat sb;
+    FILE *delta = NULL;
+
+    if (no_delta || fetch_signature(filename, server, wfd, &sig, &sig_len) != 0) return NULL;
+    if (sig_len == 0) return NULL;      // Nothing to build on
+
+    int fd = open(filename, O_RDONLY);
+    void *map = fd >= 0 && fstat(fd, &sb) == 0 && sb.st_size > 0
+                    ? mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+                    : MAP_FAILED;
+    if (map != MAP_FAILED) {
+        madvise(map, (size_t)sb.st_size, MADV_SEQUENTIAL);
+        delta = tmpfile();
+        long long copied = delta ? delta_build(map, sb.st_size, sig, sig_len, delta) : -1;
+        long long size = delta ? ftell(delta) : 0;
+        if (copied > 0 && size < sb.st_size) {
+            printf("Delta: %lld of %lld bytes to send, %lld reused from the server's copy\n", size,
+                   (long long)sb.st_size, copied);
+            rewind(delta);
+        } else if (delta) {
+            fclose(delta);
+            delta = NULL;
+        }
+        munmap(map, (size_t)sb.st_size);
+    }
+    if (fd >= 0) close(fd);
+    free(sig);
+    return delta;
+}
+
+/*------------------------------------- Batch of small files -------------------------------------*/
+
+static void queue_command(const char *cmd, const char *filename) {
+    if (queued_len < BATCH_MAX_FILES) snprintf(queued[queued_len++], sizeof(queued[0]), "%s %s", cmd, filename);
+}
+
+// Writes the file of a batch record, or says what became of it
+static void batch_take(const char *name, const BatchRecord *r, const char *data, uint64_t start) {
+    if (r->status == BATCH_NOT_FOUND) {
+        printf("%s: file not found\n", name);
+    } else if (r->status == BATCH_TOO_LARGE) {
+        queue_command("get", name);
+    } else {
+        FILE *fp = fopen(name, "wb");
+        if (!fp || fwrite(data, 1, r->len, fp) != r->len || fclose(fp) != 0) {
+            if (fp) fclose(fp);
+            printf("Cannot write %s\n", name);
+            return;
+        }
+        latency_record(&latency, r->len, now_us() - start);
+        printf("%s: %u bytes\n", name, r->len);
+    }
+}
+
+// "mget a b c": small files in one round trip each way (batch.h). What the
+// server does not answer after BATCH_TRIES, or sends as too large for a
+// batch, is queued as single gets.
+static void batch_get(char **names, unsigned n, const struct sockaddr_in *server) {
+    int done[BATCH_MAX_FILES] = {0};
+    unsigned left = n, received = 0;
+    uint64_t start = now_us();
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) return;
+
+    for (unsigned tries = 0; tries < BATCH_TRIES && left > 0; tries++) {
+        unsigned map[BATCH_MAX_FILES], m = 0;   // Request index -> names index
+        uint32_t id = new_conn_id(), packets = 0, seen = 0, got = 0;     // seen: bit per packet
+        int echoed = 0;
+        Packet pkt;
+
+        memset(&pkt, 0, sizeof(pkt));
+        // The list is read into Command.filename: what would not fit there (or
+        // in the packet) waits for the next try, or for a single get
+        int used = snprintf(pkt.data, sizeof(pkt.data), "mget "), list = used;
+        size_t room = sizeof(((Command *)0)->filename) - 1;
+        if (room > sizeof(pkt.data) - 1 - (size_t)used) room = sizeof(pkt.data) - 1 - (size_t)used;
+        for (unsigned i = 0; i < n; i++) {
+            if (done[i] || (size_t)(used - list) + (m ? 1 : 0) + strlen(names[i]) > room) continue;
+            used += snprintf(pkt.data + used, sizeof(pkt.data) - used, "%s%s", m ? "," : "", names[i]);
+            map[m++] = i;
+        }
+        if (m == 0) break;
+        pkt.header.data_len = (uint16_t)used;
+        pkt.header.flags = FLAG_SYN;
+        stamp_packet(&pkt, id, CSUM_CRC32);
+        sendto(fd, (char *)&pkt, sizeof(PacketHeader) + pkt.header.data_len, 0, (struct sockaddr *)server,
+               sizeof(*server));
+
+        uint64_t deadline = now_us() + BATCH_REPLY_MS * 1000;
+        while (left > 0 && (!packets || got < packets)) {
+            uint64_t now = now_us();
+            if (now >= deadline) break;
+            struct pollfd pfd = {fd, POLLIN, 0};
+            struct timespec ts = {0, (long)(deadline - now) * 1000};
+            if (ppoll(&pfd, 1, &ts, NULL) <= 0) continue;
+
+            unsigned nr = recv_batch_fill(&rx, fd, MSG_DONTWAIT);
+            for (unsigned j = 0; j < nr; j++) {
+                Packet *in = rx.pkt[j];
+                if (rx.len[j] < sizeof(PacketHeader) || in->header.data_len > DATA_SIZE) continue;
+                uint32_t received_crc = in->header.checksum;
+                in->header.checksum = 0;
+                if (packet_crc(in) != received_crc || !packet_in_conn(&in->header, id, &echoed)) continue;
+                if (!(in->header.flags & FLAG_DATA) || in->header.ack_num == 0 ||
+                    in->header.ack_num > BATCH_MAX_FILES || in->header.seq_num == 0 ||
+                    in->header.seq_num > in->header.ack_num || (seen & 1u << (in->header.seq_num - 1))) {
+                    continue;
+                }
+                packets = in->header.ack_num;
+                seen |= 1u << (in->header.seq_num - 1);
+                got++;
+                received++;
+
+                BatchRecord r;
+                uint16_t pos = 0;
+                const char *data;
+                while ((data = batch_next(in, &pos, &r)) != NULL) {
+                    if (r.index >= m || done[map[r.index]]) continue;
+                    batch_take(names[map[r.index]], &r, data, start);
+                    done[map[r.index]] = 1;
+                    left--;
+                }
+            }
+        }
+    }
+    close(fd);
+    udp_batch_reset_counters(&tx, &rx);
+
+    if (left > 0) {
+        printf("%s; getting %u files one by one\n", received ? "Batch incomplete" : "Server does not batch", left);
+        for (unsigned i = 0; i < n; i++) {
+            if (!done[i]) queue_command("get", names[i]);
+        }
+    }
+    printf("Batch of %u files: %u packets in %.3f ms\n", n, received, (now_us() - start) / 1000.0);
+}
+
+#define MAX_SERVER_PORTS 16
+
+int main(int argc, char **argv) {
+    int cfd;
+    struct sockaddr_in send_addr, from_addr;
+    struct sockaddr_in servers[MAX_SERVER_PORTS];  // One per port given; pget spreads its ranges over them
+    unsigned nservers = 0;
+    Packet pkt;
+    socklen_t addr_len;
+
+    if (argc != 3) {
+        printf("Client: Usage --> %s [IP Address] [Port Number[,Port Number...]]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    init_crc32();
+    init_fec();
+    srand((unsigned)time(NULL) ^ (unsigned)now_us());
+
+    char *port = argv[2];
+    do {
+        memset(&servers[nservers], 0, sizeof(servers[nservers]));
+        servers[nservers].sin_family = AF_INET;
+        servers[nservers].sin_port = htons((uint16_t)strtoul(port, &port, 10));
+        servers[nservers].sin_addr.s_addr = inet_addr(argv[1]);
+        nservers++;
+    } while (*port++ == ',' && nservers < MAX_SERVER_PORTS);
+    send_addr = servers[0];
+
+    if ((cfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        print_error("Client: socket");
+
+    int sock_buf = SOCKET_BUFFER_BYTES;
+    setsockopt(cfd, SOL_SOCKET, SO_RCVBUF, (char *)&sock_buf, sizeof(sock_buf));
+    setsockopt(cfd, SOL_SOCKET, SO_SNDBUF, (char *)&sock_buf, sizeof(sock_buf));
+
+    // GSO for put bursts, GRO for get; either stays off if the kernel refuses it
+    send_batch_init(&tx, udp_gso_probe(cfd));
+    if (recv_batch_init(&rx, udp_gro_enable(cfd)) != 0) print_error("Client: receive buffers");
+
+    // The file writer of a get reports progress here (filesink.h)
+    int wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wfd < 0) print_error("Client: eventfd");
+
+    printf("Akamai-Grade Client connected to %s:%s\n", argv[1], argv[2]);
+
+    for (;;) {
+        char cmd_input[200];
+        Command c;
+        
+        if (queued_next < queued_len) {
+            snprintf(cmd_input, sizeof(cmd_input), "%s", queued[queued_next++]);
+            printf("\nCommand: %s\n", cmd_input);
+        } else {
+            queued_len = queued_next = 0;
+            printf("\n===== Menu =====\n");
+            printf("  1.) get [file_name] [offset] [length]\n");
+            printf("  2.) pget [file_name] [streams]\n");
+            printf("  3.) mget [file_name...]\n");
+            printf("  4.) put [file_name]\n");
+            printf("  5.) delete [file_name]\n");
+            printf("  6.) ls\n");
+            printf("  7.) stats\n");
+            printf("  8.) exit\n");
+            printf("Command: ");
+
+            if (!fgets(cmd_input, sizeof(cmd_input), stdin)) break;
+            cmd_input[strcspn(cmd_input, "\n")] = 0;
+        }
+        
+        command_parse(cmd_input, &c);
+        long long get_offset = 0, get_length = 0;  // get <file> [offset [length]]
+        JournalId journal_id;                      // The file an interrupted get of this file was receiving
+        int explicit_range = 0, resumed = 0;
+        if (strcmp(c.cmd, "get") == 0) {
+            long long committed;
+            explicit_range = sscanf(cmd_input, "%*s %*s %lld %lld", &get_offset, &get_length) >= 1;
+            if (!explicit_range) {
+                get_offset = get_length = 0;
+                if (journal_load(c.filename, &journal_id, &committed) == 0) {
+                    get_offset = journal_resume_point(journal_id.size, committed);
+                    resumed = get_offset > 0;
+                }
+            }
+        }
+        if (strcmp(c.cmd, "pget") == 0) {
+            unsigned streams = PGET_STREAMS;
+            sscanf(cmd_input, "%*s %*s %u", &streams);
+            if (streams < 1) streams = 1;
+            if (streams > COMMAND_MAX_PARTS) streams = COMMAND_MAX_PARTS;
+            if (c.filename[0]) parallel_get(c.filename, streams, servers, nservers, wfd);
+            continue;
+        }
+        if (strcmp(c.cmd, "mget") == 0) {
+            char *names[BATCH_MAX_FILES], *save = NULL;
+            unsigned n = 0;
+            strtok_r(cmd_input, " ", &save);
+            for (char *name; n < BATCH_MAX_FILES && (name = strtok_r(NULL, " ", &save)) != NULL;) names[n++] = name;
+            if (n) batch_get(names, n, &send_addr);
+            continue;
+        }
+        if (strcmp(c.cmd, "get") == 0 || strcmp(c.cmd, "put") == 0) {
+            command_add_default_options(&c, cmd_input, sizeof(cmd_input));
+            if (!c.fec) command_add_fec(&c, cmd_input, sizeof(cmd_input));
+            if (!c.compress) command_add_compress(&c, cmd_input, sizeof(cmd_input));
+        }
+        // A get that keeps a journal learns the etag and mtime of the file, so
+        // that resuming it can tell whether the file is still the same
+        if (strcmp(c.cmd, "get") == 0 && !explicit_range && !c.want_etag) {
+            command_add_etag(&c, cmd_input, sizeof(cmd_input), NULL);
+        }
+        FILE *delta = NULL;     // Put: sent instead of the file, which the server has an older copy of
+        if (strcmp(c.cmd, "put") == 0) {
+            struct stat sb;
+            if (stat(c.filename, &sb) == 0 && sb.st_size >= DELTA_MIN_BYTES) {
+                delta = delta_for_put(c.filename, &send_addr, wfd);
+                if (delta) command_add_delta(&c, cmd_input, sizeof(cmd_input));
+                if (delta && !c.delta) {
+                    fclose(delta);
+                    delta = NULL;
+                }
+                if (delta && fstat(fileno(delta), &sb) != 0) sb.st_size = 0;
+            }
+            if (delta || stat(c.filename, &sb) == 0) {
+                command_add_size(&c, cmd_input, sizeof(cmd_input), (long long)sb.st_size);
+            }
+            // What is sent, so that the server resumes a broken-off put only
+            // into the same data
+            FILE *data = delta ? delta : fopen(c.filename, "rb");
+            uint32_t etag;
+            if (data && crc32c_stream(data, &etag) == 0) command_add_etag(&c, cmd_input, sizeof(cmd_input), &etag);
+            if (data && data != delta) fclose(data);
+            if (delta) rewind(delta);
+            if (stat(c.filename, &sb) == 0) command_add_mtime(&c, cmd_input, sizeof(cmd_input), (long long)sb.st_mtime);
+        }
+        if (strcmp(c.cmd, "get") == 0) command_add_offset(&c, cmd_input, sizeof(cmd_input), get_offset, get_length);
+
+        // Send Command
+        conn_id = new_conn_id();
+        conn_echoed = 0;
+        csum = CSUM_CRC32;
+        memset(&pkt, 0, sizeof(pkt));
+        strcpy(pkt.data, cmd_input);
+        pkt.header.data_len = strlen(cmd_input);
+        pkt.header.flags = FLAG_SYN; // Command packet
+        send_packet(cfd, &send_addr, sizeof(send_addr), &pkt);
+        uint64_t sent_us = now_us();
+
+        if (strcmp(c.cmd, "get") == 0) {
+            // A range or a resumed get writes into the file in place
+            FILE *fp = get_offset > 0 || get_length > 0 ? fopen(c.filename, "r+b") : NULL;
+            if (!fp) fp = fopen(c.filename, "wb");
+            if (!fp) {
+                printf("Error opening file for writing\n");
+                continue;
+            }
+
+            RecvWindow rw;
+            FileSink sink;
+            AckState as;
+            AckPolicy immediate;
+            TransferStats st;
+            if (recv_window_init(&rw) != 0) {
+                printf("Cannot allocate receive window\n");
+                fclose(fp);
+                continue;
+            }
+            if (file_sink_open(&sink, fp, &rw, 0, 0, wfd) != 0 || file_sink_decompress(&sink) != 0) {
+                printf("Cannot write %s: %s\n", c.filename, strerror(sink.error ? sink.error : ENOMEM));
+                file_sink_close(&sink);
+                recv_window_free(&rw);
+                continue;
+            }
+            file_sink_seek(&sink, get_offset);
+            if (resumed) printf("Resuming %s at byte %lld\n", c.filename, get_offset);
+            // ACK every packet until the server confirms the coalescing we asked for
+            ack_policy_default(&immediate);
+            ack_state_init(&as, &immediate);
+            stats_init(&st);
+            Packet ack;
+            int transfer_done = 0;
+
+            int write_failed = 0;
+            int replied = 0, heard = 0;
+            const char *refused = NULL;    // Why the server's answer does not fit the request
+            int restart = 0;               // The journal is of no use: the next get starts over
+            Journal journal;
+            memset(&journal, 0, sizeof(journal));
+            // A range or a resumed get takes nothing before the reply, which
+            // says whether the server sends from the offset asked. Until it
+            // comes (or, for other gets, anything does) the command is sent
+            // again every RTO_INITIAL_MS, as for a pget stream.
+            int need_reply = get_offset > 0 || get_length > 0;
+            uint64_t request_us = sent_us, last_rx_us = sent_us;
+            unsigned requests = 1;
+
+            while (!transfer_done) {
+                uint64_t now = now_us();
+                int asking = !replied && (need_reply || !heard);
+                if (now >= last_rx_us + STREAM_IDLE_MS * 1000ULL) {
+                    refused = "no answer from the server";
+                    break;
+                }
+                if (asking && now >= request_us + RTO_INITIAL_MS * 1000ULL) {
+                    if (heard && requests >= STREAM_REPLY_TRIES) {
+                        refused = "the server does not send ranges";
+                        restart = resumed;
+                        break;
+                    }
+                    send_packet(cfd, &send_addr, sizeof(send_addr), &pkt);
+                    request_us = now;
+                    requests++;
+                }
+
+                // Wait for data or the writer; flush a delayed ACK once its timer runs out
+                struct pollfd pfd[2] = {{cfd, POLLIN, 0}, {wfd, POLLIN, 0}};
+                struct timespec ts;
+                int64_t wait = (int64_t)(last_rx_us + STREAM_IDLE_MS * 1000ULL - now);
+                if (asking && (int64_t)(request_us + RTO_INITIAL_MS * 1000ULL - now) < wait) {
+                    wait = (int64_t)(request_us + RTO_INITIAL_MS * 1000ULL - now);
+                }
+                int64_t ack_wait = ack_wait_us(&as, now);
+                if (ack_wait == 0) {
+                    recv_window_build_ack(&rw, &ack);
+                    send_packet(cfd, &send_addr, sizeof(send_addr), &ack);
+                    ack_on_sent(&as);
+                    st.acks++;
+                    continue;
+                }
+                if (ack_wait > 0 && ack_wait < wait) wait = ack_wait;
+                ts.tv_sec = (time_t)(wait / 1000000);
+                ts.tv_nsec = (long)(wait % 1000000) * 1000;
+                int ready = ppoll(pfd, 2, &ts, NULL);
+                if (ready <= 0) continue;
+
+                if (pfd[1].revents & POLLIN) {
+                    uint64_t wakeups;
+                    if (read(wfd, &wakeups, sizeof(wakeups)) < 0) wakeups = 0;
+                    if (file_sink_progress(&sink) != 0) {
+                        write_failed = 1;
+                        break;
+                    }
+                    // The ring has drained: tell a sender stuck on a closed window
+                    if (file_sink_reopened(&sink)) {
+                        recv_window_build_ack(&rw, &ack);
+                        queue_packet(cfd, &send_addr, &ack, 0);
+                        ack_on_sent(&as);
+                        st.acks++;
+                    }
+                }
+
+                // Take every datagram that is already queued
+                unsigned n = pfd[0].revents & POLLIN ? recv_batch_fill(&rx, cfd, MSG_DONTWAIT) : 0;
+                for (unsigned i = 0; i < n && !transfer_done; i++) {
+                    Packet *in = rx.pkt[i];
+                    if (rx.len[i] < sizeof(PacketHeader) || in->header.data_len > DATA_SIZE) continue;
+
+                    uint32_t received_crc = in->header.checksum;
+                    in->header.checksum = 0;
+                    if (packet_crc(in) == received_crc && packet_in_conn(&in->header, conn_id, &conn_echoed)) {
+                        heard = 1;
+                        last_rx_us = now_us();
+                        // A repair packet stands in for the one packet of its group we miss
+                        Packet rebuilt;
+                        if (in->header.flags & FLAG_FEC) {
+                            st.fec_repairs++;
+                            if (!fec_rebuild(&rw, in, &rebuilt)) continue;
+                            st.fec_rebuilt++;
+                            in = &rebuilt;
+                        }
+                        if (in->header.flags & FLAG_DATA) {
+                            if (!replied && need_reply) continue;   // Sent again once the reply is in
+                            Packet *in_order;
+                            int clean = recv_window_in_order(&rw, in);
+                            clean &= recv_window_accept(&rw, in);
+                            st.data_packets++;
+                            while ((in_order = recv_window_next(&rw)) != NULL) {
+                                st.bytes += lz_raw_len(&in_order->header);
+                                printf("Received packet %d\n", in_order->header.seq_num);
+                            }
+                            if (file_sink_deliver(&sink) != 0) {
+                                write_failed = transfer_done = 1;
+                                break;
+                            }
+
+                            if (ack_on_data(&as, clean, recv_window_done(&rw), now_us())) {
+                                recv_window_build_ack(&rw, &ack);
+                                queue_packet(cfd, &send_addr, &ack, 0);
+                                ack_on_sent(&as);
+                                st.acks++;
+                            }
+
+                            if (recv_window_done(&rw)) {
+                                transfer_done = 1;
+                            }
+                        } else if ((in->header.flags & (FLAG_SYN | FLAG_ACK)) == (FLAG_SYN | FLAG_ACK)) {
+                            command_parse_reply(in, &c);
+                            as.policy = c.ack;
+                            csum = c.csum;
+                            printf("Server accepted: ACK every %u packets, %u ms delay, %s\n",
+                                   c.ack.every, c.ack.delay_us / 1000, csum == CSUM_CRC32C ? "CRC-32C" : "CRC-32");
+                            replied = 1;
+                            JournalId id = {c.size, c.mtime, c.etag, c.has_etag};
+                            if (c.offset != get_offset || c.length != get_length) {
+                                refused = "the server does not send ranges";
+                            } else if (resumed && !journal_same(&journal_id, &id)) {
+                                refused = "the file has changed on the server";
+                            }
+                            restart = refused && resumed;
+                            if (refused) {
+                                transfer_done = 1;
+                                break;
+                            }
+                            if (file_sink_reserve(&sink, c.size) != 0) {
+                                write_failed = transfer_done = 1;
+                                break;
+                            }
+                            // Whole-file gets keep a journal so they can resume
+                            if (!explicit_range && c.size > 0 &&
+                                journal_open(&journal, c.filename, &id, get_offset) == 0) {
+                                file_sink_journal(&sink, &journal);
+                            }
+                        }
+                    }
+                }
+                send_batch_flush(&tx);
+            }
+            send_batch_flush(&tx);
+
+            // The final ACK is out; wait for the writer before calling the file done
+            if (file_sink_close(&sink) != 0) write_failed = 1;
+            recv_window_free(&rw);
+            journal_close(&journal, !write_failed && !refused);
+            if (refused) {
+                if (restart) journal_remove(c.filename);
+                printf("Cannot get %s from byte %lld: %s%s\n", c.filename, get_offset, refused,
+                       restart ? "; get it again to start over" : "");
+                continue;
+            }
+            if (write_failed) {
+                printf("Cannot write %s: %s\n", c.filename, strerror(sink.error));
+                continue;
+            }
+            printf("File received successfully\n");
+            latency_record(&latency, (long long)st.bytes, now_us() - sent_us);
+            stats_print_receiver("", &st, &as.policy);
+            file_sink_print("", &sink);
+            udp_batch_print("", &tx, &rx);
+            udp_batch_reset_counters(&tx, &rx);
+
+        } else if (strcmp(c.cmd, "put") == 0) {
+            FILE *fp = delta ? delta : fopen(c.filename, "rb");
+            if (!fp) {
+                printf("File not found\n");
+                continue;
+            }
+
+            FileSource src;
+            int src_ok = file_source_open(&src, fp) == 0;
+            long filesize = src.size;
+            uint32_t total_packets = (filesize + DATA_SIZE - 1) / DATA_SIZE;
+
+            SendWindow sw;
+            RttEstimator rtt;
+            CongestionControl cc;
+            TransferStats st;
+            if (!src_ok || send_window_init(&sw, total_packets) != 0) {
+                printf("Cannot allocate send window\n");
+                file_source_close(&src);
+                continue;
+            }
+            rtt_init(&rtt);
+            rtt_set_ack_delay(&rtt, c.ack.delay_us);
+            cc_init(&cc);
+            stats_init(&st);
+            uint64_t timer_start = now_us();   // Retransmission timer, restarted when base advances
+            uint32_t seq;
+            FecEncoder fec;
+            int fec_on = 0;     // The server confirmed fec=xor
+            fec_encoder_init(&fec);
+            LzEncoder lz;       // lz.on once the server confirmed compress=lz4
+            int lz_ok = c.compress && lz_encoder_init(&lz) == 0;
+            if (!lz_ok) memset(&lz, 0, sizeof(lz));
+
+            while (sw.base <= total_packets) {
+                while (send_window_has_room(&sw, cc_window(&cc)) && send_window_next_lost(&sw, &seq)) {
+                    printf("Retransmitting packet %d\n", seq);
+                    queue_slot(cfd, &send_addr, send_window_slot(&sw, seq), &src);
+                    send_window_sent(&sw, seq, now_us());
+                    st.data_packets++;
+                    st.retransmits++;
+                }
+
+                while (send_window_can_send(&sw, cc_window(&cc))) {
+                    SendSlot *slot = send_window_slot(&sw, sw.next_seq);
+                    Packet *out = &slot->pkt;
+                    const char *fresh = NULL;   // Payload of a first transmission
+                    if (out->header.seq_num != sw.next_seq) {
+                        uint16_t len;
+                        const char *payload = file_source_payload(&src, (long)(sw.next_seq - 1) * DATA_SIZE, &len);
+                        if (!src.map) memcpy(out->data, payload, len);
+                        fresh = payload;
+
+                        out->header.seq_num = sw.next_seq;
+                        out->header.data_len = len;
+                        out->header.window_size = 0;
+                        out->header.flags = FLAG_DATA;
+                        if (sw.next_seq == total_packets) out->header.flags |= FLAG_FIN;
+                        if (lz.on && lz_encoder_pack(&lz, out, payload)) fresh = out->data;
+                    }
+                    printf("Sending packet %d\n", sw.next_seq);
+                    queue_slot(cfd, &send_addr, slot, &src);
+                    if (send_window_sent(&sw, sw.next_seq, now_us())) st.retransmits++;
+                    st.data_packets++;
+                    send_window_advance(&sw);
+                    if (fresh && fec_on && fec_encoder_add(&fec, &out->header, fresh)) {
+                        queue_packet(cfd, &send_addr, &fec.repair, 0);
+                        st.fec_repairs++;
+                    }
+                }
+                send_batch_flush(&tx);
+
+                fd_set readfds;
+                struct timeval tv;
+                uint64_t now = now_us();
+                uint64_t deadline = timer_start + rtt.rto_us;
+                uint64_t wait_us = deadline > now ? deadline - now : 0;
+                tv.tv_sec = (long)(wait_us / 1000000);
+                tv.tv_usec = (long)(wait_us % 1000000);
+
+                FD_ZERO(&readfds);
+                FD_SET(cfd, &readfds);
+
+                int activity = wait_us > 0 ? select(cfd + 1, &readfds, NULL, NULL, &tv) : 0;
+                if (activity > 0) {
+                    // Drain every ACK that is already queued
+                    unsigned n = recv_batch_fill(&rx, cfd, MSG_DONTWAIT);
+                    for (unsigned i = 0; i < n; i++) {
+                        Packet *ack_pkt = rx.pkt[i];
+                        if (rx.len[i] < sizeof(PacketHeader) || ack_pkt->header.data_len > DATA_SIZE) continue;
+
+                        uint32_t received_crc = ack_pkt->header.checksum;
+                        ack_pkt->header.checksum = 0;
+                        if (packet_crc(ack_pkt) == received_crc &&
+                            packet_in_conn(&ack_pkt->header, conn_id, &conn_echoed)) {
+                            // SYN | ACK only confirms the options requested above
+                            if ((ack_pkt->header.flags & (FLAG_ACK | FLAG_SYN)) == FLAG_ACK) {
+                                printf("Received ACK %d\n", ack_pkt->header.ack_num);
+                                uint32_t old_base = sw.base;
+                                uint32_t old_losses = sw.loss_events;
+                                int64_t rtt_us;
+                                st.acks++;
+                                uint32_t newly = send_window_on_ack(&sw, ack_pkt, now_us(), &rtt_us);
+                                if (fec_on) fec_encoder_on_ack(&fec, &ack_pkt->header, st.retransmits);
+                                if (rtt_us >= 0) {
+                                    rtt_sample(&rtt, (uint32_t)rtt_us);
+                                    cc_on_rtt(&cc, (uint32_t)rtt_us);
+                                }
+                                if (sw.loss_events != old_losses) cc_on_loss(&cc, &sw);
+                                cc_on_ack(&cc, &sw, newly, rtt.srtt_us, now_us());
+                                if (sw.base != old_base) timer_start = now_us();
+                            } else if (ack_pkt->header.flags & FLAG_ACK) {
+                                command_parse_reply(ack_pkt, &c);
+                                csum = c.csum;
+                                fec_on = c.fec;
+                                lz.on = c.compress && lz_ok;
+                                // The server kept an earlier attempt: send only the rest
+                                if (c.offset > 0 && c.offset < filesize && sw.base == 1) {
+                                    printf("Server has the first %lld bytes, resuming\n", c.offset);
+                                    send_window_skip(&sw, (uint32_t)(c.offset / DATA_SIZE) + 1);
+                                    timer_start = now_us();
+                                }
+                            }
+                        }
+                    }
+                } else if (activity == 0) {
+                    printf("Timeout, resending from %d (RTO %u ms)\n", sw.base, rtt.rto_us / 1000);
+                    st.timeouts++;
+                    rtt_backoff(&rtt);
+                    if (send_window_on_timeout(&sw)) cc_on_timeout(&cc, &sw);
+                    timer_start = now_us();
+                }
+            }
+            send_batch_flush(&tx);
+            file_source_close(&src);
+            printf("File sent successfully\n");
+            st.bytes = filesize - c.offset;
+            st.fec_rebuilt = fec.rebuilt;
+            stats_print_sender("", &st, &sw, &rtt, &cc);
+            lz_encoder_print("", &lz);
+            udp_batch_print("", &tx, &rx);
+            udp_batch_reset_counters(&tx, &rx);
+            send_window_free(&sw);
+            lz_encoder_free(&lz);
+
+        } else if (strcmp(c.cmd, "ls") == 0) {
+            addr_len = sizeof(from_addr);
+            int len = recvfrom(cfd, (char *)&pkt, sizeof(pkt), 0, (struct sockaddr *)&from_addr, &addr_len);
+            if (len > 0) {
+                printf("Files:\n%s\n", pkt.data);
+            }
+        } else if (strcmp(c.cmd, "stats") == 0) {
+            // Only the proxy keeps counters; anything else stays silent
+            struct pollfd pfd = {cfd, POLLIN, 0};
+            int len = poll(&pfd, 1, 1000) > 0 ? recv(cfd, (char *)&pkt, sizeof(pkt), 0) : 0;
+            if (len >= (int)sizeof(PacketHeader) && pkt.header.data_len <= len - (int)sizeof(PacketHeader)) {
+                printf("%.*s", pkt.header.data_len, pkt.data);
+            } else {
+                printf("No statistics from this server\n");
+            }
+        } else if (strcmp(c.cmd, "delete") == 0) {
+            addr_len = sizeof(from_addr);
+            int len = recvfrom(cfd, (char *)&pkt, sizeof(pkt), 0, (struct sockaddr *)&from_addr, &addr_len);
+            if (len > 0) {
+                int res = *(int*)pkt.data;
+                if (res == 1) printf("Deleted successfully\n");
+                else printf("Delete failed\n");
+            }
+        } else if (strcmp(c.cmd, "exit") == 0) {
+            break;
+        }
+    }
+
+    latency_print(&latency);
+    recv_batch_free(&rx);
+    close(wfd);
+    close(cfd);
+    return 0;
+}
@@ -16,43 +16,36 @@ Modified for Windows using Winsock2
 #include <time.h>
 
 #include "../common/protocol.h"
+#include "../common/sack.h"
+#include "../common/cc.h"
+#include "../common/command.h"
+#include "../common/crc32.h"
+#include "../common/filesrc.h"
+#include "../common/rtt.h"
+#include "../common/stats.h"
 
 #pragma comment(lib, "ws2_32.lib")
 
-static uint32_t crc32_table[256];
-
-void init_crc32() {
-    uint32_t polynomial = 0xEDB88320;
-    for (uint32_t i = 0; i < 256; i++) {
-        uint32_t c = i;
-        for (int j = 0; j < 8; j++) {
-            if (c & 1) {
-                c = polynomial ^ (c >> 1);
-            } else {
-                c >>= 1;
-            }
-        }
-        crc32_table[i] = c;
-    }
-}
-
-uint32_t calculate_crc32(const void *buf, size_t size) {
-    const uint8_t *p = (const uint8_t *)buf;
-    uint32_t crc = 0xFFFFFFFF;
-    for (size_t i = 0; i < size; i++) {
-        crc = crc32_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
-    }
-    return ~crc;
-}
-
 static void print_error(char *msg) {
     fprintf(stderr, "%s: %d\n", msg, WSAGetLastError());
     exit(EXIT_FAILURE);
 }
 
+static uint32_t conn_id;   // Connection ID of the current command, stamped on every packet
+static int conn_echoed;    // The server has echoed conn_id, so packets without it are strays
+static ChecksumType csum;  // Checksum we send with, CRC-32C once the server has accepted it
+
+// Random non-zero 24-bit ID so the server can tell our transfers apart
+static uint32_t new_conn_id(void) {
+    uint32_t id = ((uint32_t)rand() << 16 ^ (uint32_t)rand() << 4 ^ (uint32_t)now_us()) & 0xFFFFFF;
+    return id ? id : 1;
+}
+
 void send_packet(SOCKET sfd, struct sockaddr_in *addr, int addr_len, Packet *pkt) {
+    packet_set_conn_id(&pkt->header, conn_id);
+    if (csum == CSUM_CRC32C) pkt->header.flags |= FLAG_CRC32C;
     pkt->header.checksum = 0;
-    pkt->header.checksum = calculate_crc32(pkt, sizeof(PacketHeader) + pkt->header.data_len);
+    pkt->header.checksum = packet_crc(pkt);
     sendto(sfd, (char *)pkt, sizeof(PacketHeader) + pkt->header.data_len, 0, (struct sockaddr *)addr, addr_len);
 }
 
@@ -69,6 +62,7 @@ int main(int argc, char **argv) {
     }
 
     init_crc32();
+    srand((unsigned)time(NULL) ^ (unsigned)now_us());
 
     if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
         fprintf(stderr, "WSAStartup failed\n");
@@ -83,11 +77,15 @@ int main(int argc, char **argv) {
     if ((cfd = socket(AF_INET, SOCK_DGRAM, 0)) == INVALID_SOCKET)
         print_error("Client: socket");
 
+    int sock_buf = SOCKET_BUFFER_BYTES;
+    setsockopt(cfd, SOL_SOCKET, SO_RCVBUF, (char *)&sock_buf, sizeof(sock_buf));
+    setsockopt(cfd, SOL_SOCKET, SO_SNDBUF, (char *)&sock_buf, sizeof(sock_buf));
+
     printf("Akamai-Grade Client connected to %s:%s\n", argv[1], argv[2]);
 
     for (;;) {
         char cmd_input[200];
-        char cmd[10], flname[200];
+        Command c;
         
         printf("\n===== Menu =====\n");
         printf("  1.) get [file_name]\n");
@@ -100,139 +98,236 @@ int main(int argc, char **argv) {
         fgets(cmd_input, sizeof(cmd_input), stdin);
         cmd_input[strcspn(cmd_input, "\n")] = 0;
         
-        sscanf(cmd_input, "%s %s", cmd, flname);
+        command_parse(cmd_input, &c);
+        if (strcmp(c.cmd, "get") == 0 || strcmp(c.cmd, "put") == 0) {
+            command_add_default_options(&c, cmd_input, sizeof(cmd_input));
+        }
+        if (strcmp(c.cmd, "put") == 0) {
+            struct stat sb;
+            if (stat(c.filename, &sb) == 0) command_add_size(&c, cmd_input, sizeof(cmd_input), (long long)sb.st_size);
+        }
 
         // Send Command
+        conn_id = new_conn_id();
+        conn_echoed = 0;
+        csum = CSUM_CRC32;
         memset(&pkt, 0, sizeof(pkt));
         strcpy(pkt.data, cmd_input);
         pkt.header.data_len = strlen(cmd_input);
         pkt.header.flags = FLAG_SYN; // Command packet
         send_packet(cfd, &send_addr, sizeof(send_addr), &pkt);
 
-        if (strcmp(cmd, "get") == 0) {
-            FILE *fp = fopen(flname, "wb");
+        if (strcmp(c.cmd, "get") == 0) {
+            FILE *fp = fopen(c.filename, "wb");
             if (!fp) {
                 printf("Error opening file for writing\n");
                 continue;
             }
 
-            uint32_t expected_seq = 1;
+            RecvWindow rw;
+            AckState as;
+            AckPolicy immediate;
+            TransferStats st;
+            if (recv_window_init(&rw) != 0) {
+                printf("Cannot allocate receive window\n");
+                fclose(fp);
+                continue;
+            }
+            // ACK every packet until the server confirms the coalescing we asked for
+            ack_policy_default(&immediate);
+            ack_state_init(&as, &immediate);
+            stats_init(&st);
             Packet ack;
             int transfer_done = 0;
 
             while (!transfer_done) {
+                // Flush a delayed ACK once its timer runs out
+                int64_t ack_wait = ack_wait_us(&as, now_us());
+                if (ack_wait >= 0) {
+                    fd_set readfds;
+                    struct timeval tv;
+                    tv.tv_sec = (long)(ack_wait / 1000000);
+                    tv.tv_usec = (long)(ack_wait % 1000000);
+                    FD_ZERO(&readfds);
+                    FD_SET(cfd, &readfds);
+                    if (ack_wait == 0 || select(0, &readfds, NULL, NULL, &tv) == 0) {
+                        recv_window_build_ack(&rw, &ack);
+                        send_packet(cfd, &send_addr, sizeof(send_addr), &ack);
+                        ack_on_sent(&as);
+                        st.acks++;
+                        continue;
+                    }
+                }
+
                 addr_len = sizeof(from_addr);
                 int len = recvfrom(cfd, (char *)&pkt, sizeof(pkt), 0, (struct sockaddr *)&from_addr, &addr_len);
                 
                 if (len > 0) {
                     uint32_t received_crc = pkt.header.checksum;
                     pkt.header.checksum = 0;
-                    if (calculate_crc32(&pkt, sizeof(PacketHeader) + pkt.header.data_len) == received_crc) {
+                    if (packet_crc(&pkt) == received_crc &&
+                        packet_in_conn(&pkt.header, conn_id, &conn_echoed)) {
                         if (pkt.header.flags & FLAG_DATA) {
-                            if (pkt.header.seq_num == expected_seq) {
-                                fwrite(pkt.data, 1, pkt.header.data_len, fp);
-                                printf("Received packet %d\n", expected_seq);
-                                
-                                ack.header.seq_num = 0;
-                                ack.header.ack_num = expected_seq;
-                                ack.header.flags = FLAG_ACK;
-                                ack.header.data_len = 0;
-                                send_packet(cfd, &send_addr, sizeof(send_addr), &ack);
-                                
-                                if (pkt.header.flags & FLAG_FIN) {
-                                    transfer_done = 1;
-                                }
-                                expected_seq++;
-                            } else if (pkt.header.seq_num < expected_seq) {
-                                ack.header.seq_num = 0;
-                                ack.header.ack_num = pkt.header.seq_num;
-                                ack.header.flags = FLAG_ACK;
-                                ack.header.data_len = 0;
+                            Packet *in_order;
+                            int clean = recv_window_in_order(&rw, &pkt);
+                            clean &= recv_window_accept(&rw, &pkt);
+                            st.data_packets++;
+                            while ((in_order = recv_window_next(&rw)) != NULL) {
+                                fwrite(in_order->data, 1, in_order->header.data_len, fp);
+                                st.bytes += in_order->header.data_len;
+                                printf("Received packet %d\n", in_order->header.seq_num);
+                            }
+
+                            if (ack_on_data(&as, clean, recv_window_done(&rw), now_us())) {
+                                recv_window_build_ack(&rw, &ack);
                                 send_packet(cfd, &send_addr, sizeof(send_addr), &ack);
+                                ack_on_sent(&as);
+                                st.acks++;
+                            }
+
+                            if (recv_window_done(&rw)) {
+                                transfer_done = 1;
                             }
+                        } else if ((pkt.header.flags & (FLAG_SYN | FLAG_ACK)) == (FLAG_SYN | FLAG_ACK)) {
+                            command_parse_reply(&pkt, &c);
+                            as.policy = c.ack;
+                            csum = c.csum;
+                            printf("Server accepted: ACK every %u packets, %u ms delay, %s\n",
+                                   c.ack.every, c.ack.delay_us / 1000, csum == CSUM_CRC32C ? "CRC-32C" : "CRC-32");
                         }
                     }
                 }
             }
+            recv_window_free(&rw);
             fclose(fp);
             printf("File received successfully\n");
+            stats_print_receiver("", &st, &as.policy);
 
-        } else if (strcmp(cmd, "put") == 0) {
-            FILE *fp = fopen(flname, "rb");
+        } else if (strcmp(c.cmd, "put") == 0) {
+            FILE *fp = fopen(c.filename, "rb");
             if (!fp) {
                 printf("File not found\n");
                 continue;
             }
 
-            fseek(fp, 0, SEEK_END);
-            long filesize = ftell(fp);
-            fseek(fp, 0, SEEK_SET);
+            FileSource src;
+            int src_ok = file_source_open(&src, fp) == 0;
+            long filesize = src.size;
             uint32_t total_packets = (filesize + DATA_SIZE - 1) / DATA_SIZE;
 
-            uint32_t base = 1;
-            uint32_t next_seq_num = 1;
-            Packet window[MAX_WINDOW_SIZE];
-            int window_valid[MAX_WINDOW_SIZE] = {0};
-
-            while (base <= total_packets) {
-                while (next_seq_num < base + MAX_WINDOW_SIZE && next_seq_num <= total_packets) {
-                    int idx = next_seq_num % MAX_WINDOW_SIZE;
-                    if (!window_valid[idx] || window[idx].header.seq_num != next_seq_num) {
-                        long offset = (next_seq_num - 1) * DATA_SIZE;
-                        fseek(fp, offset, SEEK_SET);
-                        int bytes_read = fread(window[idx].data, 1, DATA_SIZE, fp);
+            SendWindow sw;
+            RttEstimator rtt;
+            CongestionControl cc;
+            TransferStats st;
+            if (!src_ok || send_window_init(&sw, total_packets) != 0) {
+                printf("Cannot allocate send window\n");
+                file_source_close(&src);
+                continue;
+            }
+            rtt_init(&rtt);
+            rtt_set_ack_delay(&rtt, c.ack.delay_us);
+            cc_init(&cc);
+            stats_init(&st);
+            uint64_t timer_start = now_us();   // Retransmission timer, restarted when base advances
+            uint32_t seq;
+
+            while (sw.base <= total_packets) {
+                while (send_window_has_room(&sw, cc_window(&cc)) && send_window_next_lost(&sw, &seq)) {
+                    printf("Retransmitting packet %d\n", seq);
+                    send_packet(cfd, &send_addr, sizeof(send_addr), &send_window_slot(&sw, seq)->pkt);
+                    send_window_sent(&sw, seq, now_us());
+                    st.data_packets++;
+                    st.retransmits++;
+                }
+
+                while (send_window_can_send(&sw, cc_window(&cc))) {
+                    Packet *out = &send_window_slot(&sw, sw.next_seq)->pkt;
+                    if (out->header.seq_num != sw.next_seq) {
+                        uint16_t bytes_read;
+                        const char *payload = file_source_payload(&src, (long)(sw.next_seq - 1) * DATA_SIZE, &bytes_read);
+                        memcpy(out->data, payload, bytes_read);
                         
-                        window[idx].header.seq_num = next_seq_num;
-                        window[idx].header.data_len = bytes_read;
-                        window[idx].header.flags = FLAG_DATA;
-                        if (next_seq_num == total_packets) window[idx].header.flags |= FLAG_FIN;
-                        window_valid[idx] = 1;
+                        out->header.seq_num = sw.next_seq;
+                        out->header.data_len = bytes_read;
+                        out->header.flags = FLAG_DATA;
+                        if (sw.next_seq == total_packets) out->header.flags |= FLAG_FIN;
                     }
-                    printf("Sending packet %d\n", next_seq_num);
-                    send_packet(cfd, &send_addr, sizeof(send_addr), &window[idx]);
-                    next_seq_num++;
+                    printf("Sending packet %d\n", sw.next_seq);
+                    send_packet(cfd, &send_addr, sizeof(send_addr), out);
+                    if (send_window_sent(&sw, sw.next_seq, now_us())) st.retransmits++;
+                    st.data_packets++;
+                    send_window_advance(&sw);
                 }
 
                 Packet ack_pkt;
                 fd_set readfds;
                 struct timeval tv;
-                tv.tv_sec = 0;
-                tv.tv_usec = 100000;
+                uint64_t now = now_us();
+                uint64_t deadline = timer_start + rtt.rto_us;
+                uint64_t wait_us = deadline > now ? deadline - now : 0;
+                tv.tv_sec = (long)(wait_us / 1000000);
+                tv.tv_usec = (long)(wait_us % 1000000);
 
                 FD_ZERO(&readfds);
                 FD_SET(cfd, &readfds);
 
-                int activity = select(0, &readfds, NULL, NULL, &tv);
+                int activity = wait_us > 0 ? select(0, &readfds, NULL, NULL, &tv) : 0;
                 if (activity > 0) {
                     addr_len = sizeof(from_addr);
                     int len = recvfrom(cfd, (char *)&ack_pkt, sizeof(ack_pkt), 0, (struct sockaddr *)&from_addr, &addr_len);
                     if (len > 0) {
                         uint32_t received_crc = ack_pkt.header.checksum;
                         ack_pkt.header.checksum = 0;
-                        if (calculate_crc32(&ack_pkt, sizeof(PacketHeader) + ack_pkt.header.data_len) == received_crc) {
-                            if (ack_pkt.header.flags & FLAG_ACK) {
+                        if (packet_crc(&ack_pkt) == received_crc &&
+                            packet_in_conn(&ack_pkt.header, conn_id, &conn_echoed)) {
+                            // SYN | ACK only confirms the options requested above
+                            if ((ack_pkt.header.flags & (FLAG_ACK | FLAG_SYN)) == FLAG_ACK) {
                                 printf("Received ACK %d\n", ack_pkt.header.ack_num);
-                                if (ack_pkt.header.ack_num >= base) {
-                                    base = ack_pkt.header.ack_num + 1;
+                                uint32_t old_base = sw.base;
+                                uint32_t old_losses = sw.loss_events;
+                                int64_t rtt_us;
+                                st.acks++;
+                                uint32_t newly = send_window_on_ack(&sw, &ack_pkt, now_us(), &rtt_us);
+                                if (rtt_us >= 0) {
+                                    rtt_sample(&rtt, (uint32_t)rtt_us);
+                                    cc_on_rtt(&cc, (uint32_t)rtt_us);
+                                }
+                                if (sw.loss_events != old_losses) cc_on_loss(&cc, &sw);
+                                cc_on_ack(&cc, &sw, newly, rtt.srtt_us, now_us());
+                                if (sw.base != old_base) timer_start = now_us();
+                            } else if (ack_pkt.header.flags & FLAG_ACK) {
+                                command_parse_reply(&ack_pkt, &c);
+                                csum = c.csum;
+                                // The server kept an earlier attempt: send only the rest
+                                if (c.offset > 0 && c.offset < filesize && sw.base == 1) {
+                                    printf("Server has the first %lld bytes, resuming\n", c.offset);
+                                    send_window_skip(&sw, (uint32_t)(c.offset / DATA_SIZE) + 1);
+                                    timer_start = now_us();
                                 }
                             }
                         }
                     }
-                } else {
-                    printf("Timeout, resending from %d\n", base);
-                    next_seq_num = base;
+                } else if (activity == 0) {
+                    printf("Timeout, resending from %d (RTO %u ms)\n", sw.base, rtt.rto_us / 1000);
+                    st.timeouts++;
+                    rtt_backoff(&rtt);
+                    if (send_window_on_timeout(&sw)) cc_on_timeout(&cc, &sw);
+                    timer_start = now_us();
                 }
             }
-            fclose(fp);
+            file_source_close(&src);
             printf("File sent successfully\n");
+            st.bytes = filesize - c.offset;
+            stats_print_sender("", &st, &sw, &rtt, &cc);
+            send_window_free(&sw);
 
-        } else if (strcmp(cmd, "ls") == 0) {
+        } else if (strcmp(c.cmd, "ls") == 0) {
             addr_len = sizeof(from_addr);
             int len = recvfrom(cfd, (char *)&pkt, sizeof(pkt), 0, (struct sockaddr *)&from_addr, &addr_len);
             if (len > 0) {
                 printf("Files:\n%s\n", pkt.data);
             }
-        } else if (strcmp(cmd, "delete") == 0) {
+        } else if (strcmp(c.cmd, "delete") == 0) {
             addr_len = sizeof(from_addr);
             int len = recvfrom(cfd, (char *)&pkt, sizeof(pkt), 0, (struct sockaddr *)&from_addr, &addr_len);
             if (len > 0) {
@@ -240,7 +335,7 @@ int main(int argc, char **argv) {
                 if (res == 1) printf("Deleted successfully\n");
                 else printf("Delete failed\n");
             }
-        } else if (strcmp(cmd, "exit") == 0) {
+        } else if (strcmp(c.cmd, "exit") == 0) {
             break;
         }
     }
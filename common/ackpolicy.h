@@ -0,0 +1,67 @@
+#ifndef ACKPOLICY_H
+#define ACKPOLICY_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+// Receiver-side ACK coalescing. In-order data is acknowledged every `every`
+// packets or when the delayed-ACK timer (`delay_us`) expires, whichever comes
+// first. Anything unusual is acknowledged at once: out-of-order or duplicate
+// packets, packets that fill a hole, and the packet that completes the
+// transfer. The policy is requested by the client in the command packet and
+// confirmed by the server (see command.h); the defaults ACK every packet,
+// which is what legacy peers expect.
+
+typedef struct {
+    uint32_t every;         // In-order packets per ACK, 1..ACK_EVERY_MAX
+    uint32_t delay_us;      // Longest an in-order packet waits for its ACK
+} AckPolicy;
+
+typedef struct {
+    AckPolicy policy;
+    uint32_t  pending;      // In-order packets not yet acknowledged
+    uint64_t  deadline_us;  // Delayed-ACK timer, 0 when idle
+} AckState;
+
+static inline void ack_policy_default(AckPolicy *p) {
+    p->every = 1;
+    p->delay_us = 0;
+}
+
+// Bounds both sides apply to a requested policy
+static inline void ack_policy_clamp(AckPolicy *p) {
+    if (p->every < 1) p->every = 1;
+    if (p->every > ACK_EVERY_MAX) p->every = ACK_EVERY_MAX;
+    if (p->delay_us > ACK_DELAY_MAX_MS * 1000) p->delay_us = ACK_DELAY_MAX_MS * 1000;
+    if (p->delay_us == 0) p->every = 1;
+}
+
+static inline void ack_state_init(AckState *as, const AckPolicy *policy) {
+    as->policy = *policy;
+    as->pending = 0;
+    as->deadline_us = 0;
+}
+
+// Called for every data packet. `clean` means it was new, in order and left
+// nothing buffered out of order; `done` means it completed the transfer.
+// Returns 1 if an ACK should be sent now.
+static inline int ack_on_data(AckState *as, int clean, int done, uint64_t now) {
+    if (!clean || done) return 1;
+    if (++as->pending >= as->policy.every) return 1;
+    if (as->deadline_us == 0) as->deadline_us = now + as->policy.delay_us;
+    return 0;
+}
+
+static inline void ack_on_sent(AckState *as) {
+    as->pending = 0;
+    as->deadline_us = 0;
+}
+
+// Microseconds until the delayed ACK is due, or -1 if none is pending
+static inline int64_t ack_wait_us(const AckState *as, uint64_t now) {
+    if (as->deadline_us == 0) return -1;
+    return as->deadline_us > now ? (int64_t)(as->deadline_us - now) : 0;
+}
+
+#endif // ACKPOLICY_H
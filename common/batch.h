@@ -0,0 +1,64 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "protocol.h"
+
+// Batched gets of small files (Linux). "mget a,b,c" asks for up to
+// BATCH_MAX_FILES files at once, and the server answers without a session:
+// it packs the files into as few DATA packets as it can, one BatchRecord
+// per file, each followed by its bytes. A file never spans packets; one that
+// does not fit a packet on its own comes back as BATCH_TOO_LARGE, for the
+// client to get on its own. Packets carry seq_num 1..n and n in ack_num,
+// with FLAG_FIN on the last.
+//
+// Nothing is acknowledged or retransmitted by the server. The client asks
+// again for what is missing after BATCH_REPLY_MS, under a new connection ID
+// so that late packets of the earlier answer are dropped, and gets the files
+// one by one from a server that never answers.
+//
+// Record fields are in host byte order; batches are between Linux programs.
+
+#define BATCH_MAX_FILES 32
+#define BATCH_REPLY_MS 200
+#define BATCH_TRIES 3
+
+enum {
+    BATCH_OK,                   // len bytes of the file follow
+    BATCH_NOT_FOUND,
+    BATCH_TOO_LARGE             // len is 0: get the file on its own
+};
+
+typedef struct {
+    uint8_t  index;             // Position of the file in the request
+    uint8_t  status;
+    uint16_t len;
+} BatchRecord;
+
+// Largest file that fits a packet of its own
+#define BATCH_FILE_MAX (DATA_SIZE - (int)sizeof(BatchRecord))
+
+// Appends a record and its bytes to pkt. Returns 0, or -1 if they do not fit.
+static inline int batch_add(Packet *pkt, uint8_t index, uint8_t status, const void *data, uint16_t len) {
+    BatchRecord r = {index, status, len};
+    if (pkt->header.data_len + sizeof(r) + len > DATA_SIZE) return -1;
+    memcpy(pkt->data + pkt->header.data_len, &r, sizeof(r));
+    if (len) memcpy(pkt->data + pkt->header.data_len + sizeof(r), data, len);
+    pkt->header.data_len += (uint16_t)(sizeof(r) + len);
+    return 0;
+}
+
+// Steps through the records of a received packet: *pos starts at 0. Returns
+// a pointer to the record's bytes, or NULL at the end or at a malformed one.
+static inline const char *batch_next(const Packet *pkt, uint16_t *pos, BatchRecord *r) {
+    if (*pos + sizeof(*r) > pkt->header.data_len) return NULL;
+    memcpy(r, pkt->data + *pos, sizeof(*r));
+    const char *data = pkt->data + *pos + sizeof(*r);
+    if (*pos + sizeof(*r) + r->len > pkt->header.data_len) return NULL;
+    *pos += (uint16_t)(sizeof(*r) + r->len);
+    return data;
+}
+
+#endif // BATCH_H
@@ -0,0 +1,134 @@
+#ifndef CC_H
+#define CC_H
+
+#include <math.h>
+#include <stdint.h>
+
+#include "protocol.h"
+#include "sack.h"
+
+// Congestion control for the sliding-window senders: slow start with a
+// HyStart-style delay exit, then CUBIC (RFC 8312) growth in congestion
+// avoidance. The window is counted in packets and bounded by MAX_WINDOW_SIZE.
+//
+// A loss event is a hole marked lost by SACK evidence. Only the first one per
+// window reduces cwnd (multiplicative decrease by CUBIC_BETA); later holes
+// below the recovery point belong to the same event. A retransmission timeout
+// collapses cwnd to one packet and restarts slow start.
+
+#define CUBIC_C    0.4
+#define CUBIC_BETA 0.7
+#define HYSTART_MIN_CWND 16     // Do not leave slow start on delay below this window
+#define HYSTART_MIN_ETA_US 4000
+#define HYSTART_MAX_ETA_US 16000
+
+typedef struct {
+    double   cwnd;              // Congestion window, packets
+    double   ssthresh;          // Slow-start threshold, packets
+    double   w_max;             // Window just before the last reduction
+    double   w_est;             // Reno-equivalent window for the TCP-friendly region
+    double   k;                 // Seconds for the cubic to regrow to w_max
+    uint64_t epoch_us;          // Start of the current avoidance epoch, 0 if none
+    uint32_t recovery_seq;      // Losses at or below this seq are the same event
+    int      in_recovery;       // Repairing a SACK-detected loss, cwnd frozen
+    uint32_t min_rtt_us;        // Lowest RTT seen, 0 until sampled
+    uint32_t loss_events;       // Reductions triggered by SACK loss detection
+} CongestionControl;
+
+static inline void cc_init(CongestionControl *cc) {
+    cc->cwnd = INITIAL_CWND;
+    cc->ssthresh = MAX_WINDOW_SIZE;
+    cc->w_max = 0;
+    cc->w_est = 0;
+    cc->k = 0;
+    cc->epoch_us = 0;
+    cc->recovery_seq = 0;
+    cc->in_recovery = 0;
+    cc->min_rtt_us = 0;
+    cc->loss_events = 0;
+}
+
+// Packets the sender may keep in flight
+static inline uint32_t cc_window(const CongestionControl *cc) {
+    return cc->cwnd < 1 ? 1 : (uint32_t)cc->cwnd;
+}
+
+// HyStart delay increase: leave slow start once queues start building.
+static inline void cc_on_rtt(CongestionControl *cc, uint32_t rtt_us) {
+    if (cc->min_rtt_us == 0 || rtt_us < cc->min_rtt_us) cc->min_rtt_us = rtt_us;
+    if (cc->cwnd >= cc->ssthresh || cc->cwnd < HYSTART_MIN_CWND) return;
+
+    uint32_t eta = cc->min_rtt_us / 8;
+    if (eta < HYSTART_MIN_ETA_US) eta = HYSTART_MIN_ETA_US;
+    if (eta > HYSTART_MAX_ETA_US) eta = HYSTART_MAX_ETA_US;
+    if (rtt_us > cc->min_rtt_us + eta) cc->ssthresh = cc->cwnd;
+}
+
+static inline void cc_on_ack(CongestionControl *cc, const SendWindow *sw, uint32_t newly_acked,
+                             uint32_t srtt_us, uint64_t now) {
+    if (newly_acked == 0) return;
+    if (cc->in_recovery) {
+        if (sw->base <= cc->recovery_seq) return;   // No growth while repairing a loss
+        cc->in_recovery = 0;
+    }
+
+    if (cc->cwnd < cc->ssthresh) {
+        cc->cwnd += newly_acked;
+        if (cc->cwnd > cc->ssthresh) cc->cwnd = cc->ssthresh;
+    } else {
+        if (cc->epoch_us == 0) {
+            cc->epoch_us = now;
+            if (cc->cwnd < cc->w_max) {
+                cc->k = cbrt((cc->w_max - cc->cwnd) / CUBIC_C);
+            } else {
+                cc->k = 0;
+                cc->w_max = cc->cwnd;
+            }
+            cc->w_est = cc->cwnd;
+        }
+
+        double t = (now - cc->epoch_us + srtt_us) / 1e6;
+        double target = CUBIC_C * (t - cc->k) * (t - cc->k) * (t - cc->k) + cc->w_max;
+        if (target > cc->cwnd * 1.5) target = cc->cwnd * 1.5;
+
+        cc->w_est += newly_acked * (3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA)) / cc->cwnd;
+        if (target > cc->cwnd) {
+            cc->cwnd += newly_acked * (target - cc->cwnd) / cc->cwnd;
+        } else {
+            cc->cwnd += newly_acked * 0.01 / cc->cwnd;
+        }
+        if (cc->w_est > cc->cwnd) cc->cwnd = cc->w_est;
+    }
+    if (cc->cwnd > MAX_WINDOW_SIZE) cc->cwnd = MAX_WINDOW_SIZE;
+}
+
+static inline void cc_reduce(CongestionControl *cc) {
+    // Fast convergence: release bandwidth sooner when the window keeps shrinking
+    if (cc->cwnd < cc->w_max) {
+        cc->w_max = cc->cwnd * (1 + CUBIC_BETA) / 2;
+    } else {
+        cc->w_max = cc->cwnd;
+    }
+    cc->ssthresh = cc->cwnd * CUBIC_BETA;
+    if (cc->ssthresh < 2) cc->ssthresh = 2;
+    cc->epoch_us = 0;
+}
+
+// SACK loss detection marked new holes lost.
+static inline void cc_on_loss(CongestionControl *cc, const SendWindow *sw) {
+    if (sw->base <= cc->recovery_seq) return;
+    cc_reduce(cc);
+    cc->cwnd = cc->ssthresh;
+    cc->recovery_seq = sw->high_water - 1;
+    cc->in_recovery = 1;
+    cc->loss_events++;
+}
+
+static inline void cc_on_timeout(CongestionControl *cc, const SendWindow *sw) {
+    cc_reduce(cc);
+    cc->cwnd = 1;
+    cc->recovery_seq = sw->high_water - 1;
+    cc->in_recovery = 0;
+}
+
+#endif // CC_H
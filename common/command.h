@@ -0,0 +1,347 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ackpolicy.h"
+#include "protocol.h"
+
+#define COMMAND_MAX_PARTS 64    // Largest N accepted in range=K/N
+
+// Command packets (FLAG_SYN) carry "<cmd> [filename] [key=value ...]". Legacy
+// servers only read the first two words, so options are ignored by them. A
+// server that understands options answers a command that carried any with a
+// FLAG_SYN | FLAG_ACK packet listing the values it accepted, in the same
+// key=value form. Known options:
+//
+//   acks=N      ACK every N in-order packets (ackpolicy.h)
+//   ackdelay=MS delayed-ACK timer in milliseconds
+//   csum=crc32c checksum packets with CRC-32C (crc32.h)
+//   size=N      length of the file about to be sent: a put announces it, the
+//               reply to a get carries it (receivers preallocate, filesink.h)
+//   range=K/N   get only part K of N of the file (command_part_range); the
+//               reply echoes it, and size= stays the size of the whole file
+//   offset=N    get: start at byte N (with length=N, 0 = to the end), echoed
+//   length=N    in the reply. put: only in the reply, the receiver already
+//               has the first N bytes (journal.h) and the sender skips them
+//   fec=xor     the receiver rebuilds lost packets from XOR repair packets
+//               (fec.h); echoed by servers that send and take them
+//   compress=lz4  the sender may compress payloads (lz.h); echoed by servers
+//               that do it and decompress
+//   delta=rsync put: the data is a delta against the server's copy (delta.h),
+//               fetched with "sig <file>"; echoed
+//   etag=HEX    get: the CRC-32C of the copy the client holds, so the file is
+//               sent only if it changed; etag=? just asks for it. The reply
+//               carries the etag= and mtime= of the server's file, and if it
+//               matches, unchanged=1 and nothing else: the reply is the answer.
+//               put: the CRC-32C of the data sent, so that a broken-off put
+//               resumes only into the same data (journal.h)
+//   mtime=N     reply to a get: modification time of the file, Unix seconds.
+//               put: that of the file being sent
+//   unchanged=1 reply to a get with etag=: the client's copy is current
+
+typedef struct {
+    char      cmd[10];
+    char      filename[200];
+    int       has_options;  // At least one key=value token was present
+    AckPolicy ack;
+    ChecksumType csum;
+    long long size;         // Announced file size, 0 if unknown
+    unsigned  part;         // range=part/parts, parts = 0 for the whole file
+    unsigned  parts;
+    long long offset;       // offset=, 0 = from the start
+    long long length;       // length=, 0 = to the end
+    int       fec;          // fec=xor
+    int       compress;     // compress=lz4
+    int       delta;        // delta=rsync
+    int       want_etag;    // etag= present, with a value or ?
+    int       has_etag;     // etag holds one
+    uint32_t  etag;         // CRC-32C of the whole file (crc32c_stream)
+    long long mtime;        // mtime=, 0 if not told
+    int       unchanged;    // unchanged=1
+} Command;
+
+// Byte range of part `part` of `parts` of a file, cut at packet boundaries
+// so that every packet but the last of the file is full. Parts can be empty
+// when the file has fewer packets than parts.
+static inline void command_part_range(long long size, unsigned part, unsigned parts, long long *offset,
+                                      long long *length) {
+    long long packets = (size + DATA_SIZE - 1) / DATA_SIZE;
+    if (parts == 0 || part >= parts) {
+        *offset = 0;
+        *length = size;
+        return;
+    }
+    long long first = packets * part / parts * DATA_SIZE;
+    long long end = packets * (part + 1) / parts * DATA_SIZE;
+    *offset = first < size ? first : size;
+    *length = (end < size ? end : size) - *offset;
+}
+
+// Applies one key=value token. Unknown keys are ignored.
+static inline void command_apply_option(Command *c, const char *key, const char *value) {
+    if (strcmp(key, "acks") == 0) {
+        c->ack.every = (uint32_t)strtoul(value, NULL, 10);
+    } else if (strcmp(key, "ackdelay") == 0) {
+        c->ack.delay_us = (uint32_t)strtoul(value, NULL, 10) * 1000;
+    } else if (strcmp(key, "csum") == 0) {
+        c->csum = strcmp(value, "crc32c") == 0 ? CSUM_CRC32C : CSUM_CRC32;
+    } else if (strcmp(key, "size") == 0) {
+        c->size = strtoll(value, NULL, 10);
+    } else if (strcmp(key, "offset") == 0) {
+        c->offset = strtoll(value, NULL, 10);
+        if (c->offset < 0) c->offset = 0;
+    } else if (strcmp(key, "length") == 0) {
+        c->length = strtoll(value, NULL, 10);
+        if (c->length < 0) c->length = 0;
+    } else if (strcmp(key, "fec") == 0) {
+        c->fec = strcmp(value, "xor") == 0;
+    } else if (strcmp(key, "compress") == 0) {
+        c->compress = strcmp(value, "lz4") == 0;
+    } else if (strcmp(key, "delta") == 0) {
+        c->delta = strcmp(value, "rsync") == 0;
+    } else if (strcmp(key, "etag") == 0) {
+        char *end;
+        c->etag = (uint32_t)strtoul(value, &end, 16);
+        c->has_etag = end != value && *end == '\0';
+        c->want_etag = 1;
+    } else if (strcmp(key, "mtime") == 0) {
+        c->mtime = strtoll(value, NULL, 10);
+    } else if (strcmp(key, "unchanged") == 0) {
+        c->unchanged = strcmp(value, "1") == 0;
+    } else if (strcmp(key, "range") == 0) {
+        if (sscanf(value, "%u/%u", &c->part, &c->parts) != 2 || c->part >= c->parts ||
+            c->parts > COMMAND_MAX_PARTS) {
+            c->part = c->parts = 0;
+        }
+    } else {
+        return;
+    }
+    c->has_options = 1;
+}
+
+// Applies the key=value tokens of text; other words are skipped.
+static inline void command_parse_options(const char *text, Command *c) {
+    char token[256];
+    int n = 0, pos = 0;
+
+    while (sscanf(text + pos, "%255s%n", token, &n) == 1) {
+        char *eq = strchr(token, '=');
+        pos += n;
+        if (eq) {
+            *eq = '\0';
+            command_apply_option(c, token, eq + 1);
+        }
+    }
+    ack_policy_clamp(&c->ack);
+}
+
+// Parses the text of a command packet. The text must be NUL-terminated. The
+// second word is always the filename, '=' or not; options follow it.
+static inline void command_parse(const char *text, Command *c) {
+    char token[256];
+    int n = 0, pos = 0;
+
+    memset(c, 0, sizeof(*c));
+    ack_policy_default(&c->ack);
+
+    if (sscanf(text, "%255s%n", token, &n) == 1) {
+        sscanf(token, "%9s", c->cmd);
+        pos = n;
+        if (sscanf(text + pos, "%255s%n", token, &n) == 1) {
+            sscanf(token, "%199s", c->filename);
+            pos += n;
+        }
+    }
+    command_parse_options(text + pos, c);
+}
+
+// Formats the negotiated options as key=value tokens.
+static inline int command_format_options(const Command *c, char *out, size_t len) {
+    int used = snprintf(out, len, "acks=%u ackdelay=%u%s", c->ack.every, c->ack.delay_us / 1000,
+                        c->csum == CSUM_CRC32C ? " csum=crc32c" : "");
+    if (c->size > 0 && used >= 0 && (size_t)used < len) {
+        used += snprintf(out + used, len - used, " size=%lld", c->size);
+    }
+    if (c->parts > 0 && used >= 0 && (size_t)used < len) {
+        used += snprintf(out + used, len - used, " range=%u/%u", c->part, c->parts);
+    }
+    if (c->offset > 0 && used >= 0 && (size_t)used < len) {
+        used += snprintf(out + used, len - used, " offset=%lld", c->offset);
+    }
+    if (c->length > 0 && used >= 0 && (size_t)used < len) {
+        used += snprintf(out + used, len - used, " length=%lld", c->length);
+    }
+    if (c->fec && used >= 0 && (size_t)used < len) {
+        used += snprintf(out + used, len - used, " fec=xor");
+    }
+    if (c->compress && used >= 0 && (size_t)used < len) {
+        used += snprintf(out + used, len - used, " compress=lz4");
+    }
+    if (c->delta && used >= 0 && (size_t)used < len) {
+        used += snprintf(out + used, len - used, " delta=rsync");
+    }
+    if (c->has_etag && used >= 0 && (size_t)used < len) {
+        used += snprintf(out + used, len - used, " etag=%08x", c->etag);
+    }
+    if (c->mtime > 0 && used >= 0 && (size_t)used < len) {
+        used += snprintf(out + used, len - used, " mtime=%lld", c->mtime);
+    }
+    if (c->unchanged && used >= 0 && (size_t)used < len) {
+        used += snprintf(out + used, len - used, " unchanged=1");
+    }
+    return used;
+}
+
+// Appends the default option request to a command typed without options
+static inline void command_add_default_options(Command *c, char *text, size_t size) {
+    size_t used = strlen(text);
+    if (c->has_options || used + 1 >= size) return;
+
+    c->ack.every = ACK_EVERY_REQUEST;
+    c->ack.delay_us = ACK_DELAY_REQUEST_MS * 1000;
+    ack_policy_clamp(&c->ack);
+    c->csum = CSUM_CRC32C;
+    c->has_options = 1;
+    text[used] = ' ';
+    command_format_options(c, text + used + 1, size - used - 1);
+}
+
+// Announces the length of the file a put is about to send
+static inline void command_add_size(Command *c, char *text, size_t size, long long bytes) {
+    size_t used = strlen(text);
+    if (bytes <= 0 || used + 1 >= size) return;
+    snprintf(text + used, size - used, " size=%lld", bytes);
+    c->size = bytes;
+}
+
+// Asks for part `part` of `parts` of the file (command_part_range)
+static inline void command_add_range(Command *c, char *text, size_t size, unsigned part, unsigned parts) {
+    size_t used = strlen(text);
+    if (parts == 0 || part >= parts || used + 1 >= size) return;
+    snprintf(text + used, size - used, " range=%u/%u", part, parts);
+    c->part = part;
+    c->parts = parts;
+    c->has_options = 1;
+}
+
+// Asks for length bytes (0 = the rest) of the file from offset
+static inline void command_add_offset(Command *c, char *text, size_t size, long long offset, long long length) {
+    size_t used = strlen(text);
+    if (offset > 0 && used + 1 < size) {
+        snprintf(text + used, size - used, " offset=%lld", offset);
+        c->offset = offset;
+        c->has_options = 1;
+        used = strlen(text);
+    }
+    if (length > 0 && used + 1 < size) {
+        snprintf(text + used, size - used, " length=%lld", length);
+        c->length = length;
+        c->has_options = 1;
+    }
+}
+
+// Offers FEC repair packets (fec.h)
+static inline void command_add_fec(Command *c, char *text, size_t size) {
+    size_t used = strlen(text);
+    if (used + 9 >= size) return;
+    snprintf(text + used, size - used, " fec=xor");
+    c->fec = 1;
+    c->has_options = 1;
+}
+
+// Offers compressed payloads (lz.h)
+static inline void command_add_compress(Command *c, char *text, size_t size) {
+    size_t used = strlen(text);
+    if (used + 14 >= size) return;
+    snprintf(text + used, size - used, " compress=lz4");
+    c->compress = 1;
+    c->has_options = 1;
+}
+
+// Marks a put as carrying a delta (delta.h)
+static inline void command_add_delta(Command *c, char *text, size_t size) {
+    size_t used = strlen(text);
+    if (used + 13 >= size) return;
+    snprintf(text + used, size - used, " delta=rsync");
+    c->delta = 1;
+    c->has_options = 1;
+}
+
+// Makes a get conditional on the copy held, whose CRC-32C is *etag; with
+// etag NULL it only asks for the server's
+static inline void command_add_etag(Command *c, char *text, size_t size, const uint32_t *etag) {
+    size_t used = strlen(text);
+    if (used + 15 >= size) return;
+    if (etag) snprintf(text + used, size - used, " etag=%08x", *etag);
+    else snprintf(text + used, size - used, " etag=?");
+    c->want_etag = 1;
+    c->has_etag = etag != NULL;
+    c->etag = etag ? *etag : 0;
+    c->has_options = 1;
+}
+
+// Tells the modification time of the file a put sends
+static inline void command_add_mtime(Command *c, char *text, size_t size, long long mtime) {
+    size_t used = strlen(text);
+    if (mtime <= 0 || used + 28 >= size) return;
+    snprintf(text + used, size - used, " mtime=%lld", mtime);
+    c->mtime = mtime;
+    c->has_options = 1;
+}
+
+// For servers that only send and take whole files in plain data packets:
+// drops the range, FEC, compression, delta and etag options so the reply
+// does not confirm them, and the client refuses, falls back or sends plain
+// packets
+static inline void command_plain(Command *c) {
+    c->part = c->parts = 0;
+    c->offset = c->length = 0;
+    c->fec = 0;
+    c->compress = 0;
+    c->delta = 0;
+    c->want_etag = c->has_etag = 0;
+    c->etag = 0;
+    c->mtime = 0;
+    c->unchanged = 0;
+}
+
+// Builds the FLAG_SYN | FLAG_ACK reply confirming the accepted options. It is
+// the first packet of the session, so it already uses the agreed checksum.
+static inline void command_build_reply(const Command *c, Packet *reply) {
+    memset(reply, 0, sizeof(PacketHeader));
+    reply->header.flags = FLAG_SYN | FLAG_ACK;
+    if (c->csum == CSUM_CRC32C) reply->header.flags |= FLAG_CRC32C;
+    reply->header.data_len = (uint16_t)command_format_options(c, reply->data, DATA_SIZE);
+}
+
+// Reads a FLAG_SYN | FLAG_ACK reply back into the option fields of c.
+static inline void command_parse_reply(const Packet *reply, Command *c) {
+    char text[DATA_SIZE + 1];
+    Command accepted;
+    uint16_t len = reply->header.data_len < DATA_SIZE ? reply->header.data_len : DATA_SIZE;
+
+    memcpy(text, reply->data, len);
+    text[len] = '\0';
+    memset(&accepted, 0, sizeof(accepted));
+    ack_policy_default(&accepted.ack);
+    command_parse_options(text, &accepted);
+    c->ack = accepted.ack;
+    c->csum = accepted.csum;
+    c->size = accepted.size;
+    c->part = accepted.part;
+    c->parts = accepted.parts;
+    c->offset = accepted.offset;
+    c->length = accepted.length;
+    c->fec = accepted.fec;
+    c->compress = accepted.compress;
+    c->delta = accepted.delta;
+    c->has_etag = accepted.has_etag;
+    c->etag = accepted.etag;
+    c->mtime = accepted.mtime;
+    c->unchanged = accepted.unchanged;
+}
+
+#endif // COMMAND_H
@@ -0,0 +1,272 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "protocol.h"
+
+// Packet checksums. The legacy wire checksum is the reflected CRC-32 (zlib,
+// polynomial 0xEDB88320) over header + payload with the checksum field zeroed.
+// Sessions that negotiate csum=crc32c use CRC-32C (Castagnoli, 0x82F63B78)
+// instead and mark every packet with FLAG_CRC32C, so a receiver always knows
+// which one to verify.
+//
+// init_crc32() builds the tables and picks the fastest kernel this CPU runs,
+// once per program:
+//   CRC-32:  PCLMULQDQ folding (64-byte blocks), else slicing-by-8
+//   CRC-32C: SSE4.2 crc32 instruction, else slicing-by-8
+// All kernels work on the raw register (no pre/post inversion) so they can be
+// mixed, e.g. PCLMUL for the bulk and the table for the tail.
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define CRC32_X86 1
+#define CRC32_TARGET(features)
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#include <immintrin.h>
+#define CRC32_X86 1
+#define CRC32_TARGET(features) __attribute__((target(features)))
+#endif
+
+#define CRC32_POLY  0xEDB88320u
+#define CRC32C_POLY 0x82F63B78u
+#define CRC32_PCLMUL_MIN 64     // Shortest input worth the folding kernel
+
+typedef uint32_t (*Crc32Kernel)(uint32_t crc, const uint8_t *p, size_t len);
+
+static uint32_t crc32_table[8][256];
+static uint32_t crc32c_table[8][256];
+static Crc32Kernel crc32_kernel;
+static Crc32Kernel crc32c_kernel;
+static const char *crc32_kernel_name = "table";
+static const char *crc32c_kernel_name = "table";
+
+static inline uint32_t crc32_load_le(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void crc32_build_table(uint32_t table[8][256], uint32_t polynomial) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++) {
+            if (c & 1) {
+                c = polynomial ^ (c >> 1);
+            } else {
+                c >>= 1;
+            }
+        }
+        table[0][i] = c;
+    }
+    // table[k][i]: CRC of byte i followed by k zero bytes
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            table[k][i] = table[0][table[k - 1][i] & 0xFF] ^ (table[k - 1][i] >> 8);
+        }
+    }
+}
+
+// Eight bytes per step through eight tables, then byte at a time
+static inline uint32_t crc32_slice8(uint32_t table[8][256], uint32_t crc, const uint8_t *p, size_t len) {
+    while (len >= 8) {
+        uint32_t one = crc32_load_le(p) ^ crc;
+        uint32_t two = crc32_load_le(p + 4);
+        crc = table[7][one & 0xFF] ^ table[6][(one >> 8) & 0xFF] ^ table[5][(one >> 16) & 0xFF] ^
+              table[4][one >> 24] ^ table[3][two & 0xFF] ^ table[2][(two >> 8) & 0xFF] ^
+              table[1][(two >> 16) & 0xFF] ^ table[0][two >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) crc = table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+static inline uint32_t crc32_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    return crc32_slice8(crc32_table, crc, p, len);
+}
+
+static inline uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    return crc32_slice8(crc32c_table, crc, p, len);
+}
+
+#ifdef CRC32_X86
+// Folds 64-byte blocks with carry-less multiplies, then Barrett-reduces to 32
+// bits (Gopal et al., "Fast CRC Computation for Generic Polynomials Using
+// PCLMULQDQ"; constants for the bit-reflected zlib polynomial). len must be
+// at least 64 and a multiple of 16.
+CRC32_TARGET("pclmul,sse4.1")
+static inline uint32_t crc32_fold_pclmul(uint32_t crc, const uint8_t *p, size_t len) {
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    p += 64;
+    len -= 64;
+
+    // Four lanes in parallel, 64 bytes per round
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(p + 0x30)));
+        p += 64;
+        len -= 64;
+    }
+
+    // Lanes into one 128-bit value
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // Remaining 16-byte blocks
+    while (len >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)p)), x5);
+        p += 16;
+        len -= 16;
+    }
+
+    // 128 -> 64 bits
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x2 = _mm_and_si128(x1, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+CRC32_TARGET("pclmul,sse4.1")
+static inline uint32_t crc32_pclmul(uint32_t crc, const uint8_t *p, size_t len) {
+    if (len >= CRC32_PCLMUL_MIN) {
+        size_t bulk = len & ~(size_t)15;
+        crc = crc32_fold_pclmul(crc, p, bulk);
+        p += bulk;
+        len -= bulk;
+    }
+    return crc32_slice8(crc32_table, crc, p, len);
+}
+
+CRC32_TARGET("sse4.2")
+static inline uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len) {
+#if defined(__x86_64__) || defined(_M_X64)
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+    while (len >= 4) {
+        uint32_t word;
+        memcpy(&word, p, sizeof(word));
+        crc = _mm_crc32_u32(crc, word);
+        p += 4;
+        len -= 4;
+    }
+    while (len--) crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+
+// CPUID leaf 1, ECX
+static inline uint32_t crc32_cpu_features(void) {
+#ifdef _MSC_VER
+    int regs[4];
+    __cpuid(regs, 1);
+    return (uint32_t)regs[2];
+#else
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return 0;
+    return ecx;
+#endif
+}
+#endif // CRC32_X86
+
+static inline void init_crc32(void) {
+    crc32_build_table(crc32_table, CRC32_POLY);
+    crc32_build_table(crc32c_table, CRC32C_POLY);
+    crc32_kernel = crc32_sw;
+    crc32c_kernel = crc32c_sw;
+
+#ifdef CRC32_X86
+    uint32_t ecx = crc32_cpu_features();
+    if ((ecx & (1u << 1)) && (ecx & (1u << 19))) {  // PCLMULQDQ, SSE4.1
+        crc32_kernel = crc32_pclmul;
+        crc32_kernel_name = "pclmul";
+    }
+    if (ecx & (1u << 20)) {                         // SSE4.2
+        crc32c_kernel = crc32c_sse42;
+        crc32c_kernel_name = "sse4.2";
+    }
+#endif
+}
+
+// Legacy wire checksum, bit-exact with the original byte-at-a-time loop
+static inline uint32_t calculate_crc32(const void *buf, size_t size) {
+    return ~crc32_kernel(0xFFFFFFFF, (const uint8_t *)buf, size);
+}
+
+static inline uint32_t calculate_crc32c(const void *buf, size_t size) {
+    return ~crc32c_kernel(0xFFFFFFFF, (const uint8_t *)buf, size);
+}
+
+// CRC-32C of the rest of a file, read from where fp stands (the etag= of
+// command.h). Returns -1 on a read error.
+static inline int crc32c_stream(FILE *fp, uint32_t *crc) {
+    uint8_t buf[64 * 1024];
+    uint32_t c = 0xFFFFFFFF;
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) c = crc32c_kernel(c, buf, n);
+    *crc = ~c;
+    return ferror(fp) ? -1 : 0;
+}
+
+// Checksum of a packet whose header (checksum field zero) and payload sit
+// in separate buffers, in the algorithm its FLAG_CRC32C bit selects
+static inline uint32_t packet_crc_parts(const PacketHeader *h, const void *payload) {
+    Crc32Kernel kernel = (h->flags & FLAG_CRC32C) ? crc32c_kernel : crc32_kernel;
+    uint32_t crc = kernel(0xFFFFFFFF, (const uint8_t *)h, sizeof(PacketHeader));
+    return ~kernel(crc, (const uint8_t *)payload, h->data_len);
+}
+
+static inline uint32_t packet_crc(const Packet *pkt) {
+    return packet_crc_parts(&pkt->header, pkt->data);
+}
+
+#endif // CRC32_H
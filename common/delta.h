@@ -0,0 +1,286 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "crc32.h"
+
+// Delta puts (Linux), after rsync. Before putting a file of DELTA_MIN_BYTES
+// or more, the client asks the server with "sig <file>" for the signature of
+// its copy: the block size and, for every full block, a weak rolling checksum
+// and two strong ones (CRC-32C and CRC-32). It comes back like the data of a
+// get; a server without a copy sends an empty one. The client slides a
+// window over its own file and, wherever the weak sum and then the strong
+// sums match a block, sends a copy instruction instead of the bytes. The
+// result goes out as an ordinary put of the delta, flagged delta=rsync, with
+// all the window, FEC, compression and resume machinery of a put.
+//
+// The server receives it into "<file>.delta" and rebuilds the file from its
+// old copy and the delta into "<file>.rebuild", which replaces the file only
+// if the length and the CRC-32C of the whole result match what the client
+// computed, so a basis that changed in between cannot produce a mixed file.
+//
+// All fields are in host byte order; delta puts are between Linux programs.
+
+#define DELTA_MIN_BYTES (1 << 20)           // Smaller files are always put whole
+#define DELTA_BLOCK_MIN 2048
+#define DELTA_BLOCK_MAX (128 * 1024)
+#define DELTA_LITERAL_MAX (1 << 20)         // Longest literal op
+#define DELTA_SUFFIX ".delta"
+#define DELTA_REBUILD_SUFFIX ".rebuild"
+#define DELTA_SIG_MAGIC 0x47495344u         // "DSIG"
+#define DELTA_MAGIC 0x544c4544u             // "DELT"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t block;         // Block size
+    int64_t  size;          // Length of the server's copy
+} DeltaSigHeader;           // Followed by size / block DeltaBlockSum
+
+typedef struct {
+    uint32_t weak;          // delta_weak()
+    uint32_t crc32c;
+    uint32_t crc32;
+} DeltaBlockSum;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t crc32c;        // Of the whole new file
+    int64_t  basis_size;    // The copy the delta applies to
+    int64_t  size;          // Length of the new file
+} DeltaHeader;              // Followed by DeltaOps
+
+typedef struct {
+    int64_t  offset;        // Copy: where the bytes are in the old copy
+    uint32_t length;
+    uint32_t literal;       // 1: length bytes of new data follow the op
+} DeltaOp;
+
+// About sqrt(size), so that sums and literals grow alike, in whole packets
+static inline uint32_t delta_block_size(long long size) {
+    uint32_t block = DELTA_BLOCK_MIN;
+    while (block < DELTA_BLOCK_MAX && (long long)block * block < size) block *= 2;
+    return block;
+}
+
+// rsync's weak checksum: a = sum of the bytes, b = sum of a over each prefix,
+// both mod 2^16, so the window can roll one byte at a time
+static inline uint32_t delta_weak(const uint8_t *p, uint32_t len, uint32_t *a_out, uint32_t *b_out) {
+    uint32_t a = 0, b = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        a += p[i];
+        b += a;
+    }
+    *a_out = a & 0xFFFF;
+    *b_out = b & 0xFFFF;
+    return *a_out | *b_out << 16;
+}
+
+/*------------------------------------------- Server -------------------------------------------*/
+
+// Writes the signature of basis (NULL = no copy, an empty signature) to out.
+// Returns -1 on a read or write error.
+static inline int delta_write_signature(FILE *basis, FILE *out) {
+    if (!basis) return 0;
+    fseek(basis, 0, SEEK_END);
+    long long size = ftell(basis);
+    fseek(basis, 0, SEEK_SET);
+
+    DeltaSigHeader h = {DELTA_SIG_MAGIC, delta_block_size(size), size};
+    uint8_t *buf = (uint8_t *)malloc(h.block);
+    if (!buf || fwrite(&h, sizeof(h), 1, out) != 1) {
+        free(buf);
+        return -1;
+    }
+    for (long long left = size; left >= h.block; left -= h.block) {
+        DeltaBlockSum sum;
+        uint32_t a, b;
+        if (fread(buf, 1, h.block, basis) != h.block) break;
+        sum.weak = delta_weak(buf, h.block, &a, &b);
+        sum.crc32c = calculate_crc32c(buf, h.block);
+        sum.crc32 = calculate_crc32(buf, h.block);
+        if (fwrite(&sum, sizeof(sum), 1, out) != 1) break;
+    }
+    free(buf);
+    return ferror(basis) || ferror(out) || fflush(out) != 0 ? -1 : 0;
+}
+
+static inline int delta_copy(FILE *from, FILE *to, long long len, uint8_t *buf, size_t buf_len, uint32_t *crc) {
+    while (len > 0) {
+        size_t n = len < (long long)buf_len ? (size_t)len : buf_len;
+        if (fread(buf, 1, n, from) != n || fwrite(buf, 1, n, to) != n) return -1;
+        *crc = crc32c_kernel(*crc, buf, n);
+        len -= (long long)n;
+    }
+    return 0;
+}
+
+// Rebuilds target from its current contents and the delta at delta_path,
+// through target.rebuild renamed into place. Both temporary files are gone
+// afterwards. Returns 0, or -1 with *why set.
+static inline int delta_apply(const char *target, const char *delta_path, const char **why) {
+    char rebuild[512];
+    DeltaHeader h;
+    DeltaOp op;
+    uint32_t crc = 0xFFFFFFFF;
+    long long written = 0;
+    size_t buf_len = 256 * 1024;
+    uint8_t *buf = (uint8_t *)malloc(buf_len);
+    FILE *delta = fopen(delta_path, "rb");
+    FILE *basis = fopen(target, "rb");
+    FILE *out = NULL;
+
+    snprintf(rebuild, sizeof(rebuild), "%s%s", target, DELTA_REBUILD_SUFFIX);
+    *why = NULL;
+    if (!buf || !delta || fread(&h, sizeof(h), 1, delta) != 1 || h.magic != DELTA_MAGIC) {
+        *why = "unreadable delta";
+    } else if (!basis || fseek(basis, 0, SEEK_END) != 0 || ftell(basis) != h.basis_size) {
+        *why = "the file changed since its signature was sent";
+    } else if (!(out = fopen(rebuild, "wb"))) {
+        *why = "cannot create the rebuilt file";
+    }
+    while (!*why && fread(&op, sizeof(op), 1, delta) == 1) {
+        if (op.literal) {
+            if (delta_copy(delta, out, op.length, buf, buf_len, &crc) != 0) *why = "truncated delta";
+        } else if (op.offset < 0 || op.offset + op.length > h.basis_size || fseek(basis, op.offset, SEEK_SET) != 0 ||
+                   delta_copy(basis, out, op.length, buf, buf_len, &crc) != 0) {
+            *why = "bad copy instruction";
+        }
+        written += op.length;
+    }
+    if (!*why && (written != h.size || ~crc != h.crc32c)) *why = "the rebuilt file does not match";
+    if (!*why && (fflush(out) != 0 || fsync(fileno(out)) != 0)) *why = "cannot write the rebuilt file";
+
+    if (out && fclose(out) != 0 && !*why) *why = "cannot write the rebuilt file";
+    if (basis) fclose(basis);
+    if (delta) fclose(delta);
+    free(buf);
+    if (!*why && rename(rebuild, target) != 0) *why = "cannot replace the file";
+    if (*why) remove(rebuild);
+    remove(delta_path);
+    return *why ? -1 : 0;
+}
+
+/*------------------------------------------- Client -------------------------------------------*/
+
+typedef struct {
+    FILE     *out;
+    DeltaOp   copy;         // Pending copy, extended while matches are contiguous
+    long long copied;
+    int       error;
+} DeltaWriter;
+
+static inline void delta_flush_copy(DeltaWriter *w) {
+    if (w->copy.length == 0) return;
+    if (fwrite(&w->copy, sizeof(w->copy), 1, w->out) != 1) w->error = 1;
+    w->copied += w->copy.length;
+    w->copy.length = 0;
+}
+
+static inline void delta_emit_copy(DeltaWriter *w, long long offset, uint32_t length) {
+    if (w->copy.length && w->copy.offset + w->copy.length == offset && w->copy.length <= UINT32_MAX - length) {
+        w->copy.length += length;
+        return;
+    }
+    delta_flush_copy(w);
+    w->copy.offset = offset;
+    w->copy.length = length;
+    w->copy.literal = 0;
+}
+
+static inline void delta_emit_literal(DeltaWriter *w, const uint8_t *p, long long len) {
+    if (len > 0) delta_flush_copy(w);
+    while (len > 0) {
+        DeltaOp op = {0, (uint32_t)(len < DELTA_LITERAL_MAX ? len : DELTA_LITERAL_MAX), 1};
+        if (fwrite(&op, sizeof(op), 1, w->out) != 1 || fwrite(p, 1, op.length, w->out) != op.length) w->error = 1;
+        p += op.length;
+        len -= op.length;
+    }
+}
+
+static inline int delta_strong_match(const DeltaBlockSum *sum, const uint8_t *p, uint32_t block) {
+    return calculate_crc32c(p, block) == sum->crc32c && calculate_crc32(p, block) == sum->crc32;
+}
+
+// Writes to out the delta that turns the copy described by sig (sig_len
+// bytes) into the size bytes at data. Returns the number of bytes it copies
+// from the old copy, or -1 if the signature is malformed or out fails.
+static inline long long delta_build(const uint8_t *data, long long size, const uint8_t *sig, size_t sig_len,
+                                    FILE *out) {
+    DeltaSigHeader sh;
+    DeltaWriter w = {out, {0, 0, 0}, 0, 0};
+
+    if (sig_len < sizeof(sh)) return -1;
+    memcpy(&sh, sig, sizeof(sh));
+    size_t nblocks = (sig_len - sizeof(sh)) / sizeof(DeltaBlockSum);
+    if (sh.magic != DELTA_SIG_MAGIC || sh.block < DELTA_BLOCK_MIN || sh.block > DELTA_BLOCK_MAX ||
+        nblocks != (size_t)(sh.size / sh.block)) {
+        return -1;
+    }
+    const DeltaBlockSum *sums = (const DeltaBlockSum *)(sig + sizeof(sh));
+    uint32_t block = sh.block;
+
+    // Open-addressed table of block numbers + 1 by weak sum
+    size_t cap = 16;
+    while (cap < nblocks * 2) cap *= 2;
+    uint32_t *table = (uint32_t *)calloc(cap, sizeof(uint32_t));
+    if (!table) return -1;
+    for (size_t i = 0; i < nblocks; i++) {
+        size_t slot = (sums[i].weak * 2654435761u) & (cap - 1);
+        while (table[slot]) slot = (slot + 1) & (cap - 1);
+        table[slot] = (uint32_t)i + 1;
+    }
+
+    DeltaHeader h = {DELTA_MAGIC, calculate_crc32c(data, (size_t)size), sh.size, size};
+    if (fwrite(&h, sizeof(h), 1, out) != 1) w.error = 1;
+
+    long long pos = 0, literal = 0;
+    size_t next = 0;                // Block after the last match, tried first
+    uint32_t a = 0, b = 0;
+    int fresh = 1;
+    while (nblocks > 0 && pos + block <= size && !w.error) {
+        if (fresh) delta_weak(data + pos, block, &a, &b);
+        fresh = 0;
+        uint32_t weak = a | b << 16;
+        long long match = -1;
+
+        if (next < nblocks && sums[next].weak == weak && delta_strong_match(&sums[next], data + pos, block)) {
+            match = (long long)next;
+        } else {
+            size_t slot = (weak * 2654435761u) & (cap - 1);
+            for (; table[slot]; slot = (slot + 1) & (cap - 1)) {
+                const DeltaBlockSum *sum = &sums[table[slot] - 1];
+                if (sum->weak == weak && delta_strong_match(sum, data + pos, block)) {
+                    match = table[slot] - 1;
+                    break;
+                }
+            }
+        }
+        if (match >= 0) {
+            delta_emit_literal(&w, data + literal, pos - literal);
+            delta_emit_copy(&w, match * block, block);
+            pos += block;
+            literal = pos;
+            next = (size_t)match + 1;
+            fresh = 1;
+            continue;
+        }
+        if (pos + block < size) {
+            uint8_t gone = data[pos], come = data[pos + block];
+            a = (a - gone + come) & 0xFFFF;
+            b = (b - block * gone + a) & 0xFFFF;
+        }
+        pos++;
+    }
+    delta_emit_literal(&w, data + literal, size - literal);
+    delta_flush_copy(&w);
+    free(table);
+    if (w.error || fflush(out) != 0) return -1;
+    return w.copied;
+}
+
+#endif // DELTA_H
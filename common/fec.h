@@ -0,0 +1,270 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "protocol.h"
+#include "sack.h"
+
+// Forward error correction (Linux programs), negotiated per transfer with
+// fec=xor. After every group of K new data packets the sender adds one repair
+// packet, flagged FLAG_FEC, whose payload is the XOR of the group's payloads
+// (zero-padded to the longest). Its header describes the group:
+//
+//   seq_num      first seq of the group
+//   ack_num      K, the number of data packets in it, plus the XOR of their
+//                window_size (compressed length, lz.h) in the upper 16 bits
+//   window_size  XOR of their data_len
+//   data_len     length of the longest of them
+//   flags        FLAG_FEC, plus FLAG_FIN when the group ends the transfer,
+//                plus FLAG_LZ if an odd number of them are compressed
+//
+// A receiver missing exactly one packet of the group rebuilds it from the
+// repair packet and the other K - 1, and takes it as if it had arrived, so a
+// single loss costs neither a timeout nor a round trip. The other packets are
+// still in its receive ring: delivered packets keep their slot until the ring
+// wraps. A repair packet that finds two or more missing is dropped and SACK
+// recovery resends them. Repair packets are never retransmitted and do not
+// count against the congestion window.
+//
+// The overhead adapts to the loss rate. Receivers report how many packets
+// they rebuilt in the seq_num of every ACK (recv_window_build_ack), and the
+// sender counts the packets it had to retransmit on top. Every
+// FEC_ADAPT_PACKETS new packets it smooths the rate and picks the largest K
+// that keeps two losses in one group rare, down to FEC_K_MIN; below
+// FEC_LOSS_OFF no repair packets are sent until losses come back.
+//
+// init_fec() picks the widest XOR kernel this CPU runs, once per program:
+// AVX2, else SSE2, else 64 bits at a time.
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define FEC_X86 1
+#define FEC_TARGET(features) __attribute__((target(features)))
+#endif
+
+#define FEC_K_MIN 4                 // Smallest group: 25% overhead
+#define FEC_K_MAX 64                // Largest group: 1.6% overhead
+#define FEC_K_START 32              // Until the first loss estimate
+#define FEC_ADAPT_PACKETS 256       // New data packets between group size updates
+#define FEC_LOSS_OFF 0.001          // Loss rate below which no repair packets are sent
+
+typedef void (*FecXorKernel)(uint8_t *dst, const uint8_t *src, size_t len);
+
+static FecXorKernel fec_xor_kernel;
+static const char *fec_kernel_name = "scalar";
+
+static inline void fec_xor_scalar(uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < len; i++) dst[i] ^= src[i];
+}
+
+#ifdef FEC_X86
+FEC_TARGET("sse2")
+static inline void fec_xor_sse2(uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(dst + i + 16));
+        __m128i a2 = _mm_loadu_si128((const __m128i *)(dst + i + 32));
+        __m128i a3 = _mm_loadu_si128((const __m128i *)(dst + i + 48));
+        a0 = _mm_xor_si128(a0, _mm_loadu_si128((const __m128i *)(src + i)));
+        a1 = _mm_xor_si128(a1, _mm_loadu_si128((const __m128i *)(src + i + 16)));
+        a2 = _mm_xor_si128(a2, _mm_loadu_si128((const __m128i *)(src + i + 32)));
+        a3 = _mm_xor_si128(a3, _mm_loadu_si128((const __m128i *)(src + i + 48)));
+        _mm_storeu_si128((__m128i *)(dst + i), a0);
+        _mm_storeu_si128((__m128i *)(dst + i + 16), a1);
+        _mm_storeu_si128((__m128i *)(dst + i + 32), a2);
+        _mm_storeu_si128((__m128i *)(dst + i + 48), a3);
+    }
+    for (; i + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i *)(src + i)));
+        _mm_storeu_si128((__m128i *)(dst + i), a);
+    }
+    fec_xor_scalar(dst + i, src + i, len - i);
+}
+
+FEC_TARGET("avx2")
+static inline void fec_xor_avx2(uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(dst + i + 32));
+        __m256i a2 = _mm256_loadu_si256((const __m256i *)(dst + i + 64));
+        __m256i a3 = _mm256_loadu_si256((const __m256i *)(dst + i + 96));
+        a0 = _mm256_xor_si256(a0, _mm256_loadu_si256((const __m256i *)(src + i)));
+        a1 = _mm256_xor_si256(a1, _mm256_loadu_si256((const __m256i *)(src + i + 32)));
+        a2 = _mm256_xor_si256(a2, _mm256_loadu_si256((const __m256i *)(src + i + 64)));
+        a3 = _mm256_xor_si256(a3, _mm256_loadu_si256((const __m256i *)(src + i + 96)));
+        _mm256_storeu_si256((__m256i *)(dst + i), a0);
+        _mm256_storeu_si256((__m256i *)(dst + i + 32), a1);
+        _mm256_storeu_si256((__m256i *)(dst + i + 64), a2);
+        _mm256_storeu_si256((__m256i *)(dst + i + 96), a3);
+    }
+    for (; i + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+        a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i *)(src + i)));
+        _mm256_storeu_si256((__m256i *)(dst + i), a);
+    }
+    fec_xor_sse2(dst + i, src + i, len - i);
+}
+#endif // FEC_X86
+
+static inline void init_fec(void) {
+    fec_xor_kernel = fec_xor_scalar;
+#ifdef FEC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        fec_xor_kernel = fec_xor_sse2;
+        fec_kernel_name = "sse2";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        fec_xor_kernel = fec_xor_avx2;
+        fec_kernel_name = "avx2";
+    }
+#endif
+}
+
+// dst ^= src over len bytes
+static inline void fec_xor(void *dst, const void *src, size_t len) {
+    fec_xor_kernel((uint8_t *)dst, (const uint8_t *)src, len);
+}
+
+/*------------------------------------------- Sender -------------------------------------------*/
+
+typedef struct {
+    uint32_t k;             // Size of the next group, 0 = no repair packets for now
+    uint32_t group_k;       // Size of the open group
+    uint32_t count;         // Data packets in the open group, 0 = none open
+    uint16_t len_xor;
+    uint16_t raw_xor;       // Of window_size, for compressed packets
+    uint8_t  lz_xor;        // Of the FLAG_LZ bits
+    uint16_t max_len;
+    Packet   repair;        // XOR of the open group, complete when fec_encoder_add says so
+    double   loss;          // Smoothed fraction of new packets lost
+    uint32_t sent;          // New data packets
+    uint32_t rebuilt;       // Packets the receiver rebuilt, from its latest ACK
+    uint32_t mark_sent;     // sent and retransmitted + rebuilt at the last update
+    uint32_t mark_lost;
+} FecEncoder;
+
+static inline void fec_encoder_init(FecEncoder *enc) {
+    memset(enc, 0, sizeof(*enc));
+    enc->k = FEC_K_START;
+}
+
+// Largest power-of-two group with fewer than one loss in four groups expected
+static inline uint32_t fec_group_size(double loss) {
+    uint32_t k = FEC_K_MAX;
+    if (loss < FEC_LOSS_OFF) return 0;
+    while (k > FEC_K_MIN && k * loss * 4 > 1.0) k /= 2;
+    return k;
+}
+
+// Adds a data packet sent for the first time; packets must come in seq
+// order. Returns 1 when it completes a group: enc->repair is then ready to
+// stamp and send.
+static inline int fec_encoder_add(FecEncoder *enc, const PacketHeader *h, const void *payload) {
+    enc->sent++;
+    if (enc->count == 0) {
+        if (enc->k == 0) return 0;
+        enc->group_k = enc->k;
+        enc->len_xor = enc->raw_xor = enc->max_len = 0;
+        enc->lz_xor = 0;
+        memcpy(enc->repair.data, payload, h->data_len);
+        memset(enc->repair.data + h->data_len, 0, DATA_SIZE - h->data_len);
+        enc->repair.header.seq_num = h->seq_num;
+    } else {
+        fec_xor(enc->repair.data, payload, h->data_len);
+    }
+    enc->count++;
+    enc->len_xor ^= h->data_len;
+    enc->raw_xor ^= h->window_size;
+    enc->lz_xor ^= h->flags & FLAG_LZ;
+    if (h->data_len > enc->max_len) enc->max_len = h->data_len;
+    if (enc->count < enc->group_k && !(h->flags & FLAG_FIN)) return 0;
+
+    uint32_t first = enc->repair.header.seq_num;
+    memset(&enc->repair.header, 0, sizeof(PacketHeader));
+    enc->repair.header.seq_num = first;
+    enc->repair.header.ack_num = enc->count | (uint32_t)enc->raw_xor << 16;
+    enc->repair.header.window_size = enc->len_xor;
+    enc->repair.header.data_len = enc->max_len;
+    enc->repair.header.flags = FLAG_FEC | (h->flags & FLAG_FIN) | enc->lz_xor;
+    enc->count = 0;
+    return 1;
+}
+
+// Takes the rebuilt count from an ACK and, every FEC_ADAPT_PACKETS new
+// packets, resizes the groups to the loss rate. retransmits is the sender's
+// running total.
+static inline void fec_encoder_on_ack(FecEncoder *enc, const PacketHeader *ack, uint32_t retransmits) {
+    if (ack->seq_num > enc->rebuilt) enc->rebuilt = ack->seq_num;
+    uint32_t sent = enc->sent - enc->mark_sent;
+    if (sent < FEC_ADAPT_PACKETS) return;
+
+    uint32_t lost = retransmits + enc->rebuilt;
+    double rate = (double)(lost - enc->mark_lost) / sent;
+    enc->loss = 0.75 * enc->loss + 0.25 * (rate < 1.0 ? rate : 1.0);
+    enc->k = fec_group_size(enc->loss);
+    enc->mark_sent = enc->sent;
+    enc->mark_lost = lost;
+}
+
+/*------------------------------------------ Receiver ------------------------------------------*/
+
+// Rebuilds into out the one packet of repair's group that the window is
+// missing. Returns 0 if none or several are missing, or one of the others has
+// already left the ring; the SACK path takes care of those.
+static inline int fec_rebuild(RecvWindow *rw, const Packet *repair, Packet *out) {
+    uint32_t first = repair->header.seq_num;
+    uint32_t k = repair->header.ack_num & 0xFFFF;
+    uint16_t len = repair->header.window_size;
+    uint16_t raw = (uint16_t)(repair->header.ack_num >> 16);
+    uint8_t lz = repair->header.flags & FLAG_LZ;
+    uint32_t missing = 0;
+
+    if (first == 0 || k == 0 || k > FEC_K_MAX || first + k <= rw->expected_seq) return 0;
+    for (uint32_t seq = first; seq < first + k; seq++) {
+        uint32_t idx = seq % rw->capacity;
+        if (seq >= rw->expected_seq && !rw->present[idx]) {
+            if (missing) return 0;
+            missing = seq;
+        } else if (rw->slots[idx].header.seq_num != seq ||
+                   rw->slots[idx].header.data_len > repair->header.data_len) {
+            return 0;
+        }
+    }
+    if (!missing || missing >= rw->expected_seq + rw->capacity - rw->unwritten) return 0;
+
+    memcpy(out->data, repair->data, repair->header.data_len);
+    for (uint32_t seq = first; seq < first + k; seq++) {
+        const Packet *p = &rw->slots[seq % rw->capacity];
+        if (seq == missing) continue;
+        fec_xor(out->data, p->data, p->header.data_len);
+        len ^= p->header.data_len;
+        raw ^= p->header.window_size;
+        lz ^= p->header.flags & FLAG_LZ;
+    }
+    if (len > repair->header.data_len) return 0;
+
+    memset(&out->header, 0, sizeof(PacketHeader));
+    out->header.seq_num = missing;
+    out->header.data_len = len;
+    out->header.window_size = lz ? raw : 0;
+    out->header.flags = FLAG_DATA | lz;
+    if ((repair->header.flags & FLAG_FIN) && missing == first + k - 1) out->header.flags |= FLAG_FIN;
+    rw->rebuilt++;
+    return 1;
+}
+
+#endif // FEC_H
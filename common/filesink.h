@@ -0,0 +1,393 @@
+#ifndef FILESINK_H
+#define FILESINK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "journal.h"
+#include "lz.h"
+#include "protocol.h"
+#include "sack.h"
+
+// Write side of a file being received (Linux). Packets delivered in order
+// stay in the receive window's ring until a writer thread has put them on
+// disk, so the receive loop never waits for the disk: it publishes how far it
+// has delivered and goes back to ACKing. The writer issues one pwritev per
+// run of delivered packets, straight from the ring slots. Until then they
+// count as rw->unwritten, which shrinks the advertised window: a disk that
+// falls behind slows the sender down instead of making it time out.
+//
+// The file is preallocated from the size the sender announced (size=N). In
+// direct mode the writer copies packets into an aligned staging buffer and
+// writes it with O_DIRECT, so multi-GB uploads do not sweep the page cache;
+// filesystems that refuse O_DIRECT get buffered writes.
+//
+// With a journal attached (journal.h) the writer also records, every
+// JOURNAL_STEP bytes, how far the file is durably written, so an interrupted
+// transfer can resume. file_sink_publish() has it store, after every write,
+// how many bytes of the file are written, for threads reading the file while
+// it arrives.
+//
+// For transfers that negotiated compression (lz.h) the writer also
+// decompresses. Every packet, compressed or not, is first copied into a
+// ring of FILE_SINK_MAX_IOV decoded packets, indexed by seq, which is what
+// gets written and what later packets of the same block copy from.
+
+#define FILE_SINK_MAX_IOV 256               // Slots per pwritev, a multiple of LZ_BLOCK_PACKETS
+#define FILE_SINK_DIRECT_ALIGN 4096
+#define FILE_SINK_DIRECT_BUF (1 << 20)      // Staging buffer, multiple of the alignment
+#ifndef FILE_SINK_DIRECT_MIN
+#define FILE_SINK_DIRECT_MIN (1LL << 30)    // Smallest announced size written with O_DIRECT
+#endif
+
+typedef struct {
+    FILE       *fp;
+    int         fd;
+    int         notify_fd;  // eventfd bumped when the writer catches up for a waiting reader, -1 = none
+    RecvWindow *rw;
+    pthread_t   thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int         started;
+
+    // Guarded by lock
+    uint32_t    delivered;  // Packets below this seq have been delivered in order
+    uint32_t    written;    // ... and below this one are out of the ring
+    int         finish;     // Nothing more will be delivered
+    int         done;       // Writer has written everything and exited
+    int         wake;       // Reader wants notify_fd bumped on progress
+    int         error;      // errno of the first failed write
+
+    // Reader only
+    int         waiting;    // Asked for a wakeup, window held below half
+    uint32_t    stalls;     // Times that happened
+
+    // Writer only
+    long long   offset;     // File offset of the next write (start of the staging buffer)
+    char       *stage;      // O_DIRECT staging buffer, NULL in buffered mode
+    size_t      staged;
+    int         direct;     // O_DIRECT was accepted
+    uint32_t    writes;
+    Journal    *journal;    // Progress journal kept up to date, NULL = none
+    long long  *published;  // Bytes written, stored for other threads; NULL = none
+    uint8_t    *decoded;    // Decoded packets, slot (seq - 1) % FILE_SINK_MAX_IOV; NULL = not compressed
+    uint32_t    lz_first;   // First seq of the transfer: no block reaches back before it
+} FileSink;
+
+static inline int file_sink_pwrite_all(int fd, struct iovec *iov, int n, long long offset) {
+    while (n > 0) {
+        ssize_t r = pwritev(fd, iov, n, offset);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return r < 0 ? errno : EIO;
+        offset += r;
+        while (n > 0 && (size_t)r >= iov->iov_len) {
+            r -= (ssize_t)iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + r;
+            iov->iov_len -= (size_t)r;
+        }
+    }
+    return 0;
+}
+
+// Decodes packet seq into k->decoded and returns where, with its length in
+// the file in *len, or NULL if its compressed payload is corrupt. The packets
+// before it in its block are the slots just below: LZ_BLOCK_PACKETS divides
+// FILE_SINK_MAX_IOV.
+static inline const char *file_sink_decode(FileSink *k, uint32_t seq, const Packet *pkt, size_t *len) {
+    uint32_t first = seq - (seq - 1) % LZ_BLOCK_PACKETS;
+    if (first < k->lz_first) first = k->lz_first;
+    size_t pos = (size_t)((seq - 1) % FILE_SINK_MAX_IOV) * DATA_SIZE;
+    size_t lo = (size_t)((first - 1) % FILE_SINK_MAX_IOV) * DATA_SIZE;
+
+    if (!(pkt->header.flags & FLAG_LZ)) {
+        memcpy(k->decoded + pos, pkt->data, pkt->header.data_len);
+        *len = pkt->header.data_len;
+    } else {
+        long n = lz_decompress((const uint8_t *)pkt->data, pkt->header.data_len, k->decoded, lo, pos, DATA_SIZE);
+        if (n != pkt->header.window_size) return NULL;
+        *len = (size_t)n;
+    }
+    return (const char *)k->decoded + pos;
+}
+
+// Writes (or stages) packets [seq, end), at most FILE_SINK_MAX_IOV of them.
+// Returns 0 or an errno value.
+static inline int file_sink_write_run(FileSink *k, uint32_t seq, uint32_t end) {
+    struct iovec iov[FILE_SINK_MAX_IOV];
+    RecvWindow *rw = k->rw;
+    int n = 0;
+    long long bytes = 0;
+
+    for (; seq < end; seq++) {
+        const Packet *pkt = &rw->slots[seq % rw->capacity];
+        const char *data = pkt->data;
+        size_t len = pkt->header.data_len;
+        if (k->decoded && !(data = file_sink_decode(k, seq, pkt, &len))) return EBADMSG;
+        if (len == 0) continue;
+
+        if (k->stage) {
+            if (k->staged + len > FILE_SINK_DIRECT_BUF) {
+                size_t room = FILE_SINK_DIRECT_BUF - k->staged;
+                memcpy(k->stage + k->staged, data, room);
+                struct iovec whole = {k->stage, FILE_SINK_DIRECT_BUF};
+                int err = file_sink_pwrite_all(k->fd, &whole, 1, k->offset);
+                if (err) return err;
+                k->writes++;
+                k->offset += FILE_SINK_DIRECT_BUF;
+                memcpy(k->stage, data + room, len - room);
+                k->staged = len - room;
+            } else {
+                memcpy(k->stage + k->staged, data, len);
+                k->staged += len;
+            }
+            continue;
+        }
+
+        iov[n].iov_base = (void *)data;
+        iov[n].iov_len = len;
+        bytes += (long long)len;
+        n++;
+    }
+    if (n > 0) {
+        int err = file_sink_pwrite_all(k->fd, iov, n, k->offset);
+        if (err) return err;
+        k->writes++;
+        k->offset += bytes;
+    }
+    return 0;
+}
+
+// Whatever is left in the staging buffer is not a whole block: drop O_DIRECT
+// and write it through the page cache.
+static inline int file_sink_flush_stage(FileSink *k) {
+    if (!k->stage || k->staged == 0) return 0;
+    fcntl(k->fd, F_SETFL, fcntl(k->fd, F_GETFL) & ~O_DIRECT);
+    struct iovec tail = {k->stage, k->staged};
+    int err = file_sink_pwrite_all(k->fd, &tail, 1, k->offset);
+    if (err) return err;
+    k->writes++;
+    k->offset += (long long)k->staged;
+    k->staged = 0;
+    return 0;
+}
+
+// Makes everything written so far durable and records it in the journal
+static inline void file_sink_checkpoint(FileSink *k) {
+    if (k->journal && k->offset - k->journal->committed >= JOURNAL_STEP && fdatasync(k->fd) == 0) {
+        journal_commit(k->journal, k->offset);
+    }
+}
+
+static inline void file_sink_notify(FileSink *k) {
+    uint64_t one = 1;
+    if (k->notify_fd >= 0 && write(k->notify_fd, &one, sizeof(one)) < 0) perror("File sink: notify");
+}
+
+static inline void *file_sink_writer(void *arg) {
+    FileSink *k = (FileSink *)arg;
+
+    pthread_mutex_lock(&k->lock);
+    for (;;) {
+        while (k->written == k->delivered && !k->finish) pthread_cond_wait(&k->cond, &k->lock);
+        if (k->written == k->delivered || k->error) break;
+
+        // One pwritev at a time, so ring space comes back as it is written
+        uint32_t seq = k->written;
+        uint32_t end = k->delivered - seq > FILE_SINK_MAX_IOV ? seq + FILE_SINK_MAX_IOV : k->delivered;
+        pthread_mutex_unlock(&k->lock);
+        int err = file_sink_write_run(k, seq, end);
+        if (!err) file_sink_checkpoint(k);
+        pthread_mutex_lock(&k->lock);
+
+        if (err) {
+            k->error = err;
+            break;
+        }
+        k->written = end;
+        if (k->published) __atomic_store_n(k->published, k->offset, __ATOMIC_RELEASE);
+        if (k->wake) {
+            k->wake = 0;
+            file_sink_notify(k);
+        }
+    }
+    if (!k->error) {
+        pthread_mutex_unlock(&k->lock);
+        int err = file_sink_flush_stage(k);
+        if (!err && k->published) __atomic_store_n(k->published, k->offset, __ATOMIC_RELEASE);
+        pthread_mutex_lock(&k->lock);
+        k->error = err;
+    }
+    k->done = 1;
+    file_sink_notify(k);
+    pthread_mutex_unlock(&k->lock);
+    return NULL;
+}
+
+// Reserves disk space for the announced size. Returns -1 only when the file
+// cannot fit (ENOSPC); filesystems without fallocate are not an error.
+static inline int file_sink_reserve(FileSink *k, long long size) {
+    if (size <= 0 || fallocate(k->fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)size) == 0 || errno != ENOSPC) return 0;
+    pthread_mutex_lock(&k->lock);
+    if (!k->error) k->error = ENOSPC;
+    pthread_mutex_unlock(&k->lock);
+    return -1;
+}
+
+// Takes over fp (closed by file_sink_close) and starts the writer for the
+// packets of rw. size is the announced file size, 0 if unknown; direct asks
+// for O_DIRECT when size reaches FILE_SINK_DIRECT_MIN. Returns -1, with the
+// errno value in k->error, if the writer cannot start or the file cannot fit.
+static inline int file_sink_open(FileSink *k, FILE *fp, RecvWindow *rw, long long size, int direct, int notify_fd) {
+    memset(k, 0, sizeof(*k));
+    k->fp = fp;
+    k->fd = fileno(fp);
+    k->notify_fd = notify_fd;
+    k->rw = rw;
+    k->delivered = k->written = rw->expected_seq;
+    pthread_mutex_init(&k->lock, NULL);
+    pthread_cond_init(&k->cond, NULL);
+
+    if (file_sink_reserve(k, size) != 0) return -1;
+    if (direct && size >= FILE_SINK_DIRECT_MIN &&
+        posix_memalign((void **)&k->stage, FILE_SINK_DIRECT_ALIGN, FILE_SINK_DIRECT_BUF) == 0 &&
+        fcntl(k->fd, F_SETFL, fcntl(k->fd, F_GETFL) | O_DIRECT) != 0) {
+        free(k->stage);
+        k->stage = NULL;
+    }
+    k->direct = k->stage != NULL;
+
+    int err = pthread_create(&k->thread, NULL, file_sink_writer, k);
+    if (err) {
+        k->error = err;
+        return -1;
+    }
+    k->started = 1;
+    return 0;
+}
+
+// Writes start at offset instead of 0 (one range of a parallel get). Call it
+// before the first delivery.
+static inline void file_sink_seek(FileSink *k, long long offset) {
+    pthread_mutex_lock(&k->lock);
+    k->offset = offset;
+    pthread_mutex_unlock(&k->lock);
+}
+
+// Has the writer keep j up to date. Call it before the first delivery.
+static inline void file_sink_journal(FileSink *k, Journal *j) {
+    pthread_mutex_lock(&k->lock);
+    k->journal = j;
+    pthread_mutex_unlock(&k->lock);
+}
+
+// Has the writer store the number of bytes written into *bytes after every
+// write, with release ordering. Call it before the first
+// delivery; *bytes must outlive the writer (file_sink_close).
+static inline void file_sink_publish(FileSink *k, long long *bytes) {
+    pthread_mutex_lock(&k->lock);
+    k->published = bytes;
+    pthread_mutex_unlock(&k->lock);
+}
+
+// Payloads may arrive compressed (lz.h). Call it before the first delivery.
+// Returns -1 if the decode ring cannot be allocated.
+static inline int file_sink_decompress(FileSink *k) {
+    uint8_t *decoded = (uint8_t *)malloc(FILE_SINK_MAX_IOV * DATA_SIZE);
+    if (!decoded) return -1;
+    pthread_mutex_lock(&k->lock);
+    k->decoded = decoded;
+    k->lz_first = k->written;
+    pthread_mutex_unlock(&k->lock);
+    return 0;
+}
+
+// Refreshes rw->unwritten from the writer's progress. Returns -1 once a
+// write has failed.
+static inline int file_sink_progress(FileSink *k) {
+    RecvWindow *rw = k->rw;
+
+    pthread_mutex_lock(&k->lock);
+    rw->unwritten = k->delivered - k->written;
+    if (rw->unwritten >= rw->capacity / 2) {
+        if (!k->waiting) k->stalls++;
+        k->wake = k->waiting = 1;
+    }
+    int err = k->error;
+    pthread_mutex_unlock(&k->lock);
+    return err ? -1 : 0;
+}
+
+// Hands everything recv_window_next() has popped so far to the writer.
+static inline int file_sink_deliver(FileSink *k) {
+    pthread_mutex_lock(&k->lock);
+    if (k->delivered != k->rw->expected_seq) {
+        k->delivered = k->rw->expected_seq;
+        pthread_cond_signal(&k->cond);
+    }
+    pthread_mutex_unlock(&k->lock);
+    return file_sink_progress(k);
+}
+
+// The reader was waiting and the writer has drained the ring below half:
+// time to advertise the reopened window. Clears the wait.
+static inline int file_sink_reopened(FileSink *k) {
+    if (!k->waiting || k->rw->unwritten >= k->rw->capacity / 2) return 0;
+    k->waiting = 0;
+    return 1;
+}
+
+// No more data: the writer exits once the ring is on disk, bumping notify_fd.
+static inline void file_sink_finish(FileSink *k) {
+    pthread_mutex_lock(&k->lock);
+    k->finish = 1;
+    pthread_cond_signal(&k->cond);
+    pthread_mutex_unlock(&k->lock);
+}
+
+// 1 while delivered packets are still on their way to disk
+static inline int file_sink_busy(FileSink *k) {
+    pthread_mutex_lock(&k->lock);
+    int busy = k->started && !k->done;
+    pthread_mutex_unlock(&k->lock);
+    return busy;
+}
+
+// Writes out what was delivered, stops the writer and closes the file.
+// Returns -1 (errno set) if any write failed. The counters stay readable.
+static inline int file_sink_close(FileSink *k) {
+    if (!k->fp) return 0;
+    if (k->started) {
+        file_sink_finish(k);
+        pthread_join(k->thread, NULL);
+    }
+    int err = k->error;
+    if (fclose(k->fp) != 0 && !err) err = errno;
+    pthread_mutex_destroy(&k->lock);
+    pthread_cond_destroy(&k->cond);
+    free(k->stage);
+    k->stage = NULL;
+    free(k->decoded);
+    k->decoded = NULL;
+    k->fp = NULL;
+    k->started = 0;
+    errno = err;
+    return err ? -1 : 0;
+}
+
+static inline void file_sink_print(const char *tag, const FileSink *k) {
+    printf("%sDisk: %u writes%s, window held back %u times\n", tag, k->writes, k->direct ? " (O_DIRECT)" : "",
+           k->stalls);
+}
+
+#endif // FILESINK_H
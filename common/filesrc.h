@@ -0,0 +1,125 @@
+#ifndef FILESRC_H
+#define FILESRC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "protocol.h"
+
+// Read side of a file being sent. On POSIX the whole file is mapped and
+// payloads are handed out as pointers into the mapping, so a sender builds
+// only the header of each packet and points an iovec at the data. Where
+// mapping is unavailable (Windows, empty files, mmap failure) payloads come
+// from a read-ahead buffer refilled one large fread at a time; callers copy
+// them into their window slot once. Either way a retransmission needs no file
+// I/O: the mapping is still there, or the slot still holds the copy.
+//
+// A ranged get sends only part of the file: file_source_range() narrows the
+// source so that offset 0 and size describe that part.
+//
+// file_source_memory() sends bytes already in memory the same way, as if
+// they were a mapping; their owner is told through a callback when the
+// source is closed. The bytes may still be arriving: the sender then only
+// hands out what *ready says is there (the proxy streams a file from the
+// origin this way).
+
+#define FILE_SOURCE_READAHEAD (256 * 1024)  // Multiple of DATA_SIZE
+
+typedef void (*FileSourceRelease)(void *owner);
+
+typedef struct {
+    FILE       *fp;
+    long        size;       // Bytes being sent: the whole file, or the range
+    long        base;       // File offset of the first of them
+    const char *map;        // Mapping at base, NULL when using the read-ahead buffer
+    size_t      map_len;    // Whole mapping
+    char       *buf;
+    long        buf_off;    // Source offset of buf[0]
+    size_t      buf_len;
+    FileSourceRelease release;  // Memory source: called on close in place of munmap
+    void       *owner;
+    const long long *ready;     // Memory source being filled: bytes from offset 0 of the file valid so far,
+                                // -1 if they never will be; NULL = all
+} FileSource;
+
+// Takes over fp (closed by file_source_close). Returns -1 if no buffer can
+// be allocated.
+static inline int file_source_open(FileSource *src, FILE *fp) {
+    memset(src, 0, sizeof(*src));
+    src->fp = fp;
+    fseek(fp, 0, SEEK_END);
+    src->size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+#ifndef _WIN32
+    if (src->size > 0) {
+        void *map = mmap(NULL, (size_t)src->size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)src->size, MADV_SEQUENTIAL);
+            src->map = map;
+            src->map_len = (size_t)src->size;
+            return 0;
+        }
+    }
+#endif
+    src->buf = (char *)malloc(FILE_SOURCE_READAHEAD);
+    return src->buf ? 0 : -1;
+}
+
+// Sends size bytes at data, which must stay put until release(owner) runs
+static inline void file_source_memory(FileSource *src, const char *data, long size, FileSourceRelease release,
+                                      void *owner) {
+    memset(src, 0, sizeof(*src));
+    src->size = size;
+    src->map = data;
+    src->map_len = (size_t)size;
+    src->release = release;
+    src->owner = owner;
+}
+
+// Restricts the source to length bytes from offset, clamped to the file.
+static inline void file_source_range(FileSource *src, long offset, long length) {
+    if (offset > src->size) offset = src->size;
+    if (length > src->size - offset) length = src->size - offset;
+    if (src->map) src->map += offset;
+    src->base += offset;
+    src->size = length;
+    src->buf_len = 0;
+}
+
+// Payload of the packet at a byte offset: up to DATA_SIZE bytes, *len set to
+// the count. A read-ahead pointer is only valid until the next call.
+static inline const char *file_source_payload(FileSource *src, long offset, uint16_t *len) {
+    long left = src->size - offset;
+    *len = (uint16_t)(left <= 0 ? 0 : left < DATA_SIZE ? left : DATA_SIZE);
+    if (src->map) return src->map + offset;
+
+    if (offset < src->buf_off || offset + *len > src->buf_off + (long)src->buf_len) {
+        fseek(src->fp, src->base + offset, SEEK_SET);
+        src->buf_off = offset;
+        src->buf_len = fread(src->buf, 1, FILE_SOURCE_READAHEAD, src->fp);
+        if (offset + *len > src->buf_off + (long)src->buf_len) *len = (uint16_t)src->buf_len;
+    }
+    return src->buf + (offset - src->buf_off);
+}
+
+static inline void file_source_close(FileSource *src) {
+    if (src->release) {
+        src->release(src->owner);
+        src->map = NULL;
+    }
+#ifndef _WIN32
+    if (src->map) munmap((void *)(src->map - src->base), src->map_len);
+#endif
+    free(src->buf);
+    if (src->fp) fclose(src->fp);
+    memset(src, 0, sizeof(*src));
+}
+
+#endif // FILESRC_H
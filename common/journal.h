@@ -0,0 +1,135 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "protocol.h"
+
+// Progress journal of a file being received (Linux): "<file>.journal" holds
+// the size of the whole file, its mtime and etag as the sender told them, and
+// how much of it, from the start, is safely on disk. The file writer updates
+// it every JOURNAL_STEP bytes, after an fdatasync of the data, so it never
+// claims bytes a crash could lose. It is removed once the file is complete; a
+// transfer that breaks off leaves it behind, and the next transfer of the
+// same file resumes there instead of starting over at seq 1. The same file
+// means the same size, with the etag and mtime agreeing wherever both
+// transfers know them, and at least one of the two known to both: a file
+// replaced by another of the same size is not joined onto the old prefix.
+
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_STEP (8LL << 20)    // Bytes written between updates
+#define JOURNAL_RECORD 128          // Fixed record, rewritten in place
+
+// The file a journal is for
+typedef struct {
+    long long size;             // Length of the whole file
+    long long mtime;            // Modification time at the sender, 0 if not told
+    uint32_t  etag;             // CRC-32C of the whole file (etag=), if has_etag
+    int       has_etag;
+} JournalId;
+
+typedef struct {
+    int       fd;
+    char      path[256];        // Empty when not journaling
+    JournalId id;
+    long long committed;        // Everything below this offset is on disk
+} Journal;
+
+static inline void journal_path(char *out, size_t len, const char *file) {
+    snprintf(out, len, "%s%s", file, JOURNAL_SUFFIX);
+}
+
+// Reads the journal of file. Returns -1 if there is none or it is unreadable.
+static inline int journal_load(const char *file, JournalId *id, long long *committed) {
+    char path[256], record[JOURNAL_RECORD + 1];
+    const char *field;
+    journal_path(path, sizeof(path), file);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = pread(fd, record, JOURNAL_RECORD, 0);
+    close(fd);
+    if (n <= 0) return -1;
+    record[n] = '\0';
+    memset(id, 0, sizeof(*id));
+    if (sscanf(record, "rudp-journal size=%lld committed=%lld", &id->size, committed) != 2) return -1;
+    if ((field = strstr(record, " mtime=")) != NULL) id->mtime = strtoll(field + 7, NULL, 10);
+    if ((field = strstr(record, " etag=")) != NULL) id->has_etag = sscanf(field + 6, "%x", &id->etag) == 1;
+    return id->size > 0 && *committed >= 0 && *committed <= id->size ? 0 : -1;
+}
+
+// 1 if a transfer of the file described by b is the one journaled as a
+static inline int journal_same(const JournalId *a, const JournalId *b) {
+    int etags = a->has_etag && b->has_etag, mtimes = a->mtime > 0 && b->mtime > 0;
+    return a->size == b->size && (etags || mtimes) && (!etags || a->etag == b->etag) &&
+           (!mtimes || a->mtime == b->mtime);
+}
+
+// Where a transfer of size bytes can pick up given committed bytes on disk:
+// a packet boundary, with at least the final packet still to come so the
+// sender ends on a FIN as usual. 0 means start over.
+static inline long long journal_resume_point(long long size, long long committed) {
+    long long packets = (size + DATA_SIZE - 1) / DATA_SIZE;
+    long long done = committed / DATA_SIZE;
+    if (done > packets - 1) done = packets - 1;
+    return done > 0 ? done * DATA_SIZE : 0;
+}
+
+// Resume offset for receiving the file id describes into file: from its
+// journal when one exists for the same file, otherwise 0.
+static inline long long journal_resume(const char *file, const JournalId *id) {
+    JournalId have;
+    long long committed;
+    if (id->size <= 0 || journal_load(file, &have, &committed) != 0 || !journal_same(&have, id)) return 0;
+    return journal_resume_point(id->size, committed);
+}
+
+static inline void journal_commit(Journal *j, long long committed) {
+    char record[JOURNAL_RECORD];
+    memset(record, ' ', sizeof(record));
+    int n = snprintf(record, sizeof(record), "rudp-journal size=%lld committed=%lld mtime=%lld", j->id.size,
+                     committed, j->id.mtime);
+    if (j->id.has_etag && n > 0 && n < JOURNAL_RECORD) {
+        n += snprintf(record + n, sizeof(record) - n, " etag=%08x", j->id.etag);
+    }
+    if (n > 0 && n < JOURNAL_RECORD) record[n] = ' ';
+    record[JOURNAL_RECORD - 1] = '\n';
+    if (pwrite(j->fd, record, sizeof(record), 0) == (ssize_t)sizeof(record)) j->committed = committed;
+}
+
+// Starts journaling a transfer of the file id describes that already has
+// committed bytes in place. Returns -1 (and journals nothing) if the journal
+// cannot be created.
+static inline int journal_open(Journal *j, const char *file, const JournalId *id, long long committed) {
+    memset(j, 0, sizeof(*j));
+    journal_path(j->path, sizeof(j->path), file);
+    j->fd = open(j->path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (j->fd < 0) {
+        j->path[0] = '\0';
+        return -1;
+    }
+    j->id = *id;
+    journal_commit(j, committed);
+    return 0;
+}
+
+// Forgets an earlier transfer of file
+static inline void journal_remove(const char *file) {
+    char path[256];
+    journal_path(path, sizeof(path), file);
+    unlink(path);
+}
+
+// complete: the file is whole, so the journal goes
+static inline void journal_close(Journal *j, int complete) {
+    if (!j->path[0]) return;
+    close(j->fd);
+    if (complete) unlink(j->path);
+    j->path[0] = '\0';
+}
+
+#endif // JOURNAL_H
@@ -0,0 +1,289 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "protocol.h"
+
+// Payload compression (Linux programs), negotiated per transfer with
+// compress=lz4. Packets keep their place in the file, one DATA_SIZE slice
+// per seq, so windows, SACK, FEC and resume work unchanged. Only the payload
+// shrinks: a compressed packet has FLAG_LZ set, carries an LZ4 block
+// (lz_compress) in data_len bytes, and its decompressed length in
+// window_size, which data packets leave at 0 otherwise.
+//
+// Each packet is compressed on its own but may copy from the packets before
+// it in the same block of LZ_BLOCK_PACKETS, so repetitive files compress
+// about as well as with a 64 KB window. A block starts at every seq where
+// (seq - 1) % LZ_BLOCK_PACKETS == 0 and at the first packet of the transfer
+// (or of a resumed put), on both sides. The receiver decompresses in its file
+// writer (filesink.h), which sees packets in seq order anyway; it keeps the
+// recent packets decompressed so later ones can refer back to them.
+//
+// Incompressible data costs little. The sender tries the first
+// LZ_PROBE_PACKETS packets of a block, and a block that does not save an
+// eighth goes raw from there on. The blocks after it go raw without trying,
+// 1, 2, 4, ... up to LZ_BYPASS_MAX, until one compresses again. A single
+// packet is only sent compressed if it shrinks by an eighth as well.
+
+#define LZ_BLOCK_PACKETS 64     // History span, packets (64 KB)
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5      // LZ4 block rules: the last 5 bytes are literals,
+#define LZ_MF_LIMIT 12          // and no match starts in the last 12
+#define LZ_PROBE_PACKETS 4      // Packets tried before a block is judged
+#define LZ_BYPASS_MAX 16        // Most blocks sent raw untried after an incompressible one
+
+// Bytes a packet occupies in the file
+static inline uint16_t lz_raw_len(const PacketHeader *h) {
+    return (h->flags & FLAG_LZ) ? h->window_size : h->data_len;
+}
+
+static inline uint32_t lz_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static inline uint8_t *lz_put_len(uint8_t *op, size_t n) {
+    while (n >= 255) {
+        *op++ = 255;
+        n -= 255;
+    }
+    *op++ = (uint8_t)n;
+    return op;
+}
+
+// One LZ4 sequence: literals, then a match (mlen = 0 for the final literals).
+// Returns NULL if it does not fit before oend.
+static inline uint8_t *lz_emit(uint8_t *op, const uint8_t *oend, const uint8_t *lit, size_t litlen, size_t offset,
+                               size_t mlen) {
+    size_t need = 1 + litlen + (litlen >= 15 ? litlen / 255 + 1 : 0) + (mlen ? 2 + (mlen - LZ_MIN_MATCH) / 255 + 1 : 0);
+    if (need > (size_t)(oend - op)) return NULL;
+
+    size_t mcode = mlen ? mlen - LZ_MIN_MATCH : 0;
+    *op++ = (uint8_t)((litlen < 15 ? litlen : 15) << 4 | (mcode < 15 ? mcode : 15));
+    if (litlen >= 15) op = lz_put_len(op, litlen - 15);
+    memcpy(op, lit, litlen);
+    op += litlen;
+    if (mlen) {
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+        if (mcode >= 15) op = lz_put_len(op, mcode - 15);
+    }
+    return op;
+}
+
+// Compresses base[pos, pos + len) as one LZ4 block into out, with matches
+// reaching back as far as base[0]. table maps hashes of 4 bytes to their
+// position in base and carries over between calls on the same base. Returns
+// the compressed length, or 0 if it would take more than limit bytes.
+static inline size_t lz_compress(const uint8_t *base, size_t pos, size_t len, uint16_t *table, uint8_t *out,
+                                 size_t limit) {
+    const uint8_t *ip = base + pos;
+    const uint8_t *anchor = ip;
+    const uint8_t *end = ip + len;
+    uint8_t *op = out;
+    const uint8_t *oend = out + limit;
+
+    if (len > LZ_MF_LIMIT) {
+        const uint8_t *mflimit = end - LZ_MF_LIMIT;
+        const uint8_t *matchlimit = end - LZ_LAST_LITERALS;
+        while (ip < mflimit) {
+            uint32_t v = lz_read32(ip);
+            uint32_t h = lz_hash(v);
+            const uint8_t *ref = base + table[h];
+            table[h] = (uint16_t)(ip - base);
+            if (ref >= ip || lz_read32(ref) != v) {
+                ip += 1 + ((ip - anchor) >> 6);     // Speed up through literals
+                continue;
+            }
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            size_t mlen = LZ_MIN_MATCH;
+            while (ip + mlen < matchlimit && ip[mlen] == ref[mlen]) mlen++;
+            op = lz_emit(op, oend, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), mlen);
+            if (!op) return 0;
+            ip += mlen;
+            anchor = ip;
+            if (ip < mflimit) table[lz_hash(lz_read32(ip - 2))] = (uint16_t)(ip - 2 - base);
+        }
+    }
+    op = lz_emit(op, oend, anchor, (size_t)(end - anchor), 0, 0);
+    return op ? (size_t)(op - out) : 0;
+}
+
+// Decodes one LZ4 block into dst + pos, where dst[lo, pos) holds what
+// matches may copy from. Returns the decoded length, or -1 if the block is
+// malformed or would write more than cap bytes.
+static inline long lz_decompress(const uint8_t *src, size_t slen, uint8_t *dst, size_t lo, size_t pos, size_t cap) {
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + slen;
+    uint8_t *op = dst + pos;
+    const uint8_t *oend = op + cap;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return -1;
+        size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (dst + lo))) return -1;
+        size_t mlen = token & 15;
+        if (mlen == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        if (mlen > (size_t)(oend - op)) return -1;
+        const uint8_t *match = op - offset;
+        if (offset >= mlen) {
+            memcpy(op, match, mlen);
+            op += mlen;
+        } else {
+            while (mlen--) *op++ = *match++;    // Overlapping: a repeat of the last offset bytes
+        }
+    }
+    return (long)(op - (dst + pos));
+}
+
+/*------------------------------------------- Sender -------------------------------------------*/
+
+typedef struct {
+    int       on;           // Negotiated: blocks started from now on are compressed
+    uint8_t  *block;        // Raw bytes of the current block, from block_first
+    uint16_t *table;        // Match finder of the current block
+    uint32_t  next_seq;     // Seq that continues the block; any other starts one
+    uint32_t  block_first;
+    int       active;       // Compressing the current block
+    uint32_t  probed;       // Packets tried in it, their raw and sent bytes
+    uint32_t  probe_raw;
+    uint32_t  probe_sent;
+    uint32_t  skip;         // Blocks still to send raw untried
+    uint32_t  backoff;      // skip for the next incompressible block
+
+    uint32_t  packets;      // Sent compressed
+    uint64_t  raw_bytes;    // Their length before and after
+    uint64_t  sent_bytes;
+    uint32_t  bypassed;     // Blocks sent raw as incompressible
+} LzEncoder;
+
+// Returns -1 if the buffers cannot be allocated.
+static inline int lz_encoder_init(LzEncoder *z) {
+    memset(z, 0, sizeof(*z));
+    z->backoff = 1;
+    z->block = (uint8_t *)malloc(LZ_BLOCK_PACKETS * DATA_SIZE);
+    z->table = (uint16_t *)malloc(sizeof(uint16_t) << LZ_HASH_BITS);
+    if (!z->block || !z->table) {
+        free(z->block);
+        free(z->table);
+        z->block = NULL;
+        z->table = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static inline void lz_encoder_free(LzEncoder *z) {
+    free(z->block);
+    free(z->table);
+    z->block = NULL;
+    z->table = NULL;
+    z->on = 0;
+}
+
+static inline void lz_encoder_block(LzEncoder *z, uint32_t seq) {
+    z->block_first = seq;
+    z->probed = z->probe_raw = z->probe_sent = 0;
+    z->active = z->on;
+    if (z->active && z->skip > 0) {
+        z->skip--;
+        z->active = 0;
+    }
+    if (z->active) memset(z->table, 0, sizeof(uint16_t) << LZ_HASH_BITS);
+}
+
+// Takes a data packet sent for the first time, header filled in and raw
+// payload at payload (which may be out->data). Compresses it into out when
+// that pays off and returns 1; otherwise leaves the payload alone and
+// returns 0. Either way window_size is set as the wire format needs it.
+static inline int lz_encoder_pack(LzEncoder *z, Packet *out, const void *payload) {
+    uint32_t seq = out->header.seq_num;
+    uint16_t len = out->header.data_len;
+    uint8_t packed[DATA_SIZE];
+
+    out->header.window_size = 0;
+    if (seq != z->next_seq || (seq - 1) % LZ_BLOCK_PACKETS == 0) lz_encoder_block(z, seq);
+    z->next_seq = seq + 1;
+    if (!z->active) return 0;
+
+    size_t pos = (size_t)(seq - z->block_first) * DATA_SIZE;
+    memcpy(z->block + pos, payload, len);
+    size_t n = lz_compress(z->block, pos, len, z->table, packed, len - len / 8);
+
+    // The first packets of a block decide whether the rest is worth trying
+    if (z->probed < LZ_PROBE_PACKETS) {
+        z->probed++;
+        z->probe_raw += len;
+        z->probe_sent += n ? (uint32_t)n : len;
+        if (z->probed == LZ_PROBE_PACKETS) {
+            if (z->probe_sent > z->probe_raw - z->probe_raw / 8) {
+                z->active = 0;
+                z->bypassed++;
+                z->skip = z->backoff;
+                if (z->backoff < LZ_BYPASS_MAX) z->backoff *= 2;
+            } else {
+                z->backoff = 1;
+            }
+        }
+    }
+    if (!n) return 0;
+
+    memcpy(out->data, packed, n);
+    out->header.window_size = len;
+    out->header.data_len = (uint16_t)n;
+    out->header.flags |= FLAG_LZ;
+    z->packets++;
+    z->raw_bytes += len;
+    z->sent_bytes += n;
+    return 1;
+}
+
+static inline void lz_encoder_print(const char *tag, const LzEncoder *z) {
+    if (z->packets) {
+        printf("%sCompression: %u packets, %llu -> %llu bytes (%.2fx), %u blocks sent raw as incompressible\n", tag,
+               z->packets, (unsigned long long)z->raw_bytes, (unsigned long long)z->sent_bytes,
+               (double)z->raw_bytes / z->sent_bytes, z->bypassed);
+    } else if (z->bypassed) {
+        printf("%sCompression: none, %u blocks sent raw as incompressible\n", tag, z->bypassed);
+    }
+}
+
+#endif // LZ_H
@@ -11,10 +11,28 @@
 #define FLAG_ACK  0x02
 #define FLAG_FIN  0x04
 #define FLAG_DATA 0x08
+#define FLAG_SACK 0x10  // ACK payload carries a selective-ack bitmap (see sack.h)
+#define FLAG_CRC32C 0x20  // Checksum is CRC-32C rather than CRC-32 (see crc32.h)
+#define FLAG_FEC  0x40  // Repair packet: XOR of a group of data packets (see fec.h)
+#define FLAG_LZ   0x80  // Payload is compressed; window_size holds its length in the file (see lz.h)
+
+// Packet checksum algorithm, negotiated per transfer with csum=crc32c
+typedef enum {
+    CSUM_CRC32,
+    CSUM_CRC32C
+} ChecksumType;
 
 // Protocol Constants
-#define MAX_WINDOW_SIZE 10
-#define TIMEOUT_MS 2000
+#define MAX_WINDOW_SIZE 8192  // Send/receive ring cap in packets (= bits in one SACK payload)
+#define INITIAL_CWND 10        // Congestion window at the start of a transfer, packets
+#define SOCKET_BUFFER_BYTES (8 * 1024 * 1024)  // SO_SNDBUF/SO_RCVBUF so a full window fits
+#define TIMEOUT_MS 2000      // Ceiling for the backed-off retransmission timeout
+#define RTO_INITIAL_MS 1000  // Retransmission timeout before the first RTT sample
+#define RTO_MIN_MS 10        // Floor for the RTT-derived retransmission timeout
+#define ACK_EVERY_MAX 64     // Largest negotiable ACK coalescing factor, packets
+#define ACK_DELAY_MAX_MS 100 // Largest negotiable delayed-ACK timer
+#define ACK_EVERY_REQUEST 4     // ACK coalescing clients ask for unless told otherwise
+#define ACK_DELAY_REQUEST_MS 5  // Delayed-ACK timer clients ask for unless told otherwise
 
 #pragma pack(push, 1)
 typedef struct {
@@ -24,7 +42,7 @@ typedef struct {
     uint16_t data_len;      // Length of data payload
     uint32_t checksum;      // CRC32 Checksum
     uint8_t  flags;         // Packet Type Flags
-    uint8_t  reserved[3];   // Padding/Reserved
+    uint8_t  reserved[3];   // Connection ID, 24-bit little-endian (0 from legacy peers)
 } PacketHeader;
 
 typedef struct {
@@ -33,4 +51,32 @@ typedef struct {
 } Packet;
 #pragma pack(pop)
 
+// Clients pick a connection ID per transfer and stamp it on every packet;
+// servers echo it so one socket can carry many sessions with the same peer.
+static inline uint32_t packet_conn_id(const PacketHeader *h) {
+    return (uint32_t)h->reserved[0] | (uint32_t)h->reserved[1] << 8 | (uint32_t)h->reserved[2] << 16;
+}
+
+static inline void packet_set_conn_id(PacketHeader *h, uint32_t conn_id) {
+    h->reserved[0] = (uint8_t)conn_id;
+    h->reserved[1] = (uint8_t)(conn_id >> 8);
+    h->reserved[2] = (uint8_t)(conn_id >> 16);
+}
+
+// 1 if a packet belongs to conn_id. Peers that predate IDs send 0 or, in
+// some ACKs, uninitialized bytes, so the ID is only enforced once the peer has
+// echoed it; *echoed tracks that and starts at 0 for each connection. Data and
+// repair packets carrying another non-zero ID are always refused: they are
+// late retransmissions of an earlier transfer on the same socket, and a
+// legacy sender's are zeroed.
+static inline int packet_in_conn(const PacketHeader *h, uint32_t conn_id, int *echoed) {
+    uint32_t id = packet_conn_id(h);
+    if (id == conn_id) {
+        *echoed = 1;
+        return 1;
+    }
+    if (id != 0 && (h->flags & (FLAG_DATA | FLAG_FEC))) return 0;
+    return !*echoed;
+}
+
 #endif // PROTOCOL_H
@@ -0,0 +1,82 @@
+#ifndef RTT_H
+#define RTT_H
+
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "protocol.h"
+
+// Per-session round-trip estimation (RFC 6298): SRTT/RTTVAR smoothing,
+// RTO = SRTT + 4 * RTTVAR clamped to [min_rto_us, TIMEOUT_MS], and exponential
+// backoff on every timeout until a fresh sample arrives. Callers apply Karn's
+// rule by never sampling a packet that has been retransmitted.
+
+// Monotonic clock in microseconds
+static inline uint64_t now_us(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER count;
+    if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000 +
+           (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+typedef struct {
+    uint32_t srtt_us;       // Smoothed round-trip time
+    uint32_t rttvar_us;     // Round-trip time variation
+    uint32_t rto_us;        // Current retransmission timeout, backoff included
+    uint32_t backoff;       // Consecutive timeouts since the last sample
+    uint32_t samples;
+    uint32_t min_rto_us;    // RTO floor, raised above the peer's delayed-ACK timer
+} RttEstimator;
+
+static inline void rtt_init(RttEstimator *est) {
+    est->srtt_us = 0;
+    est->rttvar_us = 0;
+    est->rto_us = RTO_INITIAL_MS * 1000;
+    est->backoff = 0;
+    est->samples = 0;
+    est->min_rto_us = RTO_MIN_MS * 1000;
+}
+
+// The peer may hold an ACK for up to ack_delay_us; never time out sooner
+static inline void rtt_set_ack_delay(RttEstimator *est, uint32_t ack_delay_us) {
+    est->min_rto_us = RTO_MIN_MS * 1000 + ack_delay_us;
+}
+
+static inline void rtt_sample(RttEstimator *est, uint32_t sample_us) {
+    if (est->samples == 0) {
+        est->srtt_us = sample_us;
+        est->rttvar_us = sample_us / 2;
+    } else {
+        uint32_t delta = est->srtt_us > sample_us ? est->srtt_us - sample_us : sample_us - est->srtt_us;
+        est->rttvar_us = (3 * est->rttvar_us + delta) / 4;
+        est->srtt_us = (7 * est->srtt_us + sample_us) / 8;
+    }
+    est->samples++;
+    est->backoff = 0;
+
+    uint32_t rto = est->srtt_us + 4 * est->rttvar_us;
+    if (rto < est->min_rto_us) rto = est->min_rto_us;
+    if (rto > TIMEOUT_MS * 1000) rto = TIMEOUT_MS * 1000;
+    est->rto_us = rto;
+}
+
+// Timer expired: double the timeout, capped at TIMEOUT_MS
+static inline void rtt_backoff(RttEstimator *est) {
+    est->rto_us = est->rto_us * 2 > TIMEOUT_MS * 1000 ? TIMEOUT_MS * 1000 : est->rto_us * 2;
+    est->backoff++;
+}
+
+#endif // RTT_H
@@ -0,0 +1,373 @@
+#ifndef SACK_H
+#define SACK_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "protocol.h"
+
+// Selective Repeat window bookkeeping shared by every sender and receiver.
+//
+// Receivers buffer out-of-order packets and answer each data packet with a
+// cumulative ACK (ack_num = last in-order seq) flagged FLAG_SACK. The ACK
+// payload is a bitmap of packets held beyond the cumulative point: bit i
+// (LSB first, byte i / 8) stands for seq ack_num + 2 + i. Senders that see
+// FLAG_SACK retransmit only the holes; senders talking to a receiver that
+// never SACKs (legacy peers) keep the Go-Back-N behaviour on timeout.
+//
+// Flow control: every ACK advertises in window_size how many packets past
+// ack_num the receiver can still take (ring space not tied up by data that is
+// in order but not yet written out). Packets held out of order sit inside that
+// span, so they do not shrink it. Senders never send beyond base + rwnd and,
+// when the window closes with nothing in flight, probe with one packet per
+// retransmission timeout instead of treating the silence as loss. Only SACK
+// ACKs are trusted for this: legacy receivers leave window_size uninitialised.
+//
+// Both windows are ring buffers of up to MAX_WINDOW_SIZE packets indexed by
+// seq % capacity, allocated per transfer. Large allocations are zero pages
+// until touched, so memory only grows as far as the congestion window does.
+
+#define SACK_DUP_THRESH 3   // SACKed packets above a hole before it is resent
+
+/*------------------------------------------ Receiver ------------------------------------------*/
+
+typedef struct {
+    uint32_t expected_seq;      // Next in-order sequence number
+    uint32_t fin_seq;           // Sequence number flagged FIN, 0 until seen
+    uint32_t high_seq;          // Highest sequence number buffered
+    uint32_t held;              // Packets buffered and not yet delivered
+    uint32_t unwritten;         // Delivered in order but not yet on disk
+    uint32_t capacity;          // Ring size in packets
+    uint32_t rebuilt;           // Packets rebuilt from FEC repair packets (fec.h)
+    Packet  *slots;
+    uint8_t *present;
+} RecvWindow;
+
+// Returns -1 if the ring cannot be allocated.
+static inline int recv_window_init(RecvWindow *rw) {
+    memset(rw, 0, sizeof(*rw));
+    rw->expected_seq = 1;
+    rw->capacity = MAX_WINDOW_SIZE;
+    rw->slots = (Packet *)calloc(rw->capacity, sizeof(Packet));
+    rw->present = (uint8_t *)calloc(rw->capacity, 1);
+    if (!rw->slots || !rw->present) {
+        free(rw->slots);
+        free(rw->present);
+        return -1;
+    }
+    return 0;
+}
+
+static inline void recv_window_free(RecvWindow *rw) {
+    free(rw->slots);
+    free(rw->present);
+    rw->slots = NULL;
+    rw->present = NULL;
+}
+
+// Starts the window at seq: the packets before it are already on disk (a
+// resumed transfer). Call it before the first packet arrives.
+static inline void recv_window_skip(RecvWindow *rw, uint32_t seq) {
+    if (seq > rw->expected_seq) rw->expected_seq = seq;
+}
+
+// Packets the receiver can take past the cumulative ACK
+static inline uint16_t recv_window_space(const RecvWindow *rw) {
+    uint32_t space = rw->capacity > rw->unwritten ? rw->capacity - rw->unwritten : 0;
+    return (uint16_t)(space > 0xFFFF ? 0xFFFF : space);
+}
+
+// Stores a data packet. Returns 1 if it was new, 0 for duplicates and packets
+// outside the receive window.
+static inline int recv_window_accept(RecvWindow *rw, const Packet *pkt) {
+    uint32_t seq = pkt->header.seq_num;
+    if (seq < rw->expected_seq || seq >= rw->expected_seq + rw->capacity - rw->unwritten) return 0;
+
+    uint32_t idx = seq % rw->capacity;
+    if (rw->present[idx]) return 0;
+
+    memcpy(&rw->slots[idx], pkt, sizeof(PacketHeader) + pkt->header.data_len);
+    rw->present[idx] = 1;
+    rw->held++;
+    if (seq > rw->high_seq) rw->high_seq = seq;
+    if (pkt->header.flags & FLAG_FIN) rw->fin_seq = seq;
+    return 1;
+}
+
+// Pops the next in-order packet, or NULL while it is still missing. The
+// pointer stays valid until the next recv_window_accept().
+static inline Packet *recv_window_next(RecvWindow *rw) {
+    uint32_t idx = rw->expected_seq % rw->capacity;
+    if (!rw->present[idx]) return NULL;
+    rw->present[idx] = 0;
+    rw->held--;
+    rw->expected_seq++;
+    return &rw->slots[idx];
+}
+
+// 1 if pkt is the next expected packet and nothing is buffered past a hole
+static inline int recv_window_in_order(const RecvWindow *rw, const Packet *pkt) {
+    return pkt->header.seq_num == rw->expected_seq && rw->held == 0;
+}
+
+static inline int recv_window_done(const RecvWindow *rw) {
+    return rw->fin_seq != 0 && rw->expected_seq > rw->fin_seq;
+}
+
+// Cumulative ACK plus the bitmap of everything buffered past the first hole.
+// seq_num, unused in ACKs otherwise, tells an FEC sender how many packets the
+// receiver rebuilt so far.
+static inline void recv_window_build_ack(const RecvWindow *rw, Packet *ack) {
+    memset(&ack->header, 0, sizeof(PacketHeader));
+    ack->header.seq_num = rw->rebuilt;
+    ack->header.ack_num = rw->expected_seq - 1;
+    ack->header.window_size = recv_window_space(rw);
+    ack->header.flags = FLAG_ACK | FLAG_SACK;
+
+    if (rw->held == 0) return;
+
+    uint32_t span = rw->high_seq - rw->expected_seq;   // bits needed, seq expected+1 .. high
+    if (span > DATA_SIZE * 8) span = DATA_SIZE * 8;
+    memset(ack->data, 0, (span + 7) / 8);
+    for (uint32_t i = 0; i < span; i++) {
+        if (rw->present[(rw->expected_seq + 1 + i) % rw->capacity]) {
+            ack->data[i >> 3] |= (char)(1 << (i & 7));
+        }
+    }
+    ack->header.data_len = (span + 7) / 8;
+}
+
+/*------------------------------------------- Sender -------------------------------------------*/
+
+typedef struct {
+    Packet  pkt;
+    uint8_t sacked;         // Receiver holds it out of order
+    uint8_t lost;           // Queued for selective retransmission
+    uint8_t retransmitted;  // Resent since the last timeout
+    uint8_t resent;         // Ever sent twice: never RTT-sampled (Karn's rule)
+    uint64_t sent_us;       // Time of the latest transmission
+} SendSlot;
+
+typedef struct {
+    uint32_t base;          // Oldest unacknowledged sequence number
+    uint32_t next_seq;      // Next sequence number to (re)send in order
+    uint32_t high_water;    // First sequence number never sent
+    uint32_t total_packets;
+    uint32_t high_sacked;   // Highest sequence number SACKed so far
+    uint32_t sacked_count;  // SACKed slots above base
+    uint32_t lost_count;    // Slots flagged lost and not yet resent
+    uint32_t lost_cursor;   // No lost slot below this sequence number
+    uint32_t loss_floor;    // Holes below this one have been judged already
+    uint32_t loss_events;   // Bumped whenever SACK evidence marks a new hole lost
+    uint32_t rwnd;          // Receiver-advertised window, packets past base - 1
+    uint32_t probes;        // Zero-window probes sent
+    int      probe;         // Next new packet may go past a closed window
+    int      selective;     // Peer sends SACK bitmaps, resend holes only
+    uint32_t capacity;      // Ring size in packets
+    SendSlot *slots;
+} SendWindow;
+
+// Returns -1 if the ring cannot be allocated.
+static inline int send_window_init(SendWindow *sw, uint32_t total_packets) {
+    memset(sw, 0, sizeof(*sw));
+    sw->base = 1;
+    sw->next_seq = 1;
+    sw->high_water = 1;
+    sw->total_packets = total_packets;
+    sw->rwnd = MAX_WINDOW_SIZE;
+    sw->capacity = total_packets < MAX_WINDOW_SIZE ? total_packets : MAX_WINDOW_SIZE;
+    if (sw->capacity == 0) sw->capacity = 1;
+    sw->slots = (SendSlot *)calloc(sw->capacity, sizeof(SendSlot));
+    return sw->slots ? 0 : -1;
+}
+
+static inline void send_window_free(SendWindow *sw) {
+    free(sw->slots);
+    sw->slots = NULL;
+}
+
+// Moves the window to start at seq: the receiver already has everything
+// before it (a resumed transfer). Whatever was in flight below seq is
+// forgotten; the receiver only ACKs it.
+static inline void send_window_skip(SendWindow *sw, uint32_t seq) {
+    if (seq <= sw->base) return;
+    memset(sw->slots, 0, sw->capacity * sizeof(SendSlot));
+    sw->base = sw->next_seq = sw->high_water = seq;
+    sw->high_sacked = sw->sacked_count = sw->lost_count = 0;
+    sw->lost_cursor = sw->loss_floor = 0;
+    sw->probe = 0;
+}
+
+static inline SendSlot *send_window_slot(SendWindow *sw, uint32_t seq) {
+    return &sw->slots[seq % sw->capacity];
+}
+
+// Packets the network is believed to hold: sent, not SACKed, not given up on.
+static inline uint32_t send_window_in_flight(const SendWindow *sw) {
+    if (!sw->selective) return sw->next_seq - sw->base;
+    return (sw->high_water - sw->base) - sw->sacked_count - sw->lost_count;
+}
+
+// May another packet (new or retransmitted) go out under the given limit?
+static inline int send_window_has_room(const SendWindow *sw, uint32_t limit) {
+    return send_window_in_flight(sw) < limit;
+}
+
+// May the next new sequence number go out under the congestion limit and
+// the receiver's advertised window?
+static inline int send_window_can_send(const SendWindow *sw, uint32_t limit) {
+    return sw->next_seq <= sw->total_packets &&
+           sw->next_seq < sw->base + sw->capacity &&
+           (sw->next_seq < sw->base + sw->rwnd || sw->probe) &&
+           send_window_has_room(sw, limit);
+}
+
+static inline void send_window_advance(SendWindow *sw) {
+    if (sw->probe && sw->next_seq >= sw->base + sw->rwnd) {
+        sw->probe = 0;
+        sw->probes++;
+    }
+    sw->next_seq++;
+    if (sw->next_seq > sw->high_water) sw->high_water = sw->next_seq;
+}
+
+// Records a transmission of seq. Returns 1 if it was a retransmission.
+static inline int send_window_sent(SendWindow *sw, uint32_t seq, uint64_t now) {
+    SendSlot *slot = send_window_slot(sw, seq);
+    int again = seq < sw->high_water;
+    if (again) slot->resent = 1;
+    slot->sent_us = now;
+    return again;
+}
+
+static inline void send_window_mark_lost(SendWindow *sw, uint32_t seq) {
+    SendSlot *slot = send_window_slot(sw, seq);
+    if (!slot->lost) {
+        slot->lost = 1;
+        sw->lost_count++;
+        if (seq < sw->lost_cursor) sw->lost_cursor = seq;
+    }
+}
+
+// Applies a cumulative ACK and its SACK bitmap. Returns the number of packets
+// newly acknowledged either way; *rtt_us gets the RTT of the most recently sent
+// of them that was never retransmitted, or -1 if there is none.
+static inline uint32_t send_window_on_ack(SendWindow *sw, const Packet *ack, uint64_t now, int64_t *rtt_us) {
+    uint32_t ack_num = ack->header.ack_num;
+    uint32_t newly = 0;
+    uint32_t newly_sacked = 0;
+    uint64_t newest_sent = 0;
+
+    *rtt_us = -1;
+
+    if (ack->header.flags & FLAG_SACK) sw->selective = 1;
+    if ((ack->header.flags & FLAG_SACK) && ack_num + 1 >= sw->base) {
+        sw->rwnd = ack->header.window_size;
+        if (sw->rwnd > 0) sw->probe = 0;
+    }
+
+    if (ack_num >= sw->base && ack_num < sw->high_water) {
+        for (uint32_t seq = sw->base; seq <= ack_num; seq++) {
+            SendSlot *slot = send_window_slot(sw, seq);
+            if (slot->sacked) {
+                sw->sacked_count--;
+            } else {
+                newly++;
+                if (!slot->resent && slot->sent_us > newest_sent) newest_sent = slot->sent_us;
+            }
+            if (slot->lost) sw->lost_count--;
+            slot->sacked = slot->lost = slot->retransmitted = slot->resent = 0;
+        }
+        sw->base = ack_num + 1;
+    }
+    if (sw->next_seq < sw->base) sw->next_seq = sw->base;
+
+    if (ack->header.flags & FLAG_SACK) {
+        uint32_t bits = (uint32_t)(ack->header.data_len < DATA_SIZE ? ack->header.data_len : DATA_SIZE) * 8;
+        for (uint32_t i = 0; i < bits; i++) {
+            if (ack->data[i >> 3] == 0) {
+                i |= 7;
+                continue;
+            }
+            if (!(ack->data[i >> 3] & (1 << (i & 7)))) continue;
+            uint32_t seq = ack_num + 2 + i;
+            if (seq < sw->base || seq >= sw->high_water) continue;
+            SendSlot *slot = send_window_slot(sw, seq);
+            if (slot->sacked) continue;
+            if (slot->lost) {
+                slot->lost = 0;
+                sw->lost_count--;
+            }
+            slot->sacked = 1;
+            sw->sacked_count++;
+            newly++;
+            newly_sacked++;
+            if (!slot->resent && slot->sent_us > newest_sent) newest_sent = slot->sent_us;
+            if (seq > sw->high_sacked) sw->high_sacked = seq;
+        }
+    }
+
+    // A hole with SACK_DUP_THRESH packets delivered above it is lost. Holes
+    // below loss_floor were judged by an earlier ACK, so only the new span is walked.
+    if (newly_sacked > 0) {
+        uint32_t above = 0;
+        uint32_t floor = sw->loss_floor > sw->base ? sw->loss_floor : sw->base;
+        uint32_t new_floor = 0;
+        for (uint32_t seq = sw->high_sacked; seq >= floor; seq--) {
+            SendSlot *slot = send_window_slot(sw, seq);
+            if (slot->sacked) {
+                if (++above == SACK_DUP_THRESH) new_floor = seq;
+            } else if (above >= SACK_DUP_THRESH && !slot->retransmitted && !slot->lost) {
+                send_window_mark_lost(sw, seq);
+                sw->loss_events++;
+            }
+        }
+        if (new_floor > sw->loss_floor) sw->loss_floor = new_floor;
+    }
+
+    if (newest_sent != 0 && now >= newest_sent) *rtt_us = (int64_t)(now - newest_sent);
+    return newly;
+}
+
+// Pops the next hole to resend. Returns 0 when none are queued.
+static inline int send_window_next_lost(SendWindow *sw, uint32_t *seq_out) {
+    if (sw->lost_count == 0) return 0;
+    uint32_t seq = sw->lost_cursor > sw->base ? sw->lost_cursor : sw->base;
+    for (; seq < sw->high_water; seq++) {
+        SendSlot *slot = send_window_slot(sw, seq);
+        if (slot->lost) {
+            slot->lost = 0;
+            slot->retransmitted = 1;
+            sw->lost_count--;
+            sw->lost_cursor = seq + 1;
+            *seq_out = seq;
+            return 1;
+        }
+    }
+    sw->lost_count = 0;
+    return 0;
+}
+
+// Retransmission timeout: Go-Back-N for legacy receivers, every unSACKed
+// hole for selective ones. Returns 0 if nothing was outstanding because the
+// receiver's window is closed: that is a persist probe, not a loss.
+static inline int send_window_on_timeout(SendWindow *sw) {
+    if (sw->base == sw->high_water && sw->next_seq >= sw->base + sw->rwnd) {
+        sw->probe = 1;
+        return 0;
+    }
+    if (!sw->selective) {
+        sw->next_seq = sw->base;
+        return 1;
+    }
+    for (uint32_t seq = sw->base; seq < sw->high_water; seq++) {
+        SendSlot *slot = send_window_slot(sw, seq);
+        slot->retransmitted = 0;
+        if (!slot->sacked) send_window_mark_lost(sw, seq);
+    }
+    sw->lost_cursor = sw->base;
+    sw->loss_floor = 0;
+    return 1;
+}
+
+#endif // SACK_H
@@ -0,0 +1,127 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "ackpolicy.h"
+#include "cc.h"
+#include "rtt.h"
+#include "sack.h"
+
+// Per-transfer counters printed when a session ends
+typedef struct {
+    uint64_t start_us;
+    uint64_t bytes;             // Payload bytes delivered
+    uint32_t data_packets;      // Data packets sent (receiver: received), retransmissions included
+    uint32_t retransmits;
+    uint32_t timeouts;
+    uint32_t acks;              // Valid ACKs received (receiver: sent)
+    uint32_t fec_repairs;       // FEC repair packets sent (receiver: received)
+    uint32_t fec_rebuilt;       // Data packets rebuilt from them (sender: as the receiver reports)
+} TransferStats;
+
+static inline void stats_init(TransferStats *st) {
+    st->start_us = now_us();
+    st->bytes = 0;
+    st->data_packets = 0;
+    st->retransmits = 0;
+    st->timeouts = 0;
+    st->acks = 0;
+    st->fec_repairs = 0;
+    st->fec_rebuilt = 0;
+}
+
+static inline void stats_print_fec(const char *tag, const TransferStats *st) {
+    if (!st->fec_repairs) return;
+    printf("%sFEC: %u repair packets, %u data packets rebuilt\n", tag, st->fec_repairs, st->fec_rebuilt);
+}
+
+static inline void stats_print_sender(const char *tag, const TransferStats *st, const SendWindow *sw,
+                                      const RttEstimator *rtt, const CongestionControl *cc) {
+    double secs = (now_us() - st->start_us) / 1e6;
+    printf("%sStats: %llu bytes in %.3f s (%.2f MB/s), %u packets, %u retransmits, %u timeouts, "
+           "%u ACKs (%.2f per data packet)\n",
+           tag, (unsigned long long)st->bytes, secs, secs > 0 ? st->bytes / secs / 1e6 : 0.0,
+           st->data_packets, st->retransmits, st->timeouts, st->acks,
+           st->data_packets ? (double)st->acks / st->data_packets : 0.0);
+    printf("%sRTT: srtt %.3f ms, rttvar %.3f ms, rto %.3f ms, %u samples\n",
+           tag, rtt->srtt_us / 1000.0, rtt->rttvar_us / 1000.0, rtt->rto_us / 1000.0, rtt->samples);
+    printf("%sCwnd: %u packets, rwnd %u, ssthresh %.0f, %u loss events, %u zero-window probes\n",
+           tag, cc_window(cc), sw->rwnd, cc->ssthresh, cc->loss_events, sw->probes);
+    stats_print_fec(tag, st);
+}
+
+static inline void stats_print_receiver(const char *tag, const TransferStats *st, const AckPolicy *ack) {
+    double secs = (now_us() - st->start_us) / 1e6;
+    printf("%sStats: %llu bytes in %.3f s (%.2f MB/s), %u packets, %u ACKs (%.2f per data packet, "
+           "every %u / %u ms)\n",
+           tag, (unsigned long long)st->bytes, secs, secs > 0 ? st->bytes / secs / 1e6 : 0.0,
+           st->data_packets, st->acks, st->data_packets ? (double)st->acks / st->data_packets : 0.0,
+           ack->every, ack->delay_us / 1000);
+    stats_print_fec(tag, st);
+}
+
+/*------------------------------------ Latency by file size ------------------------------------*/
+
+#define LATENCY_BUCKETS 5           // <= 1 KB, 64 KB, 1 MB, 64 MB, and larger
+#define LATENCY_SLOTS 128           // Log-scale histogram: 4 slots per doubling of the latency
+
+// Time from command to complete file, per size class of the file
+typedef struct {
+    uint32_t count[LATENCY_BUCKETS];
+    uint64_t total_us[LATENCY_BUCKETS];
+    uint64_t max_us[LATENCY_BUCKETS];
+    uint32_t hist[LATENCY_BUCKETS][LATENCY_SLOTS];
+} LatencyStats;
+
+// Slot of us: the doubling it falls in and which quarter of it
+static inline unsigned latency_slot(uint64_t us) {
+    unsigned log = 2;
+    if (us < 4) return (unsigned)us;
+    while (us >> (log + 1)) log++;
+    unsigned slot = log * 4 + (unsigned)((us >> (log - 2)) & 3);
+    return slot < LATENCY_SLOTS ? slot : LATENCY_SLOTS - 1;
+}
+
+// Upper end of a slot, which percentiles report
+static inline uint64_t latency_slot_max(unsigned slot) {
+    if (slot < 8) return slot < 4 ? slot : 3;
+    unsigned log = slot / 4;
+    return ((uint64_t)(4 + slot % 4 + 1) << (log - 2)) - 1;
+}
+
+static inline void latency_record(LatencyStats *l, long long size, uint64_t us) {
+    static const long long bucket_max[LATENCY_BUCKETS - 1] = {1024, 64 * 1024, 1 << 20, 64 << 20};
+    unsigned b = 0;
+    while (b < LATENCY_BUCKETS - 1 && size > bucket_max[b]) b++;
+    l->count[b]++;
+    l->total_us[b] += us;
+    if (us > l->max_us[b]) l->max_us[b] = us;
+    l->hist[b][latency_slot(us)]++;
+}
+
+static inline uint64_t latency_percentile(const LatencyStats *l, unsigned b, double p) {
+    uint64_t want = (uint64_t)(l->count[b] * p + 0.5), seen = 0;
+    if (want == 0) want = 1;
+    for (unsigned s = 0; s < LATENCY_SLOTS; s++) {
+        seen += l->hist[b][s];
+        if (seen >= want) return latency_slot_max(s) < l->max_us[b] ? latency_slot_max(s) : l->max_us[b];
+    }
+    return l->max_us[b];
+}
+
+static inline void latency_print(const LatencyStats *l) {
+    static const char *const names[LATENCY_BUCKETS] = {"<= 1 KB", "<= 64 KB", "<= 1 MB", "<= 64 MB", "> 64 MB"};
+    int any = 0;
+    for (unsigned b = 0; b < LATENCY_BUCKETS; b++) {
+        if (!l->count[b]) continue;
+        if (!any) printf("Latency by file size:\n");
+        any = 1;
+        printf("  %-8s %u files, avg %.3f ms, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", names[b],
+               l->count[b], l->total_us[b] / 1000.0 / l->count[b], latency_percentile(l, b, 0.50) / 1000.0,
+               latency_percentile(l, b, 0.99) / 1000.0, l->max_us[b] / 1000.0);
+    }
+}
+
+#endif // STATS_H
@@ -0,0 +1,338 @@
+#ifndef UDPBATCH_H
+#define UDPBATCH_H
+
+// Batched datagram I/O for the Linux programs: outgoing packets are queued and
+// leave in one sendmmsg() per batch, incoming ones are drained with one
+// recvmmsg() per batch. Packets that stay put until the flush (send window
+// slots) are referenced in place; transient ones (ACKs, replies built on the
+// stack) are copied into the batch. Linux only.
+//
+// With UDP GSO, consecutive equal-sized packets to one peer are chained into a
+// single message that the kernel cuts back into datagrams, so a window burst
+// costs a handful of messages. With UDP GRO the kernel hands back runs of
+// datagrams from one peer as one buffer, which recv_batch_fill() splits again.
+// Both are optional and stay off where the kernel refuses them.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "protocol.h"
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+#define UDP_BATCH_MAX 64        // Messages per sendmmsg/recvmmsg call
+#define UDP_BATCH_IOV 1024      // Datagrams queued before a forced flush, GSO chains included
+#define UDP_GSO_MAX_SEGS 62     // 62 full packets stay under the 64 KB UDP limit
+#define UDP_GSO_MAX_BYTES 65000
+#define UDP_GRO_MSGS 8          // Coalesced buffers per recvmmsg with GRO on
+#define UDP_GRO_BUF_BYTES 65536
+#define UDP_RECV_MAX (UDP_GRO_MSGS * UDP_GSO_MAX_SEGS)
+
+typedef struct {
+    int            fd;      // Socket the queued packets go out on
+    int            gso;     // Chain equal-sized packets into UDP_SEGMENT messages
+    unsigned       count;   // Messages queued
+    unsigned       niov;    // Datagrams queued
+    unsigned       ncopies;
+    struct mmsghdr msgs[UDP_BATCH_MAX];
+    struct sockaddr_in addrs[UDP_BATCH_MAX];
+    uint16_t       seg_size[UDP_BATCH_MAX];  // Size of the first datagram of each message
+    uint16_t       segs[UDP_BATCH_MAX];
+    uint32_t       bytes[UDP_BATCH_MAX];
+    uint8_t        closed[UDP_BATCH_MAX];    // Ends in a short datagram, cannot grow
+    char           ctrl[UDP_BATCH_MAX][CMSG_SPACE(sizeof(uint16_t))];
+    struct iovec   iov[UDP_BATCH_IOV];
+    Packet         copies[UDP_BATCH_MAX];
+    uint64_t       calls;   // sendmmsg calls made
+    uint64_t       packets; // Datagrams they carried
+    uint64_t       gso_msgs;     // Messages that carried more than one datagram
+    uint64_t       gso_segments; // Datagrams inside those
+} SendBatch;
+
+typedef struct {
+    int            gro;     // Buffers are UDP_GRO_BUF_BYTES and may hold several datagrams
+    unsigned       count;   // Datagrams from the last fill
+    int            more;    // The last fill used every buffer, more may be waiting
+    Packet        *pkt[UDP_RECV_MAX];
+    uint16_t       len[UDP_RECV_MAX];
+    struct sockaddr_in *from[UDP_RECV_MAX];
+    struct mmsghdr msgs[UDP_BATCH_MAX];
+    struct iovec   iov[UDP_BATCH_MAX];
+    struct sockaddr_in addrs[UDP_BATCH_MAX];
+    char           ctrl[UDP_BATCH_MAX][CMSG_SPACE(sizeof(int))];
+    char          *bufs;
+    uint64_t       calls;   // recvmmsg calls that returned data
+    uint64_t       packets;
+    uint64_t       gro_msgs;     // Buffers that held more than one datagram
+    uint64_t       gro_segments; // Datagrams inside those
+} RecvBatch;
+
+// 1 if the kernel supports UDP_SEGMENT on this socket
+static inline int udp_gso_probe(int fd) {
+    int off = 0;
+    return setsockopt(fd, SOL_UDP, UDP_SEGMENT, &off, sizeof(off)) == 0;
+}
+
+// 1 if the kernel will coalesce received datagrams on this socket
+static inline int udp_gro_enable(int fd) {
+    int on = 1;
+    return setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+}
+
+static inline void send_batch_init(SendBatch *b, int gso) {
+    memset(b, 0, sizeof(*b));
+    b->fd = -1;
+    b->gso = gso;
+}
+
+// Sends the datagrams of message m one by one, after the kernel refused GSO.
+// Each datagram is seg_size bytes (the last may be short) over 1 or 2 iovecs.
+static inline void send_batch_unchain(SendBatch *b, unsigned m) {
+    struct msghdr one = b->msgs[m].msg_hdr;
+    struct iovec *iov = one.msg_iov, *end = iov + one.msg_iovlen;
+
+    one.msg_control = NULL;
+    one.msg_controllen = 0;
+    while (iov < end) {
+        size_t len = 0;
+        one.msg_iov = iov;
+        one.msg_iovlen = 0;
+        while (iov < end && len < b->seg_size[m]) {
+            len += iov->iov_len;
+            iov++;
+            one.msg_iovlen++;
+        }
+        sendmsg(b->fd, &one, 0);
+        b->calls++;
+        b->packets++;
+    }
+}
+
+static inline void send_batch_flush(SendBatch *b) {
+    unsigned sent = 0;
+
+    for (unsigned m = 0; m < b->count; m++) {
+        struct msghdr *h = &b->msgs[m].msg_hdr;
+        if (b->segs[m] < 2) continue;
+        h->msg_control = b->ctrl[m];
+        h->msg_controllen = sizeof(b->ctrl[m]);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(h);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        memcpy(CMSG_DATA(cm), &b->seg_size[m], sizeof(uint16_t));
+    }
+
+    while (sent < b->count) {
+        int n = sendmmsg(b->fd, b->msgs + sent, b->count - sent, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (b->segs[sent] > 1) {
+                printf("UDP GSO rejected (%s), sending plain datagrams\n", strerror(errno));
+                b->gso = 0;
+                for (; sent < b->count; sent++) send_batch_unchain(b, sent);
+                break;
+            }
+            sent++;             // Dropped like a lost datagram; retransmission recovers it
+            continue;
+        }
+        b->calls++;
+        for (unsigned m = sent; m < sent + (unsigned)n; m++) {
+            b->packets += b->segs[m];
+            if (b->segs[m] > 1) {
+                b->gso_msgs++;
+                b->gso_segments += b->segs[m];
+            }
+        }
+        sent += (unsigned)n;
+    }
+    b->count = 0;
+    b->niov = 0;
+    b->ncopies = 0;
+}
+
+// Queues one datagram made of nparts (1 or 2) stable buffers
+static inline void send_batch_queue(SendBatch *b, int fd, const struct sockaddr_in *to, const struct iovec *parts,
+                                    unsigned nparts) {
+    size_t len = 0;
+    for (unsigned i = 0; i < nparts; i++) len += parts[i].iov_len;
+    b->fd = fd;
+
+    // Extend the last message: same peer, no larger than its first datagram,
+    // and only the final datagram of a chain may be short
+    unsigned m = b->count - 1;
+    if (b->gso && b->count && !b->closed[m] && b->segs[m] < UDP_GSO_MAX_SEGS &&
+        b->bytes[m] + len <= UDP_GSO_MAX_BYTES && len <= b->seg_size[m] &&
+        b->addrs[m].sin_addr.s_addr == to->sin_addr.s_addr && b->addrs[m].sin_port == to->sin_port) {
+        memcpy(&b->iov[b->niov], parts, nparts * sizeof(*parts));
+        b->niov += nparts;
+        b->msgs[m].msg_hdr.msg_iovlen += nparts;
+        b->segs[m]++;
+        b->bytes[m] += (uint32_t)len;
+        if (len < b->seg_size[m]) b->closed[m] = 1;
+        return;
+    }
+
+    m = b->count++;
+    b->addrs[m] = *to;
+    memset(&b->msgs[m], 0, sizeof(b->msgs[m]));
+    b->msgs[m].msg_hdr.msg_name = &b->addrs[m];
+    b->msgs[m].msg_hdr.msg_namelen = sizeof(b->addrs[m]);
+    b->msgs[m].msg_hdr.msg_iov = &b->iov[b->niov];
+    b->msgs[m].msg_hdr.msg_iovlen = nparts;
+    memcpy(&b->iov[b->niov], parts, nparts * sizeof(*parts));
+    b->niov += nparts;
+    b->seg_size[m] = (uint16_t)len;
+    b->segs[m] = 1;
+    b->bytes[m] = (uint32_t)len;
+    b->closed[m] = 0;
+}
+
+static inline void send_batch_make_room(SendBatch *b, int fd, unsigned nparts, int copy) {
+    if ((b->count && fd != b->fd) || b->count == UDP_BATCH_MAX || b->niov + nparts > UDP_BATCH_IOV ||
+        (copy && b->ncopies == UDP_BATCH_MAX)) {
+        send_batch_flush(b);
+    }
+}
+
+// Queues a checksummed packet. stable = the packet memory is left untouched
+// until the next flush, so it need not be copied.
+static inline void send_batch_add(SendBatch *b, int fd, const struct sockaddr_in *to, Packet *pkt, int stable) {
+    struct iovec part;
+
+    send_batch_make_room(b, fd, 1, !stable);
+    part.iov_len = sizeof(PacketHeader) + pkt->header.data_len;
+    if (!stable) {
+        Packet *copy = &b->copies[b->ncopies++];
+        memcpy(copy, pkt, part.iov_len);
+        pkt = copy;
+    }
+    part.iov_base = pkt;
+    send_batch_queue(b, fd, to, &part, 1);
+}
+
+// Queues a checksummed packet whose payload lives apart from its header (a
+// file mapping). Both must stay untouched until the next flush.
+static inline void send_batch_add_split(SendBatch *b, int fd, const struct sockaddr_in *to, PacketHeader *hdr,
+                                        const void *payload) {
+    struct iovec parts[2];
+
+    send_batch_make_room(b, fd, 2, 0);
+    parts[0].iov_base = hdr;
+    parts[0].iov_len = sizeof(PacketHeader);
+    parts[1].iov_base = (void *)payload;
+    parts[1].iov_len = hdr->data_len;
+    send_batch_queue(b, fd, to, parts, hdr->data_len ? 2 : 1);
+}
+
+// gro: the sockets read through this batch have UDP_GRO on. Returns -1 if
+// the buffers cannot be allocated.
+static inline int recv_batch_init(RecvBatch *b, int gro) {
+    memset(b, 0, sizeof(*b));
+    b->gro = gro;
+    b->bufs = malloc(gro ? (size_t)UDP_GRO_MSGS * UDP_GRO_BUF_BYTES : UDP_BATCH_MAX * sizeof(Packet));
+    return b->bufs ? 0 : -1;
+}
+
+static inline void recv_batch_free(RecvBatch *b) {
+    free(b->bufs);
+    b->bufs = NULL;
+}
+
+// Size of the datagrams coalesced into a GRO buffer of len bytes: the
+// UDP_GRO control message, or len itself when there is none.
+static inline unsigned udp_gro_segment(struct msghdr *h, unsigned len) {
+    unsigned seg = len;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(h); cm; cm = CMSG_NXTHDR(h, cm)) {
+        int gso_size;
+        if (cm->cmsg_level != SOL_UDP || cm->cmsg_type != UDP_GRO) continue;
+        memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+        if (gso_size > 0) seg = (unsigned)gso_size;
+    }
+    return seg ? seg : 1;   // Empty datagram, still reported
+}
+
+// Appends the datagrams of one received buffer (several when GRO coalesced
+// them) as pkt/len/from entries. The buffer must outlive the entries.
+static inline void recv_batch_split(RecvBatch *b, char *buf, unsigned len, unsigned seg, struct sockaddr_in *from) {
+    unsigned segs = 0;
+    for (unsigned off = 0; (off < len || segs == 0) && b->count < UDP_RECV_MAX; off += seg, segs++) {
+        b->pkt[b->count] = (Packet *)(buf + off);
+        b->len[b->count] = (uint16_t)(len - off < seg ? len - off : seg);
+        b->from[b->count] = from;
+        b->count++;
+    }
+    if (segs > 1) {
+        b->gro_msgs++;
+        b->gro_segments += segs;
+    }
+}
+
+// Reads a batch of datagrams. flags: MSG_DONTWAIT to poll, or MSG_WAITFORONE
+// to block for the first one only. Returns the number of datagrams, GRO
+// buffers already split, 0 if none were waiting. They stay valid as
+// pkt[i] / len[i] / from[i] until the next fill.
+static inline unsigned recv_batch_fill(RecvBatch *b, int fd, int flags) {
+    unsigned nmsgs = b->gro ? UDP_GRO_MSGS : UDP_BATCH_MAX;
+    size_t buf_size = b->gro ? UDP_GRO_BUF_BYTES : sizeof(Packet);
+
+    for (unsigned i = 0; i < nmsgs; i++) {
+        b->iov[i].iov_base = b->bufs + i * buf_size;
+        b->iov[i].iov_len = buf_size;
+        memset(&b->msgs[i].msg_hdr, 0, sizeof(b->msgs[i].msg_hdr));
+        b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+        b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+        b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+        b->msgs[i].msg_hdr.msg_iovlen = 1;
+        if (b->gro) {
+            b->msgs[i].msg_hdr.msg_control = b->ctrl[i];
+            b->msgs[i].msg_hdr.msg_controllen = sizeof(b->ctrl[i]);
+        }
+    }
+
+    b->count = 0;
+    int n = recvmmsg(fd, b->msgs, nmsgs, flags, NULL);
+    b->more = n == (int)nmsgs;
+    if (n <= 0) return 0;
+    b->calls++;
+
+    for (int i = 0; i < n; i++) {
+        unsigned len = b->msgs[i].msg_len;
+        unsigned seg = b->gro ? udp_gro_segment(&b->msgs[i].msg_hdr, len) : (len ? len : 1);
+        recv_batch_split(b, b->iov[i].iov_base, len, seg, &b->addrs[i]);
+    }
+    b->packets += b->count;
+    return b->count;
+}
+
+static inline void udp_batch_print(const char *tag, const SendBatch *tx, const RecvBatch *rx) {
+    printf("%sBatching: %.1f datagrams per sendmmsg (%llu calls), %.1f per recvmmsg (%llu calls)\n", tag,
+           tx->calls ? (double)tx->packets / tx->calls : 0.0, (unsigned long long)tx->calls,
+           rx->calls ? (double)rx->packets / rx->calls : 0.0, (unsigned long long)rx->calls);
+    if (tx->gso || rx->gro) {
+        printf("%sOffload: GSO %s, %.1f datagrams per message (%llu); GRO %s, %.1f per buffer (%llu)\n", tag,
+               tx->gso ? "on" : "off", tx->gso_msgs ? (double)tx->gso_segments / tx->gso_msgs : 0.0,
+               (unsigned long long)tx->gso_msgs, rx->gro ? "on" : "off",
+               rx->gro_msgs ? (double)rx->gro_segments / rx->gro_msgs : 0.0, (unsigned long long)rx->gro_msgs);
+    }
+}
+
+static inline void udp_batch_reset_counters(SendBatch *tx, RecvBatch *rx) {
+    tx->calls = tx->packets = tx->gso_msgs = tx->gso_segments = 0;
+    rx->calls = rx->packets = rx->gro_msgs = rx->gro_segments = 0;
+}
+
+#endif // UDPBATCH_H
@@ -0,0 +1,430 @@
+#ifndef CACHEINDEX_H
+#define CACHEINDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Index of the proxy's cache directory, kept in a file of its own
+// (<dir>/.index) and mapped shared, so it is the on-disk copy itself: a
+// restart maps it and carries on, without listing the directory. It records
+// the size, last access and hit count of every file, and holds a count-min
+// sketch of how often each name was asked for (TinyLFU), hits and misses
+// alike, halved every CACHE_SKETCH_RESET requests so that old popularity
+// fades.
+//
+// The directory is kept under a byte quota. A file that needs room is only
+// admitted if it has been asked for more often than each file it would
+// evict, so a one-off request cannot push out files in steady demand.
+// Victims are picked from random samples of CACHE_EVICT_SAMPLE files: the
+// one with the fewest requests per byte goes first, so one large, rarely
+// used file makes room for many small popular ones.
+//
+// Each entry also holds what the origin said of the file when it was last
+// checked (its mtime and etag, the CRC-32C of command.h) and how long that
+// check holds: a heuristic TTL of a tenth of the file's age at the time,
+// at least CACHE_TTL_MIN_S and at most the proxy's --ttl, as web caches do. Past it the file is stale,
+// and for another --stale seconds is still served while one conditional get
+// revalidates it in the background; after that a get waits for the check.
+// Files found by a directory scan were never checked: they are stale until
+// their first check, served meanwhile, which with no etag yet downloads them
+// again in the background.
+//
+// Names are found by linear probing; removal shifts the rest of the run back,
+// so there are no tombstones. The workers share the index under a mutex.
+
+#define CACHE_INDEX_NAME ".index"
+#define CACHE_INDEX_MAGIC 0x32584943u               // "CIX2"
+#define CACHE_INDEX_SLOTS 16384                     // Power of two
+#define CACHE_INDEX_MAX (CACHE_INDEX_SLOTS * 3 / 4) // Files at most, to keep probe runs short
+#define CACHE_SKETCH_DEPTH 4
+#define CACHE_SKETCH_WIDTH (CACHE_INDEX_SLOTS * 4)  // Counters per row, power of two
+#define CACHE_SKETCH_RESET (CACHE_INDEX_SLOTS * 10) // Requests between halvings
+#define CACHE_EVICT_SAMPLE 8
+#define CACHE_EVICT_MAX 64                          // Victims one admission may cost
+#define CACHE_DISK_MB 1024                          // Default quota
+#define CACHE_TTL_S 300                             // Default cap on the TTL
+#define CACHE_STALE_S 60                            // Default stale-while-revalidate window
+#define CACHE_TTL_MIN_S 1                           // Even a file changed just now is not checked on every get
+
+typedef enum {
+    CACHE_MISS,
+    CACHE_FRESH,
+    CACHE_STALE,        // Serve, and revalidate
+    CACHE_EXPIRED       // Revalidate first
+} CacheState;
+
+// What the origin said of a file
+typedef struct {
+    int64_t  mtime;     // Unix seconds, 0 = not told
+    uint32_t etag;
+    uint32_t has_etag;  // 0 from origins that do not tell
+} CacheMeta;
+
+typedef struct {
+    char     name[200];
+    int64_t  size;
+    int64_t  atime;         // Last access, Unix seconds
+    int64_t  checked;       // Last fetched or revalidated, 0 = never
+    CacheMeta meta;
+    uint32_t ttl;           // Seconds fresh after checked
+    uint32_t hits;          // Requests served from the file
+    uint32_t used;
+} CacheEntry;
+
+// The index file
+typedef struct {
+    uint32_t   magic;
+    uint32_t   slots;
+    uint32_t   sketch_adds;    // Since the last halving
+    uint32_t   pad;
+    uint8_t    sketch[CACHE_SKETCH_DEPTH][CACHE_SKETCH_WIDTH];
+    CacheEntry entries[CACHE_INDEX_SLOTS];
+} CacheIndexFile;
+
+typedef struct {
+    pthread_mutex_t lock;
+    CacheIndexFile *f;
+    char     dir[128];
+    int64_t  quota;
+    uint32_t max_ttl;
+    uint32_t stale;             // Stale-while-revalidate window, seconds
+    int64_t  used;              // Bytes of the indexed files
+    uint32_t objects;
+    int      warm;              // Mapped an existing index
+    uint64_t rng;
+    uint64_t admitted;
+    uint64_t rejected;
+    uint64_t evictions;
+    uint64_t evicted_bytes;
+    uint64_t revalidated;       // Checks the origin answered unchanged
+    void   (*on_evict)(const char *name);   // Told of every file evicted (with the lock held), if set
+} CacheIndex;
+
+static inline uint64_t cache_index_hash(const char *name) {
+    uint64_t h = 14695981039346656037ull;       // FNV-1a
+    while (*name) h = (h ^ (uint8_t)*name++) * 1099511628211ull;
+    return h;
+}
+
+/*------------------------------------------- Sketch -------------------------------------------*/
+
+// Counter of name in row i: double hashing over one 64-bit hash
+static inline uint8_t *cache_sketch_counter(CacheIndexFile *f, uint64_t h, int i) {
+    uint32_t lo = (uint32_t)h, hi = (uint32_t)(h >> 32) | 1;
+    return &f->sketch[i][(lo + (uint32_t)i * hi) & (CACHE_SKETCH_WIDTH - 1)];
+}
+
+static inline void cache_sketch_add(CacheIndexFile *f, const char *name) {
+    uint64_t h = cache_index_hash(name);
+    for (int i = 0; i < CACHE_SKETCH_DEPTH; i++) {
+        uint8_t *c = cache_sketch_counter(f, h, i);
+        if (*c < 255) (*c)++;
+    }
+    if (++f->sketch_adds < CACHE_SKETCH_RESET) return;
+    for (int i = 0; i < CACHE_SKETCH_DEPTH; i++) {
+        for (uint32_t j = 0; j < CACHE_SKETCH_WIDTH; j++) f->sketch[i][j] >>= 1;
+    }
+    f->sketch_adds = 0;
+}
+
+// Requests for name lately (an overestimate, never under)
+static inline uint32_t cache_sketch_estimate(CacheIndexFile *f, const char *name) {
+    uint64_t h = cache_index_hash(name);
+    uint32_t est = 255;
+    for (int i = 0; i < CACHE_SKETCH_DEPTH; i++) {
+        uint8_t c = *cache_sketch_counter(f, h, i);
+        if (c < est) est = c;
+    }
+    return est;
+}
+
+/*------------------------------------------- Table --------------------------------------------*/
+
+// Slot of name, or of the free slot ending its probe run (with the lock held)
+static inline uint32_t cache_index_slot(const CacheIndex *ci, const char *name) {
+    uint32_t i = (uint32_t)cache_index_hash(name) & (CACHE_INDEX_SLOTS - 1);
+    while (ci->f->entries[i].used && strcmp(ci->f->entries[i].name, name) != 0) i = (i + 1) & (CACHE_INDEX_SLOTS - 1);
+    return i;
+}
+
+// Heuristic freshness of a file checked at now
+static inline uint32_t cache_index_ttl(const CacheIndex *ci, const CacheMeta *meta, int64_t now) {
+    if (meta->mtime <= 0) return ci->max_ttl;
+    int64_t ttl = now > meta->mtime ? (now - meta->mtime) / 10 : 0;
+    if (ttl < CACHE_TTL_MIN_S) ttl = CACHE_TTL_MIN_S;
+    return ttl < ci->max_ttl ? (uint32_t)ttl : ci->max_ttl;
+}
+
+static inline CacheEntry *cache_index_insert(CacheIndex *ci, const char *name, int64_t size, int64_t atime) {
+    CacheEntry *en = &ci->f->entries[cache_index_slot(ci, name)];
+    if (en->used) {
+        ci->used -= en->size;
+    } else {
+        snprintf(en->name, sizeof(en->name), "%s", name);
+        en->hits = 0;
+        en->used = 1;
+        ci->objects++;
+    }
+    en->size = size;
+    en->atime = atime;
+    ci->used += size;
+    return en;
+}
+
+// Empties slot i and moves later entries of its run back into the gap
+static inline void cache_index_erase(CacheIndex *ci, uint32_t i) {
+    CacheEntry *e = ci->f->entries;
+    ci->used -= e[i].size;
+    ci->objects--;
+    e[i].used = 0;
+    for (uint32_t j = (i + 1) & (CACHE_INDEX_SLOTS - 1); e[j].used; j = (j + 1) & (CACHE_INDEX_SLOTS - 1)) {
+        uint32_t home = (uint32_t)cache_index_hash(e[j].name) & (CACHE_INDEX_SLOTS - 1);
+        // Movable unless its home lies in (i, j]
+        if (((j - home) & (CACHE_INDEX_SLOTS - 1)) >= ((j - i) & (CACHE_INDEX_SLOTS - 1))) {
+            e[i] = e[j];
+            e[j].used = 0;
+            i = j;
+        }
+    }
+}
+
+// Downloads in progress (<name>.partXXXXXX) and the index are not cached files
+static inline int cache_index_listed_name(const char *name) {
+    size_t len = strlen(name);
+    if (name[0] == '.') return 0;
+    return len <= 11 || memcmp(name + len - 11, ".part", 5) != 0 || strspn(name + len - 6, "0123456789abcdef") != 6;
+}
+
+// Cold start: lists the directory, dropping downloads a crash left behind
+static inline void cache_index_scan(CacheIndex *ci) {
+    char path[512];
+    struct stat st;
+    DIR *d = opendir(ci->dir);
+    if (!d) return;
+    for (struct dirent *de; (de = readdir(d)) != NULL;) {
+        snprintf(path, sizeof(path), "%s/%s", ci->dir, de->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) || strlen(de->d_name) >= sizeof(ci->f->entries[0].name)) {
+            continue;
+        }
+        if (!cache_index_listed_name(de->d_name)) {
+            if (de->d_name[0] != '.') remove(path);
+        } else if (ci->objects < CACHE_INDEX_MAX) {
+            cache_index_insert(ci, de->d_name, st.st_size, st.st_atime);
+        }
+    }
+    closedir(d);
+}
+
+// Maps <dir>/.index, creating it from the directory listing when it is
+// missing or unreadable. Returns -1 if it cannot be mapped.
+static inline int cache_index_open(CacheIndex *ci, const char *dir, int64_t quota, uint32_t max_ttl, uint32_t stale) {
+    char path[256];
+    struct stat st;
+    memset(ci, 0, sizeof(*ci));
+    snprintf(ci->dir, sizeof(ci->dir), "%s", dir);
+    snprintf(path, sizeof(path), "%s/%s", dir, CACHE_INDEX_NAME);
+    ci->quota = quota;
+    ci->max_ttl = max_ttl;
+    ci->stale = stale;
+    ci->rng = cache_index_hash(path) ^ (uint64_t)time(NULL);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    int fresh = st.st_size != (off_t)sizeof(CacheIndexFile);
+    if (fresh && (ftruncate(fd, 0) != 0 || ftruncate(fd, sizeof(CacheIndexFile)) != 0)) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, sizeof(CacheIndexFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    ci->f = (CacheIndexFile *)map;
+
+    ci->warm = !fresh && ci->f->magic == CACHE_INDEX_MAGIC && ci->f->slots == CACHE_INDEX_SLOTS;
+    if (ci->warm) {
+        for (uint32_t i = 0; i < CACHE_INDEX_SLOTS; i++) {
+            if (!ci->f->entries[i].used) continue;
+            ci->objects++;
+            ci->used += ci->f->entries[i].size;
+        }
+    } else {
+        memset(ci->f, 0, sizeof(CacheIndexFile));
+        cache_index_scan(ci);
+        ci->f->slots = CACHE_INDEX_SLOTS;
+        ci->f->magic = CACHE_INDEX_MAGIC;
+    }
+    return pthread_mutex_init(&ci->lock, NULL) == 0 ? 0 : -1;
+}
+
+/*-------------------------------------------- Use ---------------------------------------------*/
+
+// Counts a request for name, a hit if it is in the cache. Returns how fresh
+// the file is, with a copy of its entry in *out unless it is a miss.
+static inline CacheState cache_index_access(CacheIndex *ci, const char *name, CacheEntry *out) {
+    int64_t now = (int64_t)time(NULL);
+    CacheState state = CACHE_MISS;
+    pthread_mutex_lock(&ci->lock);
+    cache_sketch_add(ci->f, name);
+    CacheEntry *en = &ci->f->entries[cache_index_slot(ci, name)];
+    if (en->used) {
+        en->atime = now;
+        en->hits++;
+        *out = *en;
+        int64_t expires = en->checked + en->ttl;
+        state = en->checked > 0 && now < expires ? CACHE_FRESH
+                : en->checked == 0 || now < expires + ci->stale ? CACHE_STALE
+                : CACHE_EXPIRED;
+    }
+    pthread_mutex_unlock(&ci->lock);
+    return state;
+}
+
+// When name was last checked, 0 if never, -1 if it is not in the cache
+static inline int64_t cache_index_checked(CacheIndex *ci, const char *name) {
+    pthread_mutex_lock(&ci->lock);
+    const CacheEntry *en = &ci->f->entries[cache_index_slot(ci, name)];
+    int64_t checked = en->used ? en->checked : -1;
+    pthread_mutex_unlock(&ci->lock);
+    return checked;
+}
+
+// The origin still has the copy of name in the cache, as of now
+static inline void cache_index_revalidated(CacheIndex *ci, const char *name, const CacheMeta *meta) {
+    int64_t now = (int64_t)time(NULL);
+    pthread_mutex_lock(&ci->lock);
+    CacheEntry *en = &ci->f->entries[cache_index_slot(ci, name)];
+    if (en->used) {
+        en->checked = now;
+        en->meta = *meta;
+        en->ttl = cache_index_ttl(ci, meta, now);
+        ci->revalidated++;
+    }
+    pthread_mutex_unlock(&ci->lock);
+}
+
+// The file went missing behind our back
+static inline void cache_index_forget(CacheIndex *ci, const char *name) {
+    pthread_mutex_lock(&ci->lock);
+    uint32_t i = cache_index_slot(ci, name);
+    if (ci->f->entries[i].used) cache_index_erase(ci, i);
+    pthread_mutex_unlock(&ci->lock);
+}
+
+static inline uint64_t cache_index_random(CacheIndex *ci) {
+    ci->rng ^= ci->rng << 13;       // xorshift64
+    ci->rng ^= ci->rng >> 7;
+    ci->rng ^= ci->rng << 17;
+    return ci->rng;
+}
+
+// From a random sample, the file with the fewest requests per byte that is
+// not in chosen yet; CACHE_INDEX_SLOTS if there is none
+static inline uint32_t cache_index_victim(CacheIndex *ci, const uint32_t *chosen, unsigned nchosen) {
+    uint32_t best = CACHE_INDEX_SLOTS;
+    double best_score = 0;
+    uint32_t i = (uint32_t)cache_index_random(ci) & (CACHE_INDEX_SLOTS - 1);
+    for (unsigned seen = 0, probed = 0; seen < CACHE_EVICT_SAMPLE && probed < CACHE_INDEX_SLOTS; probed++) {
+        const CacheEntry *en = &ci->f->entries[i];
+        unsigned k = 0;
+        while (k < nchosen && chosen[k] != i) k++;
+        if (en->used && k == nchosen) {
+            double score = (cache_sketch_estimate(ci->f, en->name) + 1.0) / (double)(en->size + 1);
+            if (best == CACHE_INDEX_SLOTS || score < best_score ||
+                (score == best_score && en->atime < ci->f->entries[best].atime)) {
+                best = i;
+                best_score = score;
+            }
+            seen++;
+        }
+        i = (i + 1) & (CACHE_INDEX_SLOTS - 1);
+    }
+    return best;
+}
+
+// The file name of size bytes, just fetched, is now in the directory: lists
+// it if it earns its place, deleting the files it displaces. A new copy of a
+// listed file keeps the place. Returns 0 if it is not wanted (the caller
+// removes it).
+static inline int cache_index_admit(CacheIndex *ci, const char *name, int64_t size, const CacheMeta *meta) {
+    int64_t now = (int64_t)time(NULL);
+    char path[512];
+    char names[CACHE_EVICT_MAX][sizeof(((CacheEntry *)0)->name)];
+    uint32_t victims[CACHE_EVICT_MAX];
+    unsigned n = 0, gone = 0;
+
+    pthread_mutex_lock(&ci->lock);
+    int64_t room = ci->quota - ci->used;
+    uint32_t slots = CACHE_INDEX_MAX - ci->objects;
+    uint32_t max_est = 0;
+    CacheEntry *self = &ci->f->entries[cache_index_slot(ci, name)];
+    if (self->used) {
+        room += self->size;     // Replacing an older copy
+        slots++;
+    }
+    while ((room < size || slots == 0) && size <= ci->quota && n < CACHE_EVICT_MAX) {
+        uint32_t v = cache_index_victim(ci, victims, n);
+        if (v == CACHE_INDEX_SLOTS) break;
+        CacheEntry *en = &ci->f->entries[v];
+        if (en == self) {
+            victims[n++] = v;   // Never its own victim
+            continue;
+        }
+        uint32_t est = cache_sketch_estimate(ci->f, en->name);
+        if (est > max_est) max_est = est;
+        victims[n++] = v;
+        memcpy(names[gone++], en->name, sizeof(names[0]));  // Erasing moves entries: go by name
+        room += en->size;
+        slots++;
+    }
+    int admit = room >= size && slots > 0 && (gone == 0 || self->used || cache_sketch_estimate(ci->f, name) > max_est);
+    if (!admit) {
+        if (self->used) cache_index_erase(ci, (uint32_t)(self - ci->f->entries));
+        ci->rejected++;
+        pthread_mutex_unlock(&ci->lock);
+        return 0;
+    }
+
+    for (unsigned k = 0; k < gone; k++) {
+        uint32_t i = cache_index_slot(ci, names[k]);
+        ci->evictions++;
+        ci->evicted_bytes += (uint64_t)ci->f->entries[i].size;
+        cache_index_erase(ci, i);
+        snprintf(path, sizeof(path), "%s/%.*s", ci->dir, (int)sizeof(names[0]), names[k]);
+        remove(path);
+        if (ci->on_evict) ci->on_evict(names[k]);
+    }
+    CacheEntry *en = cache_index_insert(ci, name, size, now);
+    en->checked = now;
+    en->meta = *meta;
+    en->ttl = cache_index_ttl(ci, meta, now);
+    ci->admitted++;
+    pthread_mutex_unlock(&ci->lock);
+    return 1;
+}
+
+// One line of counters
+static inline int cache_index_format(CacheIndex *ci, char *out, size_t len) {
+    pthread_mutex_lock(&ci->lock);
+    int n = snprintf(out, len, "Disk index: %u files, %lld of %lld MB, %llu admitted, %llu turned away, "
+                               "%llu evictions (%llu MB), %llu revalidated unchanged\n",
+                     ci->objects, (long long)(ci->used >> 20), (long long)(ci->quota >> 20),
+                     (unsigned long long)ci->admitted, (unsigned long long)ci->rejected,
+                     (unsigned long long)ci->evictions, (unsigned long long)(ci->evicted_bytes >> 20),
+                     (unsigned long long)ci->revalidated);
+    pthread_mutex_unlock(&ci->lock);
+    return n;
+}
+
+#endif // CACHEINDEX_H
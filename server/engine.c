@@ -0,0 +1,1273 @@
+/***************************************************************************************************
+MIT License - Linux session engine (Akamai-Grade Reliable UDP)
+
+epoll + timerfd event loop multiplexing many get/put sessions on one socket,
+optionally receiving through io_uring
+****************************************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#include "engine.h"
+#include "uring.h"
+#include "../common/crc32.h"
+
+// Queues for the next sendmmsg; stable packets (window slots) are not copied
+static void send_packet(Engine *e, int fd, const struct sockaddr_in *to, Packet *pkt, int stable) {
+    pkt->header.checksum = 0;
+    pkt->header.checksum = packet_crc(pkt);
+    send_batch_add(&e->tx, fd, to, pkt, stable);
+    e->rate_tx++;
+}
+
+// Length and checksum check; clears the checksum field as a side effect
+static int packet_valid(Packet *pkt, ssize_t len) {
+    if (len < (ssize_t)sizeof(PacketHeader) || pkt->header.data_len > DATA_SIZE ||
+        (size_t)len < sizeof(PacketHeader) + pkt->header.data_len) return 0;
+
+    uint32_t received_crc = pkt->header.checksum;
+    pkt->header.checksum = 0;
+    return packet_crc(pkt) == received_crc;
+}
+
+void engine_send(Engine *e, const struct sockaddr_in *to, Packet *pkt) {
+    send_packet(e, e->sfd, to, pkt, 0);
+}
+
+static void session_send(Engine *e, Session *s, Packet *pkt, int stable) {
+    if (s->csum == CSUM_CRC32C) pkt->header.flags |= FLAG_CRC32C;
+    send_packet(e, s->fd, &s->peer, pkt, stable);
+}
+
+/*---------------------------------------- Session table ----------------------------------------*/
+
+static uint32_t session_hash(const struct sockaddr_in *addr, uint32_t conn_id) {
+    uint32_t h = addr->sin_addr.s_addr * 2654435761u;
+    h ^= (uint32_t)addr->sin_port * 40503u;
+    h ^= conn_id * 0x9E3779B1u;
+    return (h ^ (h >> 16)) & (SESSION_TABLE_SIZE - 1);
+}
+
+static int session_matches(const Session *s, const struct sockaddr_in *addr, uint32_t conn_id) {
+    return s->conn_id == conn_id && s->peer.sin_addr.s_addr == addr->sin_addr.s_addr &&
+           s->peer.sin_port == addr->sin_port;
+}
+
+// Exact match first; legacy sessions (ID 0) take whatever ID the peer sends
+static Session *session_find(Engine *e, const struct sockaddr_in *addr, uint32_t conn_id) {
+    for (Session *s = e->buckets[session_hash(addr, conn_id)]; s; s = s->next) {
+        if (session_matches(s, addr, conn_id)) return s;
+    }
+    if (conn_id == 0) return NULL;
+    for (Session *s = e->buckets[session_hash(addr, 0)]; s; s = s->next) {
+        if (session_matches(s, addr, 0)) return s;
+    }
+    return NULL;
+}
+
+/*---------------------------------------- Deadline heap ----------------------------------------*/
+
+static void heap_swap(Engine *e, size_t a, size_t b) {
+    Session *t = e->heap[a];
+    e->heap[a] = e->heap[b];
+    e->heap[b] = t;
+    e->heap[a]->heap_idx = a;
+    e->heap[b]->heap_idx = b;
+}
+
+static void heap_sift_up(Engine *e, size_t i) {
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (e->heap[parent]->deadline_us <= e->heap[i]->deadline_us) break;
+        heap_swap(e, i, parent);
+        i = parent;
+    }
+}
+
+static void heap_sift_down(Engine *e, size_t i) {
+    for (;;) {
+        size_t l = 2 * i + 1, r = l + 1, min = i;
+        if (l < e->heap_len && e->heap[l]->deadline_us < e->heap[min]->deadline_us) min = l;
+        if (r < e->heap_len && e->heap[r]->deadline_us < e->heap[min]->deadline_us) min = r;
+        if (min == i) break;
+        heap_swap(e, i, min);
+        i = min;
+    }
+}
+
+static void heap_remove(Engine *e, Session *s) {
+    size_t i = s->heap_idx;
+    if (i == SIZE_MAX) return;
+    s->heap_idx = SIZE_MAX;
+    e->heap_len--;
+    if (i == e->heap_len) return;
+    e->heap[i] = e->heap[e->heap_len];
+    e->heap[i]->heap_idx = i;
+    heap_sift_up(e, i);
+    heap_sift_down(e, e->heap[i]->heap_idx);
+}
+
+// Moves a session to its new deadline (0 removes it from the heap)
+static void session_set_deadline(Engine *e, Session *s, uint64_t deadline_us) {
+    heap_remove(e, s);
+    s->deadline_us = deadline_us;
+    if (deadline_us == 0) return;
+
+    if (e->heap_len == e->heap_cap) {
+        size_t cap = e->heap_cap ? e->heap_cap * 2 : 64;
+        Session **heap = realloc(e->heap, cap * sizeof(*heap));
+        if (!heap) {
+            perror("Engine: heap");
+            exit(EXIT_FAILURE);
+        }
+        e->heap = heap;
+        e->heap_cap = cap;
+    }
+    s->heap_idx = e->heap_len;
+    e->heap[e->heap_len++] = s;
+    heap_sift_up(e, s->heap_idx);
+}
+
+static void engine_arm_timer(Engine *e) {
+    uint64_t next = e->heap_len ? e->heap[0]->deadline_us : 0;
+    if (next == e->armed_us) return;
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = (time_t)(next / 1000000);
+    its.it_value.tv_nsec = (long)(next % 1000000) * 1000;
+    if (next != 0 && its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) its.it_value.tv_nsec = 1;
+    timerfd_settime(e->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+    e->armed_us = next;
+}
+
+/*------------------------------------------ Sessions ------------------------------------------*/
+
+// Outbound sessions have their own socket and stay out of the hash table
+static Session *session_new(Engine *e, const struct sockaddr_in *peer, uint32_t conn_id, SessionRole role,
+                            int outbound) {
+    Session *s = calloc(1, sizeof(*s));
+    if (!s) return NULL;
+
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &peer->sin_addr, ip, sizeof(ip));
+    snprintf(s->tag, sizeof(s->tag), "[%s:%u#%06x] ", ip, ntohs(peer->sin_port), conn_id);
+    s->peer = *peer;
+    s->conn_id = conn_id;
+    s->role = role;
+    s->state = SESSION_ACTIVE;
+    s->fd = e->sfd;
+    s->outbound = outbound;
+    s->heap_idx = SIZE_MAX;
+    stats_init(&s->st);
+
+    if (!outbound) {
+        uint32_t b = session_hash(peer, conn_id);
+        s->next = e->buckets[b];
+        e->buckets[b] = s;
+    }
+    e->sessions++;
+    return s;
+}
+
+// Tears a session down; the memory itself goes once the epoll batch is over,
+// as later events in the same batch may still point at it
+static void session_free(Engine *e, Session *s) {
+    if (!s->outbound) {
+        Session **link = &e->buckets[session_hash(&s->peer, s->conn_id)];
+        while (*link != s) link = &(*link)->next;
+        *link = s->next;
+    } else if (s->fd >= 0 && s->fd != e->sfd) {
+        if (e->tx.count && e->tx.fd == s->fd) send_batch_flush(&e->tx);
+        close(s->fd);
+    }
+
+    heap_remove(e, s);
+    free(s->reply);
+    s->reply = NULL;
+    if (s->role == SESSION_SEND) {
+        // Queued packets may still point into the window slots and the mapping
+        if (e->tx.count) send_batch_flush(&e->tx);
+        file_source_close(&s->src);
+        send_window_free(&s->sw);
+        lz_encoder_free(&s->lz);
+    } else {
+        file_sink_close(&s->sink);  // The writer reads the ring until it stops
+        journal_close(&s->journal, 0);
+        recv_window_free(&s->rw);
+        free(s->request);
+        s->request = NULL;
+    }
+    e->sessions--;
+    s->dead = 1;
+    s->next = e->dead;
+    e->dead = s;
+}
+
+static void engine_reap(Engine *e) {
+    if (!e->dead) return;
+    while (e->dead) {
+        Session *s = e->dead;
+        e->dead = s->next;
+        free(s);
+    }
+
+    // Batching summary for each busy period
+    if (e->sessions == 0 && e->tx.calls) {
+        udp_batch_print("", &e->tx, &e->rx);
+        udp_batch_reset_counters(&e->tx, &e->rx);
+    }
+}
+
+// Reports the outcome to the owner, once. A receiver's writer is stopped
+// first, so the owner is free to take the file (and what it published).
+static void session_done(Engine *e, Session *s, int ok) {
+    SessionDoneFn on_done = s->on_done;
+    s->on_done = NULL;
+    if (on_done && s->role == SESSION_RECV) file_sink_close(&s->sink);
+    if (on_done) on_done(e, s, ok);
+}
+
+// Kept, so that a client whose reply was lost can have it again by repeating
+// the command (engine_on_command)
+static void session_reply_options(Engine *e, Session *s, const Command *c) {
+    if (!c->has_options) return;
+    if (!s->reply && !(s->reply = malloc(sizeof(*s->reply)))) return;
+    command_build_reply(c, s->reply);
+    packet_set_conn_id(&s->reply->header, s->conn_id);
+    engine_send(e, &s->peer, s->reply);
+}
+
+/*------------------------------------------- Sender -------------------------------------------*/
+
+// Sends a window slot. With the file mapped the slot holds only the header
+// and the payload goes out straight from the mapping, unless it was
+// compressed into the slot.
+static void session_send_slot(Engine *e, Session *s, SendSlot *slot) {
+    PacketHeader *h = &slot->pkt.header;
+    if (!s->src.map || (h->flags & FLAG_LZ)) {
+        session_send(e, s, &slot->pkt, 1);
+        return;
+    }
+
+    const char *payload = s->src.map + (long)(h->seq_num - 1) * DATA_SIZE;
+    if (s->csum == CSUM_CRC32C) h->flags |= FLAG_CRC32C;
+    h->checksum = 0;
+    h->checksum = packet_crc_parts(h, payload);
+    send_batch_add_split(&e->tx, s->fd, &s->peer, h, payload);
+    e->rate_tx++;
+}
+
+// Is the packet at seq in a source that is still being filled? Once the
+// whole source is there, it stops looking.
+static int session_source_ready(Session *s, uint32_t seq) {
+    if (!s->src.ready) return 1;
+    long long ready = __atomic_load_n(s->src.ready, __ATOMIC_ACQUIRE);
+    if (ready >= s->src.base + s->src.size) {
+        s->src.ready = NULL;
+        return 1;
+    }
+    long end = (long)seq * DATA_SIZE;
+    return ready >= s->src.base + (end < s->src.size ? end : s->src.size);
+}
+
+// Resends reported holes, then fills the window from the file
+static void session_pump(Engine *e, Session *s) {
+    SendWindow *sw = &s->sw;
+    uint64_t deadline = s->timer_start + s->rtt.rto_us;
+    uint32_t seq;
+
+    while (send_window_has_room(sw, cc_window(&s->cc)) && send_window_next_lost(sw, &seq)) {
+        session_send_slot(e, s, send_window_slot(sw, seq));
+        send_window_sent(sw, seq, now_us());
+        s->st.data_packets++;
+        s->st.retransmits++;
+    }
+
+    while (send_window_can_send(sw, cc_window(&s->cc))) {
+        SendSlot *slot = send_window_slot(sw, sw->next_seq);
+        Packet *out = &slot->pkt;
+        const char *fresh = NULL;   // Payload of a first transmission
+        if (out->header.seq_num != sw->next_seq) {
+            // Ahead of the source: look again shortly, sooner than the RTO
+            if (!session_source_ready(s, sw->next_seq)) {
+                uint64_t poll = now_us() + SESSION_SOURCE_POLL_MS * 1000ULL;
+                if (poll < deadline || sw->base == sw->next_seq) deadline = poll;
+                break;
+            }
+            uint16_t len;
+            const char *payload = file_source_payload(&s->src, (long)(sw->next_seq - 1) * DATA_SIZE, &len);
+            if (!s->src.map) memcpy(out->data, payload, len);
+            fresh = payload;
+
+            memset(&out->header, 0, sizeof(PacketHeader));
+            out->header.seq_num = sw->next_seq;
+            out->header.data_len = len;
+            out->header.flags = FLAG_DATA;
+            if (sw->next_seq == sw->total_packets) out->header.flags |= FLAG_FIN;
+            packet_set_conn_id(&out->header, s->conn_id);
+            if (s->lz.on && lz_encoder_pack(&s->lz, out, payload)) fresh = out->data;
+        }
+        session_send_slot(e, s, slot);
+        if (send_window_sent(sw, sw->next_seq, now_us())) s->st.retransmits++;
+        s->st.data_packets++;
+        send_window_advance(sw);
+
+        // The packet closed an FEC group: its repair packet follows it
+        if (fresh && s->fec && fec_encoder_add(&s->fec_enc, &out->header, fresh)) {
+            packet_set_conn_id(&s->fec_enc.repair.header, s->conn_id);
+            session_send(e, s, &s->fec_enc.repair, 0);
+            s->st.fec_repairs++;
+        }
+    }
+    session_set_deadline(e, s, deadline);
+}
+
+static void session_send_done(Engine *e, Session *s) {
+    printf("%sSent %ld bytes\n", s->tag, s->filesize);
+    s->st.bytes = s->filesize;
+    s->st.fec_rebuilt = s->fec_enc.rebuilt;
+    stats_print_sender(s->tag, &s->st, &s->sw, &s->rtt, &s->cc);
+    lz_encoder_print(s->tag, &s->lz);
+    session_done(e, s, 1);
+    session_free(e, s);
+}
+
+static void session_on_ack(Engine *e, Session *s, const Packet *ack) {
+    uint32_t old_base = s->sw.base;
+    uint32_t old_losses = s->sw.loss_events;
+    int64_t rtt_us;
+
+    s->st.acks++;
+    uint32_t newly = send_window_on_ack(&s->sw, ack, now_us(), &rtt_us);
+    if (s->fec) fec_encoder_on_ack(&s->fec_enc, &ack->header, s->st.retransmits);
+    if (rtt_us >= 0) {
+        rtt_sample(&s->rtt, (uint32_t)rtt_us);
+        cc_on_rtt(&s->cc, (uint32_t)rtt_us);
+    }
+    if (s->sw.loss_events != old_losses) cc_on_loss(&s->cc, &s->sw);
+    cc_on_ack(&s->cc, &s->sw, newly, s->rtt.srtt_us, now_us());
+    if (s->sw.base != old_base) s->timer_start = now_us();
+
+    if (s->sw.base > s->sw.total_packets) {
+        session_send_done(e, s);
+        return;
+    }
+    session_pump(e, s);
+}
+
+static void session_send_timeout(Engine *e, Session *s) {
+    if (s->src.ready) {
+        if (__atomic_load_n(s->src.ready, __ATOMIC_ACQUIRE) < 0) {
+            printf("%sSource failed, aborting at packet %u\n", s->tag, s->sw.base);
+            session_done(e, s, 0);
+            session_free(e, s);
+            return;
+        }
+        // Polling the source, or idle waiting for it with everything ACKed: not a loss
+        uint64_t now = now_us();
+        if (s->sw.base == s->sw.next_seq) s->timer_start = now;
+        if (now < s->timer_start + s->rtt.rto_us) {
+            session_pump(e, s);
+            return;
+        }
+    }
+    if (s->rtt.backoff >= SESSION_MAX_TIMEOUTS) {
+        printf("%sPeer unresponsive, aborting at packet %u\n", s->tag, s->sw.base);
+        session_done(e, s, 0);
+        session_free(e, s);
+        return;
+    }
+    printf("%sTimeout, resending from %u (RTO %u ms)\n", s->tag, s->sw.base, s->rtt.rto_us / 1000);
+    s->st.timeouts++;
+    rtt_backoff(&s->rtt);
+    if (send_window_on_timeout(&s->sw)) cc_on_timeout(&s->cc, &s->sw);
+    s->timer_start = now_us();
+    session_pump(e, s);
+}
+
+Session *engine_start_send(Engine *e, const struct sockaddr_in *peer, uint32_t conn_id, const Command *c, FILE *fp) {
+    FileSource src;
+    if (file_source_open(&src, fp) != 0) {
+        file_source_close(&src);
+        return NULL;
+    }
+    return engine_start_send_source(e, peer, conn_id, c, &src);
+}
+
+Session *engine_start_send_source(Engine *e, const struct sockaddr_in *peer, uint32_t conn_id, const Command *c,
+                                  FileSource *src) {
+    Session *s = session_new(e, peer, conn_id, SESSION_SEND, 0);
+    if (!s) {
+        file_source_close(src);
+        return NULL;
+    }
+    s->src = *src;
+    long long whole = s->src.size;
+    if (c->parts > 0) {
+        long long offset, length;
+        command_part_range(whole, c->part, c->parts, &offset, &length);
+        file_source_range(&s->src, (long)offset, (long)length);
+    } else if (c->offset > 0 || c->length > 0) {
+        file_source_range(&s->src, (long)c->offset, (long)(c->length > 0 ? c->length : whole));
+    }
+    long filesize = s->src.size;
+    uint32_t total_packets = (uint32_t)((filesize + DATA_SIZE - 1) / DATA_SIZE);
+    if (send_window_init(&s->sw, total_packets) != 0) {
+        printf("%sCannot allocate send window\n", s->tag);
+        session_free(e, s);
+        return NULL;
+    }
+    s->filesize = filesize;
+    s->csum = c->csum;
+    s->fec = c->fec;
+    fec_encoder_init(&s->fec_enc);
+    s->lz.on = c->compress && lz_encoder_init(&s->lz) == 0;
+    rtt_init(&s->rtt);
+    rtt_set_ack_delay(&s->rtt, c->ack.delay_us);
+    cc_init(&s->cc);
+    s->timer_start = now_us();
+    if (c->parts > 0) {
+        printf("%sGET %s: part %u/%u, %ld bytes at %ld, %u packets\n", s->tag, c->filename, c->part, c->parts,
+               filesize, s->src.base, total_packets);
+    } else if (s->src.base > 0 || filesize < whole) {
+        printf("%sGET %s: %ld bytes at %ld, %u packets\n", s->tag, c->filename, filesize, s->src.base,
+               total_packets);
+    } else {
+        printf("%sGET %s: %ld bytes, %u packets\n", s->tag, c->filename, filesize, total_packets);
+    }
+
+    // The reply tells the receiver how much to preallocate (the whole file
+    // for a ranged get, which also echoes the range or offset). A whole file
+    // of one packet goes without: its DATA|FIN packet is the answer, which
+    // receivers take as the whole file, as from a server without options.
+    Command reply = *c;
+    reply.size = whole;
+    reply.compress = s->lz.on;
+    if (total_packets != 1 || c->parts > 0 || c->offset > 0 || c->length > 0 || c->want_etag) {
+        session_reply_options(e, s, &reply);
+    }
+    if (total_packets == 0) {
+        session_send_done(e, s);
+        return NULL;
+    }
+    session_pump(e, s);
+    return s;
+}
+
+/*------------------------------------------ Receiver ------------------------------------------*/
+
+static void session_send_ack(Engine *e, Session *s) {
+    Packet ack;
+    recv_window_build_ack(&s->rw, &ack);
+    packet_set_conn_id(&ack.header, s->conn_id);
+    session_send(e, s, &ack, 0);
+    ack_on_sent(&s->as);
+    s->st.acks++;
+}
+
+// Earliest of the delayed-ACK timer, the idle limit and re-sending the command
+static void session_recv_deadline(Engine *e, Session *s) {
+    uint64_t deadline = s->last_rx_us + SESSION_IDLE_MS * 1000ULL;
+    uint64_t resend = s->request_us + RTO_INITIAL_MS * 1000ULL;
+    if (s->as.deadline_us && s->as.deadline_us < deadline) deadline = s->as.deadline_us;
+    if (s->request && resend < deadline) deadline = resend;
+    session_set_deadline(e, s, deadline);
+}
+
+static void session_write_failed(Engine *e, Session *s) {
+    printf("%sWrite failed after %llu bytes: %s\n", s->tag, (unsigned long long)s->st.bytes,
+           strerror(s->sink.error));
+    session_done(e, s, 0);
+    session_free(e, s);
+}
+
+// The writer has put the whole file on disk (or given up): close it and report
+static void session_recv_complete(Engine *e, Session *s) {
+    if (file_sink_close(&s->sink) != 0) {
+        printf("%sWrite failed after %llu bytes: %s\n", s->tag, (unsigned long long)s->st.bytes, strerror(errno));
+        session_done(e, s, 0);
+        return;
+    }
+    journal_close(&s->journal, 1);
+    printf("%sReceived %llu bytes\n", s->tag, (unsigned long long)s->st.bytes);
+    stats_print_receiver(s->tag, &s->st, &s->as.policy);
+    file_sink_print(s->tag, &s->sink);
+    session_done(e, s, 1);
+}
+
+static void session_on_data(Engine *e, Session *s, const Packet *pkt) {
+    if (s->state == SESSION_LINGER) {
+        // Our final ACK was lost: the sender is retransmitting the tail
+        session_send_ack(e, s);
+        return;
+    }
+
+    Packet *in_order;
+    int clean = recv_window_in_order(&s->rw, pkt);
+    clean &= recv_window_accept(&s->rw, pkt);
+    s->st.data_packets++;
+    s->last_rx_us = now_us();
+    while ((in_order = recv_window_next(&s->rw)) != NULL) s->st.bytes += lz_raw_len(&in_order->header);
+    if (file_sink_deliver(&s->sink) != 0) {
+        session_write_failed(e, s);
+        return;
+    }
+
+    if (ack_on_data(&s->as, clean, recv_window_done(&s->rw), s->last_rx_us)) session_send_ack(e, s);
+
+    // The sender is done once it has the final ACK; the file is done once
+    // the writer has caught up, which the linger period waits for
+    if (recv_window_done(&s->rw)) {
+        file_sink_finish(&s->sink);
+        s->state = SESSION_LINGER;
+        session_set_deadline(e, s, now_us() + SESSION_LINGER_MS * 1000ULL);
+        if (!file_sink_busy(&s->sink)) session_recv_complete(e, s);
+        return;
+    }
+    session_recv_deadline(e, s);
+}
+
+// An FEC repair packet: a lone missing packet of its group is rebuilt and
+// taken like any other
+static void session_on_repair(Engine *e, Session *s, const Packet *pkt) {
+    Packet rebuilt;
+    s->st.fec_repairs++;
+    if (s->state == SESSION_ACTIVE && fec_rebuild(&s->rw, pkt, &rebuilt)) {
+        s->st.fec_rebuilt++;
+        session_on_data(e, s, &rebuilt);
+    }
+}
+
+// The writer made progress a waiting session cares about
+static void session_on_disk(Engine *e, Session *s) {
+    if (!s->sink.fp) return;
+    int failed = file_sink_progress(&s->sink) != 0;
+    if (s->state == SESSION_LINGER) {
+        if (!file_sink_busy(&s->sink)) session_recv_complete(e, s);
+    } else if (failed) {
+        session_write_failed(e, s);
+    } else if (file_sink_reopened(&s->sink)) {
+        session_send_ack(e, s);     // Window update: the sender may be probing a closed window
+    }
+}
+
+static void session_recv_timer(Engine *e, Session *s) {
+    uint64_t now = now_us();
+    if (s->state == SESSION_LINGER) {
+        // Stay until the file is on disk, answering retransmissions meanwhile
+        if (s->sink.fp && file_sink_busy(&s->sink)) {
+            session_set_deadline(e, s, now + SESSION_LINGER_MS * 1000ULL);
+            return;
+        }
+        if (s->sink.fp) session_recv_complete(e, s);
+        session_free(e, s);
+        return;
+    }
+    if (now >= s->last_rx_us + SESSION_IDLE_MS * 1000ULL) {
+        printf("%sPeer idle, aborting after %llu bytes\n", s->tag, (unsigned long long)s->st.bytes);
+        session_done(e, s, 0);
+        session_free(e, s);
+        return;
+    }
+    if (s->request && now >= s->request_us + RTO_INITIAL_MS * 1000ULL) {
+        session_send(e, s, s->request, 0);      // The command or its answer was lost
+        s->request_us = now;
+    }
+    if (ack_wait_us(&s->as, now) == 0) session_send_ack(e, s);
+    session_recv_deadline(e, s);
+}
+
+Session *engine_start_recv(Engine *e, const struct sockaddr_in *peer, uint32_t conn_id, const Command *c, FILE *fp) {
+    Session *s = session_new(e, peer, conn_id, SESSION_RECV, 0);
+    if (!s) {
+        fclose(fp);
+        return NULL;
+    }
+    if (recv_window_init(&s->rw) != 0) {
+        printf("%sCannot allocate receive window\n", s->tag);
+        fclose(fp);
+        session_free(e, s);
+        return NULL;
+    }
+    // A resumed upload continues at c->offset, a packet boundary, with the
+    // sequence numbers it would have had from the start
+    recv_window_skip(&s->rw, (uint32_t)(c->offset / DATA_SIZE) + 1);
+    int direct = e->direct && c->offset % FILE_SINK_DIRECT_ALIGN == 0;
+    if (file_sink_open(&s->sink, fp, &s->rw, c->size, direct, e->wfd) != 0) {
+        printf("%sCannot write %s: %s\n", s->tag, c->filename, strerror(s->sink.error));
+        session_free(e, s);
+        return NULL;
+    }
+    file_sink_seek(&s->sink, c->offset);
+    JournalId id = {c->size, c->mtime, c->etag, c->has_etag};
+    if (c->size > 0 && journal_open(&s->journal, c->filename, &id, c->offset) == 0) {
+        file_sink_journal(&s->sink, &s->journal);
+    }
+    ack_state_init(&s->as, &c->ack);
+    s->csum = c->csum;
+    s->last_rx_us = now_us();
+    if (c->offset > 0) {
+        printf("%sPUT %s: resuming at byte %lld of %lld%s\n", s->tag, c->filename, c->offset, c->size,
+               s->sink.direct ? " (O_DIRECT)" : "");
+    } else {
+        printf("%sPUT %s%s\n", s->tag, c->filename, s->sink.direct ? " (O_DIRECT)" : "");
+    }
+
+    Command reply = *c;
+    reply.compress = c->compress && file_sink_decompress(&s->sink) == 0;
+    session_reply_options(e, s, &reply);
+    session_recv_deadline(e, s);
+    return s;
+}
+
+Session *engine_start_fetch(Engine *e, const struct sockaddr_in *server, const char *filename, const uint32_t *etag,
+                            FILE *fp, SessionDoneFn on_done, void *user) {
+    struct epoll_event ev;
+    AckPolicy immediate;
+    Command c;
+    uint32_t conn_id = ((uint32_t)rand() << 8 ^ (uint32_t)now_us()) & 0xFFFFFF;
+
+    Session *s = session_new(e, server, conn_id ? conn_id : 1, SESSION_RECV, 1);
+    if (!s) {
+        fclose(fp);
+        return NULL;
+    }
+    s->on_done = on_done;
+    s->user = user;
+    s->request = calloc(1, sizeof(*s->request));
+    if (!s->request || recv_window_init(&s->rw) != 0 || (s->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+        printf("%sCannot set up fetch\n", s->tag);
+        s->fd = -1;
+        fclose(fp);
+        session_free(e, s);
+        return NULL;
+    }
+    if (file_sink_open(&s->sink, fp, &s->rw, 0, 0, e->wfd) != 0) {
+        printf("%sCannot write %s: %s\n", s->tag, filename, strerror(s->sink.error));
+        session_free(e, s);
+        return NULL;
+    }
+    int sock_buf = SOCKET_BUFFER_BYTES;
+    setsockopt(s->fd, SOL_SOCKET, SO_RCVBUF, &sock_buf, sizeof(sock_buf));
+    if (e->rx.gro) udp_gro_enable(s->fd);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = s;
+    epoll_ctl(e->epfd, EPOLL_CTL_ADD, s->fd, &ev);
+
+    // ACK every packet until the server confirms the coalescing asked for
+    ack_policy_default(&immediate);
+    ack_state_init(&s->as, &immediate);
+    s->last_rx_us = now_us();
+
+    Packet *req = s->request;
+    snprintf(req->data, DATA_SIZE, "get %s", filename);
+    command_parse(req->data, &c);
+    command_add_default_options(&c, req->data, DATA_SIZE);
+    command_add_fec(&c, req->data, DATA_SIZE);
+    if (file_sink_decompress(&s->sink) == 0) command_add_compress(&c, req->data, DATA_SIZE);
+    command_add_etag(&c, req->data, DATA_SIZE, etag);
+    req->header.data_len = (uint16_t)strlen(req->data);
+    req->header.flags = FLAG_SYN;
+    packet_set_conn_id(&req->header, s->conn_id);
+    session_send(e, s, req, 0);
+    s->request_us = s->last_rx_us;
+    printf("%sFetching %s%s\n", s->tag, filename, etag ? " if changed" : "");
+
+    session_recv_deadline(e, s);
+    return s;
+}
+
+/*------------------------------------------ Dispatch ------------------------------------------*/
+
+static void engine_on_command(Engine *e, const struct sockaddr_in *from, uint32_t conn_id, Packet *pkt) {
+    char text[DATA_SIZE + 1];
+    Command c;
+
+    // A repeated command for a live session is a duplicate, sent again because
+    // our reply did not arrive; a legacy peer (ID 0) starting over, or a
+    // session only lingering, is replaced
+    Session *s = session_find(e, from, conn_id);
+    if (s && s->conn_id == conn_id) {
+        if (s->state == SESSION_ACTIVE && conn_id != 0) {
+            if (s->reply) engine_send(e, &s->peer, s->reply);
+            return;
+        }
+        session_done(e, s, 0);
+        session_free(e, s);
+    }
+
+    memcpy(text, pkt->data, pkt->header.data_len);
+    text[pkt->header.data_len] = '\0';
+    command_parse(text, &c);
+    e->on_command(e, from, conn_id, &c);
+}
+
+static void session_on_packet(Engine *e, Session *s, const Packet *pkt) {
+    uint8_t flags = pkt->header.flags;
+
+    if (s->request && (flags & (FLAG_SYN | FLAG_ACK)) == (FLAG_SYN | FLAG_ACK)) {
+        free(s->request);       // Answered: data alone may come from a server whose reply was lost
+        s->request = NULL;
+    }
+    if (s->role == SESSION_SEND && (flags & FLAG_ACK) && !(flags & FLAG_SYN)) {
+        session_on_ack(e, s, pkt);
+    } else if (s->role == SESSION_RECV && (flags & FLAG_DATA)) {
+        session_on_data(e, s, pkt);
+    } else if (s->role == SESSION_RECV && (flags & FLAG_FEC)) {
+        session_on_repair(e, s, pkt);
+    } else if (s->outbound && (flags & (FLAG_SYN | FLAG_ACK)) == (FLAG_SYN | FLAG_ACK)) {
+        Command accepted;
+        command_parse_reply(pkt, &accepted);
+        s->as.policy = accepted.ack;
+        s->csum = accepted.csum;
+        SessionReplyFn on_reply = s->on_reply;
+        s->on_reply = NULL;
+        if (accepted.unchanged) {
+            // Conditional fetch of a copy that is still current: nothing follows
+            printf("%sUnchanged\n", s->tag);
+            s->unchanged = 1;
+            if (on_reply) on_reply(e, s, &accepted);
+            session_done(e, s, 1);
+            session_free(e, s);
+        } else if (file_sink_reserve(&s->sink, accepted.size) != 0) {
+            session_write_failed(e, s);
+        } else if (on_reply) {
+            on_reply(e, s, &accepted);
+        }
+    }
+}
+
+static void engine_dispatch(Engine *e, Packet *pkt, ssize_t len, const struct sockaddr_in *from) {
+    if (!packet_valid(pkt, len)) return;
+
+    uint32_t conn_id = packet_conn_id(&pkt->header);
+    if ((pkt->header.flags & FLAG_SYN) && !(pkt->header.flags & FLAG_ACK)) {
+        engine_on_command(e, from, conn_id, pkt);
+        return;
+    }
+
+    // Anything else belongs to a session; strays are dropped
+    Session *s = session_find(e, from, conn_id);
+    if (s) session_on_packet(e, s, pkt);
+}
+
+static void engine_count_rx(Engine *e, unsigned n) {
+    if (!n) return;
+    e->rate_last_us = now_us();
+    if (!e->rate_start_us) e->rate_start_us = e->rate_last_us;
+    e->rate_rx += n;
+}
+
+static void engine_drain(Engine *e) {
+    RecvBatch *rx = &e->rx;
+
+    for (int got = 0; got < ENGINE_RECV_BURST;) {
+        unsigned n = recv_batch_fill(rx, e->sfd, MSG_DONTWAIT);
+        engine_count_rx(e, n);
+        for (unsigned i = 0; i < n; i++) engine_dispatch(e, rx->pkt[i], rx->len[i], rx->from[i]);
+        if (!rx->more) return;
+        got += n;
+    }
+}
+
+// Datagrams on an outbound session's own socket
+static void session_drain(Engine *e, Session *s) {
+    RecvBatch *rx = &e->rx;
+
+    for (int got = 0; got < ENGINE_RECV_BURST && !s->dead;) {
+        unsigned n = recv_batch_fill(rx, s->fd, MSG_DONTWAIT);
+        engine_count_rx(e, n);
+        for (unsigned i = 0; i < n && !s->dead; i++) {
+            const struct sockaddr_in *from = rx->from[i];
+            Packet *pkt = rx->pkt[i];
+            if (from->sin_addr.s_addr != s->peer.sin_addr.s_addr || from->sin_port != s->peer.sin_port) continue;
+            if (packet_valid(pkt, rx->len[i]) && packet_in_conn(&pkt->header, s->conn_id, &s->conn_echoed)) {
+                session_on_packet(e, s, pkt);
+            }
+        }
+        if (!rx->more) return;
+        got += n;
+    }
+}
+
+// Some writer caught up or finished. Sessions freed on the way stay
+// readable until engine_reap, so a snapshot of the heap is safe to walk.
+static void engine_disk(Engine *e) {
+    uint64_t wakeups;
+    if (read(e->wfd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) perror("Engine: eventfd");
+
+    size_t count = e->heap_len;
+    Session **live = malloc(count * sizeof(*live));
+    if (!live) return;
+    memcpy(live, e->heap, count * sizeof(*live));
+    for (size_t i = 0; i < count; i++) {
+        if (!live[i]->dead && live[i]->role == SESSION_RECV) session_on_disk(e, live[i]);
+    }
+    free(live);
+}
+
+int engine_post(Engine *e, EngineTaskFn fn, void *arg) {
+    EngineTask *t = malloc(sizeof(*t));
+    if (!t) return -1;
+    t->fn = fn;
+    t->arg = arg;
+    pthread_mutex_lock(&e->post_lock);
+    t->next = e->posted;
+    e->posted = t;
+    pthread_mutex_unlock(&e->post_lock);
+
+    uint64_t one = 1;
+    if (write(e->wfd, &one, sizeof(one)) < 0) perror("Engine: eventfd");
+    return 0;
+}
+
+// Runs what other threads posted, oldest first
+static void engine_run_posted(Engine *e) {
+    pthread_mutex_lock(&e->post_lock);
+    EngineTask *t = e->posted, *order = NULL;
+    e->posted = NULL;
+    pthread_mutex_unlock(&e->post_lock);
+
+    while (t) {
+        EngineTask *next = t->next;
+        t->next = order;
+        order = t;
+        t = next;
+    }
+    while (order) {
+        t = order;
+        order = t->next;
+        t->fn(e, t->arg);
+        free(t);
+    }
+}
+
+static void engine_expire(Engine *e) {
+    uint64_t expirations;
+    if (read(e->tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) perror("Engine: timerfd");
+    e->armed_us = 0;
+
+    uint64_t now = now_us();
+    while (e->heap_len && e->heap[0]->deadline_us <= now) {
+        Session *s = e->heap[0];
+        session_set_deadline(e, s, 0);
+        if (s->role == SESSION_SEND) {
+            session_send_timeout(e, s);
+        } else {
+            session_recv_timer(e, s);
+        }
+    }
+}
+
+// Prints the packet rates of the interval once it is over. Returns the
+// epoll timeout until the next report, -1 while idle.
+static int engine_report_rate(Engine *e) {
+    if (!e->rate_start_us) return -1;
+
+    uint64_t now = now_us();
+    uint64_t end = e->rate_start_us + ENGINE_RATE_MS * 1000ULL;
+    if (now < end) return (int)((end - now + 999) / 1000);
+
+    // Rates over the busy part of the interval, so an idle tail does not dilute them
+    uint64_t busy_end = !e->sessions && e->rate_last_us > e->rate_start_us ? e->rate_last_us : now;
+    uint64_t busy_us = busy_end - e->rate_start_us;
+    double secs = (busy_us > 1000 ? busy_us : 1000) / 1e6;
+    if (e->rate_rx || e->rate_tx) {
+        printf("[worker %u] %.0f packets/s in, %.0f packets/s out, %u sessions\n", e->worker,
+               e->rate_rx / secs, e->rate_tx / secs, e->sessions);
+    }
+    e->rate_start_us = e->rate_rx || e->rate_tx || e->sessions ? now : 0;
+    e->rate_rx = e->rate_tx = 0;
+    return e->rate_start_us ? ENGINE_RATE_MS : -1;
+}
+
+// One ready source from the epoll set
+static void engine_handle(Engine *e, void *source) {
+    if (source == &e->sfd) {
+        engine_drain(e);
+    } else if (source == &e->tfd) {
+        engine_expire(e);
+    } else if (source == &e->wfd) {
+        engine_disk(e);
+        engine_run_posted(e);
+    } else {
+        Session *s = source;
+        if (!s->dead) session_drain(e, s);
+    }
+    send_batch_flush(&e->tx);
+}
+
+/*------------------------------------------ io_uring ------------------------------------------*/
+
+#define URING_RECV 1                // user_data of the multishot recvmsg on sfd
+#define URING_POLL 2                // ... and of the multishot poll on the epoll fd
+#define URING_BUF_GROUP 0
+#define URING_BUFS 1024             // Provided buffers without GRO, one datagram each
+#define URING_GRO_BUFS 64           // ... and with GRO, UDP_GRO_BUF_BYTES each
+#define URING_BUF_HEADROOM 128      // io_uring_recvmsg_out, address and control message
+
+struct EngineUring {
+    Uring ring;
+    struct msghdr armed;            // Name and control sizes of the multishot recvmsg
+    int recv_armed;
+    int poll_armed;
+    int epoll_ready;                // The poll fired: epoll_wait has something
+    int error;                      // errno that ends the io_uring path
+    uint16_t bids[UDP_RECV_MAX];    // Buffers behind the datagrams in e->rx
+    unsigned nbids;
+};
+
+// Returns -1 (errno set) when the kernel lacks io_uring or provided buffer rings
+static int engine_uring_init(Engine *e) {
+    struct EngineUring *eu = calloc(1, sizeof(*eu));
+    unsigned bufs = e->rx.gro ? URING_GRO_BUFS : URING_BUFS;
+    unsigned buf_size = (e->rx.gro ? UDP_GRO_BUF_BYTES : sizeof(Packet)) + URING_BUF_HEADROOM;
+
+    if (!eu) return -1;
+    if (uring_init(&eu->ring, 64, bufs * 2) != 0) {
+        free(eu);
+        return -1;
+    }
+    if (uring_buffers_init(&eu->ring, bufs, buf_size, URING_BUF_GROUP) != 0) {
+        int err = errno;
+        uring_free(&eu->ring);
+        free(eu);
+        errno = err;
+        return -1;
+    }
+    eu->armed.msg_namelen = sizeof(struct sockaddr_in);
+    eu->armed.msg_controllen = e->rx.gro ? CMSG_SPACE(sizeof(int)) : 0;
+    e->uring = eu;
+    return 0;
+}
+
+static void engine_uring_free(Engine *e) {
+    if (!e->uring) return;
+    uring_free(&e->uring->ring);
+    free(e->uring);
+    e->uring = NULL;
+}
+
+// Back to plain epoll for the rest of the run
+static void engine_uring_fallback(Engine *e) {
+    struct epoll_event ev;
+
+    if (e->worker == 0) printf("io_uring: %s, falling back to epoll\n", strerror(e->uring->error));
+    engine_uring_free(e);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &e->sfd;
+    epoll_ctl(e->epfd, EPOLL_CTL_ADD, e->sfd, &ev);
+}
+
+// Multishot requests end when the kernel runs out of buffers or gives up;
+// re-issue them before waiting again.
+static void engine_uring_arm(Engine *e) {
+    struct EngineUring *eu = e->uring;
+    if (!eu->recv_armed) {
+        uring_prep_recvmsg_multishot(&eu->ring, e->sfd, &eu->armed, URING_RECV);
+        eu->recv_armed = 1;
+    }
+    if (!eu->poll_armed) {
+        uring_prep_poll_multishot(&eu->ring, e->epfd, URING_POLL);
+        eu->poll_armed = 1;
+    }
+}
+
+// Dispatches the datagrams gathered in e->rx and returns their buffers
+static void engine_uring_dispatch(Engine *e) {
+    struct EngineUring *eu = e->uring;
+    RecvBatch *rx = &e->rx;
+
+    if (rx->count) {
+        rx->calls++;
+        rx->packets += rx->count;
+        engine_count_rx(e, rx->count);
+        for (unsigned i = 0; i < rx->count; i++) engine_dispatch(e, rx->pkt[i], rx->len[i], rx->from[i]);
+    }
+    for (unsigned i = 0; i < eu->nbids; i++) uring_buffer_put(&eu->ring, eu->bids[i]);
+    if (eu->nbids) uring_buffers_publish(&eu->ring);
+    rx->count = 0;
+    eu->nbids = 0;
+}
+
+static void engine_uring_recv(Engine *e, const struct io_uring_cqe *cqe) {
+    struct EngineUring *eu = e->uring;
+    Uring *u = &eu->ring;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) eu->recv_armed = 0;
+    if (cqe->res < 0) {
+        if (cqe->res != -ENOBUFS) eu->error = -cqe->res;   // Out of buffers only needs a re-arm
+        return;
+    }
+    if (!(cqe->flags & IORING_CQE_F_BUFFER)) return;
+
+    uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    char *buf = uring_buffer(u, bid);
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+    struct sockaddr_in *from;
+    struct msghdr ctrl;
+    unsigned len;
+
+    eu->bids[eu->nbids++] = bid;
+    if ((unsigned)cqe->res < sizeof(*out) || (out->flags & MSG_TRUNC)) return;
+    char *payload = uring_recvmsg_payload(buf, &eu->armed, &from, &ctrl, &len);
+    unsigned seg = e->rx.gro ? udp_gro_segment(&ctrl, len) : (len ? len : 1);
+    recv_batch_split(&e->rx, payload, len, seg, from);
+}
+
+// Handles every completion posted so far
+static void engine_uring_reap(Engine *e) {
+    struct EngineUring *eu = e->uring;
+    Uring *u = &eu->ring;
+    unsigned room = e->rx.gro ? UDP_GSO_MAX_SEGS : 1;
+    unsigned seen = 0;
+    struct io_uring_cqe *cqe;
+
+    e->rx.count = 0;
+    while ((cqe = uring_peek(u, seen)) != NULL) {
+        if (e->rx.count + room > UDP_RECV_MAX || eu->nbids == UDP_RECV_MAX) {
+            engine_uring_dispatch(e);
+            uring_seen(u, seen);
+            seen = 0;
+            continue;
+        }
+        seen++;
+        if (cqe->user_data == URING_RECV) {
+            engine_uring_recv(e, cqe);
+        } else if (cqe->user_data == URING_POLL) {
+            if (!(cqe->flags & IORING_CQE_F_MORE)) eu->poll_armed = 0;
+            if (cqe->res < 0) {
+                eu->error = -cqe->res;
+            } else {
+                eu->epoll_ready = 1;
+            }
+        }
+    }
+    engine_uring_dispatch(e);
+    uring_seen(u, seen);
+}
+
+// The loop with sfd on io_uring. Returns 0 to continue on epoll, -1 on failure.
+static int engine_run_uring(Engine *e) {
+    struct epoll_event events[ENGINE_MAX_EVENTS];
+
+    for (;;) {
+        struct EngineUring *eu = e->uring;
+
+        engine_arm_timer(e);
+        engine_uring_arm(e);
+        int timeout = engine_report_rate(e);
+        if (uring_submit(&eu->ring, eu->epoll_ready ? 0 : 1, timeout) != 0) {
+            perror("Engine: io_uring_enter");
+            return -1;
+        }
+        engine_uring_reap(e);
+        send_batch_flush(&e->tx);
+
+        // Level-triggered sources with more to read keep epoll_ready set
+        if (eu->epoll_ready) {
+            int n = epoll_wait(e->epfd, events, ENGINE_MAX_EVENTS, 0);
+            for (int i = 0; i < n; i++) engine_handle(e, events[i].data.ptr);
+            eu->epoll_ready = n > 0;
+        }
+        engine_reap(e);
+        if (eu->error) {
+            engine_uring_fallback(e);
+            return 0;
+        }
+    }
+}
+
+/*------------------------------------------- Engine -------------------------------------------*/
+
+int engine_init(Engine *e, const EngineConfig *cfg, EngineCommandFn on_command) {
+    struct sockaddr_in addr;
+    struct epoll_event ev;
+
+    memset(e, 0, sizeof(*e));
+    e->on_command = on_command;
+    e->direct = cfg->direct;
+    e->worker = cfg->worker;
+    init_crc32();
+    init_fec();
+
+    if ((e->sfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("Engine: socket");
+        return -1;
+    }
+
+    // Every worker binds the same port; the kernel spreads peers across them
+    int one = 1;
+    if (cfg->workers > 1 && setsockopt(e->sfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("Engine: SO_REUSEPORT");
+        close(e->sfd);
+        return -1;
+    }
+
+    // Room for a full congestion window of every session in both directions
+    int sock_buf = SOCKET_BUFFER_BYTES;
+    setsockopt(e->sfd, SOL_SOCKET, SO_RCVBUF, &sock_buf, sizeof(sock_buf));
+    setsockopt(e->sfd, SOL_SOCKET, SO_SNDBUF, &sock_buf, sizeof(sock_buf));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(cfg->port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(e->sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Engine: bind");
+        close(e->sfd);
+        return -1;
+    }
+
+    // Offload is best effort: a kernel without it keeps the plain batch path
+    send_batch_init(&e->tx, cfg->offload && udp_gso_probe(e->sfd));
+    if (recv_batch_init(&e->rx, cfg->offload && udp_gro_enable(e->sfd)) != 0) {
+        perror("Engine: receive buffers");
+        close(e->sfd);
+        return -1;
+    }
+    if (cfg->worker == 0) {
+        if (cfg->offload) {
+            printf("UDP offload: GSO %s, GRO %s\n", e->tx.gso ? "on" : "unavailable",
+                   e->rx.gro ? "on" : "unavailable");
+        }
+        printf("Checksums: CRC-32 %s, CRC-32C %s; FEC XOR %s\n", crc32_kernel_name, crc32c_kernel_name,
+               fec_kernel_name);
+    }
+
+    if ((e->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        (e->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0 ||
+        (e->wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror("Engine: epoll/timerfd/eventfd");
+        recv_batch_free(&e->rx);
+        close(e->sfd);
+        return -1;
+    }
+    pthread_mutex_init(&e->post_lock, NULL);
+
+    // io_uring is best effort too; without it sfd joins the epoll set
+    if (cfg->uring && engine_uring_init(e) != 0 && cfg->worker == 0) {
+        printf("io_uring unavailable (%s), using epoll\n", strerror(errno));
+    }
+    if (cfg->worker == 0 && e->uring) {
+        printf("io_uring: multishot receive into %u provided buffers\n", e->uring->ring.buf_count);
+    }
+
+    // Event data points at the source: &e->sfd, &e->tfd, &e->wfd or an outbound Session
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &e->sfd;
+    if (!e->uring) epoll_ctl(e->epfd, EPOLL_CTL_ADD, e->sfd, &ev);
+    ev.data.ptr = &e->tfd;
+    epoll_ctl(e->epfd, EPOLL_CTL_ADD, e->tfd, &ev);
+    ev.data.ptr = &e->wfd;
+    epoll_ctl(e->epfd, EPOLL_CTL_ADD, e->wfd, &ev);
+    return 0;
+}
+
+void engine_run(Engine *e) {
+    struct epoll_event events[ENGINE_MAX_EVENTS];
+
+    if (e->uring && engine_run_uring(e) != 0) return;
+    for (;;) {
+        engine_arm_timer(e);
+        int n = epoll_wait(e->epfd, events, ENGINE_MAX_EVENTS, engine_report_rate(e));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Engine: epoll_wait");
+            return;
+        }
+        for (int i = 0; i < n; i++) engine_handle(e, events[i].data.ptr);
+        engine_reap(e);
+    }
+}
+
+void engine_close(Engine *e) {
+    // Every live session has a deadline (RTO, idle limit or linger)
+    while (e->heap_len) {
+        Session *s = e->heap[0];
+        session_done(e, s, 0);
+        session_free(e, s);
+    }
+    send_batch_flush(&e->tx);
+    engine_reap(e);
+    while (e->posted) {
+        EngineTask *t = e->posted;
+        e->posted = t->next;
+        free(t);
+    }
+    pthread_mutex_destroy(&e->post_lock);
+    free(e->heap);
+    engine_uring_free(e);
+    recv_batch_free(&e->rx);
+    close(e->wfd);
+    close(e->tfd);
+    close(e->epfd);
+    close(e->sfd);
+}
+
+static void *engine_worker(void *arg) {
+    engine_run(arg);
+    return NULL;
+}
+
+// Keeps a worker on one core (and its socket's softirq work warm there)
+static void engine_pin(pthread_t thread, unsigned worker) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(worker % (unsigned)(cpus > 0 ? cpus : 1), &set);
+    pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+int engine_run_workers(const EngineConfig *cfg, EngineCommandFn on_command) {
+    unsigned workers = cfg->workers ? cfg->workers : 1;
+    Engine *engines = calloc(workers, sizeof(*engines));
+    pthread_t *threads = calloc(workers, sizeof(*threads));
+    unsigned ready = 0;
+
+    if (!engines || !threads) {
+        free(engines);
+        free(threads);
+        return -1;
+    }
+    for (; ready < workers; ready++) {
+        EngineConfig wc = *cfg;
+        wc.workers = workers;
+        wc.worker = ready;
+        if (engine_init(&engines[ready], &wc, on_command) != 0) break;
+    }
+    if (ready == workers) {
+        if (workers > 1) printf("%u workers on SO_REUSEPORT sockets\n", workers);
+        for (unsigned i = 1; i < workers; i++) {
+            if (pthread_create(&threads[i], NULL, engine_worker, &engines[i]) != 0) {
+                perror("Engine: worker thread");
+                exit(EXIT_FAILURE);
+            }
+            engine_pin(threads[i], i);
+        }
+        if (workers > 1) engine_pin(pthread_self(), 0);
+        engine_run(&engines[0]);
+        exit(EXIT_FAILURE);     // The other workers cannot be stopped cleanly
+    }
+
+    while (ready > 0) engine_close(&engines[--ready]);
+    free(engines);
+    free(threads);
+    return -1;
+}
@@ -0,0 +1,214 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "../common/protocol.h"
+#include "../common/ackpolicy.h"
+#include "../common/cc.h"
+#include "../common/command.h"
+#include "../common/fec.h"
+#include "../common/filesink.h"
+#include "../common/filesrc.h"
+#include "../common/journal.h"
+#include "../common/lz.h"
+#include "../common/rtt.h"
+#include "../common/sack.h"
+#include "../common/stats.h"
+#include "../common/udpbatch.h"
+
+// Single-threaded event loop for the Linux server and proxy: one UDP socket
+// and one timerfd in an epoll set. Datagrams are demultiplexed to sessions
+// keyed by peer address and connection ID (sessions of legacy peers, which
+// send ID 0, match on the address alone). Each session is a small state
+// machine driven by packets and by its own deadline; a min-heap of deadlines
+// keeps the timerfd armed for the earliest one. Sessions we open towards
+// another server (origin fetches) get a socket of their own, since a legacy
+// server does not echo connection IDs. Received files are written by one
+// writer thread per session (filesink.h), which reports back through an
+// eventfd in the same epoll set. Transfers that negotiate fec=xor carry XOR
+// repair packets (fec.h) both ways, and those that negotiate compress=lz4
+// compressed payloads (lz.h).
+//
+// To use several cores, engine_run_workers() starts one engine per worker
+// thread, each pinned to a core with its own SO_REUSEPORT socket, session
+// table and timers. The kernel hashes every peer address to one socket, so
+// a session lives on exactly one worker and nothing is shared between them.
+// Work that must run on another worker, such as answering its client once a
+// file arrives, is handed over with engine_post().
+//
+// With EngineConfig.uring the main socket is read through io_uring instead
+// (uring.h): a multishot recvmsg keeps the kernel filling a ring of provided
+// buffers without a system call per batch, and the epoll set, still holding
+// the timer, the eventfd and outbound sockets, is itself polled through the
+// ring. Kernels without it fall back to the epoll path.
+
+#define SESSION_TABLE_SIZE 1024  // Hash buckets, power of two
+#define SESSION_IDLE_MS 30000    // Receiver gives up after this much silence
+#define SESSION_LINGER_MS 2000   // Finished receiver keeps re-sending its final ACK this long
+#define SESSION_MAX_TIMEOUTS 15  // Sender gives up after this many timeouts in a row
+#define SESSION_SOURCE_POLL_MS 2 // Sender waiting for its source to fill (FileSource.ready) looks again this often
+#define ENGINE_MAX_EVENTS 16
+#define ENGINE_RECV_BURST 256    // Datagrams drained per wakeup before timers get a turn
+#define ENGINE_RATE_MS 5000      // Packet rate report interval while busy
+
+typedef enum {
+    SESSION_SEND,   // get: we own the file and the send window
+    SESSION_RECV    // put: the peer sends, we ACK and write
+} SessionRole;
+
+typedef enum {
+    SESSION_ACTIVE,
+    SESSION_LINGER  // Transfer done, final ACK re-sent to retransmitted data
+} SessionState;
+
+typedef struct Session Session;
+typedef struct Engine Engine;
+
+// Called once when a session completes (ok = 1) or is abandoned (ok = 0).
+// A receiver's file writer has stopped by then. A conditional fetch the
+// server answers with unchanged=1 completes with Session.unchanged set and
+// nothing received.
+typedef void (*SessionDoneFn)(Engine *e, Session *s, int ok);
+
+// Outbound: called when the server accepts the command's options, which
+// tell the file size, or says the copy held is unchanged (before on_done)
+typedef void (*SessionReplyFn)(Engine *e, Session *s, const Command *reply);
+
+struct Session {
+    struct sockaddr_in peer;
+    uint32_t     conn_id;
+    int          fd;            // Socket the session talks on
+    int          outbound;      // We sent the command (origin fetch)
+    int          conn_echoed;   // Outbound: the server echoes conn_id (packet_in_conn)
+    int          dead;          // Freed, waiting for the end of the epoll batch
+    int          unchanged;     // Outbound: the server still has the copy we hold (etag=)
+    Packet      *request;       // Outbound: the command, re-sent until the server's reply comes
+    Packet      *reply;         // Our option reply, sent again if the command is repeated
+    uint64_t     request_us;    // When it last went out
+    SessionRole  role;
+    SessionState state;
+    char         tag[48];       // "[ip:port#id] " prefix for log lines
+    ChecksumType csum;          // Checksum of the packets we send (FLAG_CRC32C)
+    long         filesize;
+    uint64_t     deadline_us;   // Next timer for this session, 0 = none
+    size_t       heap_idx;      // Position in the deadline heap, SIZE_MAX when absent
+    Session     *next;          // Hash chain, then the dead list
+    SessionDoneFn on_done;
+    SessionReplyFn on_reply;
+    void        *user;
+
+    TransferStats st;
+
+    // SESSION_SEND
+    FileSource   src;           // The file being sent (fp stays NULL)
+    SendWindow   sw;
+    RttEstimator rtt;
+    CongestionControl cc;
+    uint64_t     timer_start;   // Retransmission timer, restarted when base advances
+    int          fec;           // The receiver asked for FEC repair packets (fec.h)
+    FecEncoder   fec_enc;
+    LzEncoder    lz;            // lz.on: the receiver takes compressed payloads
+
+    // SESSION_RECV
+    FileSink     sink;          // The file being received
+    Journal      journal;       // Its progress, so a broken-off put can resume
+    RecvWindow   rw;
+    AckState     as;
+    uint64_t     last_rx_us;
+};
+
+typedef struct {
+    uint16_t port;
+    int      offload;       // Try UDP GSO/GRO; the plain path is used where the kernel refuses
+    int      direct;        // Write uploads of FILE_SINK_DIRECT_MIN bytes or more with O_DIRECT
+    int      uring;         // Receive on the main socket through io_uring where available
+    unsigned workers;       // Engines sharing the port (engine_run_workers), 0 = 1
+    unsigned worker;        // Index of this engine, set by engine_run_workers
+} EngineConfig;
+
+// Called for every valid command packet (FLAG_SYN without FLAG_ACK)
+typedef void (*EngineCommandFn)(Engine *e, const struct sockaddr_in *from, uint32_t conn_id, const Command *c);
+
+// Work handed to an engine by engine_post
+typedef void (*EngineTaskFn)(Engine *e, void *arg);
+
+typedef struct EngineTask {
+    EngineTaskFn fn;
+    void        *arg;
+    struct EngineTask *next;
+} EngineTask;
+
+struct Engine {
+    int sfd;                    // UDP socket
+    int epfd;
+    int tfd;                    // timerfd, armed for heap[0]
+    int wfd;                    // eventfd bumped by file writers (filesink.h) and engine_post
+    int direct;                 // EngineConfig.direct
+    unsigned worker;            // EngineConfig.worker
+    struct EngineUring *uring;  // io_uring receive path, NULL = sfd is in the epoll set
+    uint64_t armed_us;          // Deadline the timerfd is set to, 0 = disarmed
+    Session *buckets[SESSION_TABLE_SIZE];
+    Session **heap;             // Sessions with a deadline, earliest first
+    size_t heap_len;
+    size_t heap_cap;
+    uint32_t sessions;
+    Session *dead;              // Freed sessions, released after each epoll batch
+    pthread_mutex_t post_lock;
+    EngineTask *posted;         // From engine_post, newest first
+    EngineCommandFn on_command;
+    SendBatch tx;               // Flushed after every event and whenever full
+    RecvBatch rx;
+    uint64_t rate_start_us;     // Start of the current rate interval, 0 = idle
+    uint64_t rate_last_us;      // Latest datagram received in it
+    uint64_t rate_rx;           // Datagrams received since then
+    uint64_t rate_tx;           // Datagrams queued since then
+};
+
+int  engine_init(Engine *e, const EngineConfig *cfg, EngineCommandFn on_command);
+void engine_run(Engine *e);
+void engine_close(Engine *e);
+
+// Runs cfg->workers engines on their own threads, the first on the caller's.
+// Returns only if an engine cannot be set up or fails (-1).
+int  engine_run_workers(const EngineConfig *cfg, EngineCommandFn on_command);
+
+// Checksums and queues one packet (conn_id must already be stamped)
+void engine_send(Engine *e, const struct sockaddr_in *to, Packet *pkt);
+
+// Runs fn(e, arg) on e's own thread, soon. Safe from any thread. Returns -1
+// (fn will not run) if the task cannot be queued.
+int  engine_post(Engine *e, EngineTaskFn fn, void *arg);
+
+// Start a transfer with a peer. fp is owned by the session from here on; the
+// option reply is sent first when the command carried options. Return NULL
+// (and close fp) if the session cannot be set up. A put with c->offset set
+// resumes there: fp already holds that much, and the reply tells the sender.
+Session *engine_start_send(Engine *e, const struct sockaddr_in *peer, uint32_t conn_id, const Command *c, FILE *fp);
+Session *engine_start_recv(Engine *e, const struct sockaddr_in *peer, uint32_t conn_id, const Command *c, FILE *fp);
+
+// Like engine_start_send, from a source already open (a file or memory,
+// filesrc.h), which the session takes over and closes. A source still being
+// filled (ready set) is sent as far as it goes, looking for more every
+// SESSION_SOURCE_POLL_MS; waiting for it with nothing in flight is not a timeout.
+Session *engine_start_send_source(Engine *e, const struct sockaddr_in *peer, uint32_t conn_id, const Command *c,
+                                  FileSource *src);
+
+// Sends "get <filename>" to a server from a fresh socket and receives the
+// file into fp. on_done runs once the file is complete and on disk (fp
+// already closed), or with ok = 0 when the server stays silent for
+// SESSION_IDLE_MS or the file cannot be written. The caller may set on_reply
+// and give the session's sink to file_sink_publish() to read the file while
+// it arrives. With etag set the get is conditional on the copy of that
+// CRC-32C the caller holds (Session.unchanged); either way the reply tells
+// the server's etag and mtime. The command is re-sent every RTO_INITIAL_MS
+// until the server's reply comes, data arriving or not; a server repeats its
+// reply to a repeated command.
+Session *engine_start_fetch(Engine *e, const struct sockaddr_in *server, const char *filename, const uint32_t *etag,
+                            FILE *fp, SessionDoneFn on_done, void *user);
+
+#endif // ENGINE_H
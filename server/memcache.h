@@ -0,0 +1,206 @@
+#ifndef MEMCACHE_H
+#define MEMCACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// In-memory tier of the proxy cache, in front of the cache directory: whole
+// files held in RAM, found through a hash of the name and evicted least
+// recently used first once they take more than the byte budget. A hit is
+// sent straight from the object (file_source_memory), with no open, map or
+// read. Files over a quarter of the budget stay on disk only.
+//
+// The workers share one cache under a mutex. Objects are reference counted:
+// the cache holds one reference while an object is listed and every sending
+// session another, so an object evicted mid-transfer is freed by the last
+// session to finish with it.
+//
+// Every object carries the version of the file it was read from (its inode:
+// a new copy is renamed into place, so it has a new one). A worker may read
+// the old copy just before it is replaced and list it after the drop, so
+// whoever lists an object checks the file again afterwards and drops its own
+// version if the file has moved on.
+
+#define MEM_CACHE_BUCKETS 4096      // Power of two
+#define MEM_CACHE_MB 256            // Default budget
+
+typedef struct MemCache MemCache;
+
+typedef struct MemObject {
+    MemCache *cache;
+    char     *name;
+    char     *data;
+    long      size;
+    uint64_t  version;              // Of the file the data came from
+    uint32_t  refs;
+    struct MemObject *hnext;        // Hash chain
+    struct MemObject *prev, *next;  // LRU list, most recent first
+} MemObject;
+
+struct MemCache {
+    pthread_mutex_t lock;
+    MemObject *buckets[MEM_CACHE_BUCKETS];
+    MemObject *head, *tail;
+    size_t    budget;
+    size_t    used;                 // Bytes of the listed objects
+    uint32_t  objects;
+    uint64_t  hits;                 // Lookups answered from memory
+    uint64_t  misses;
+    uint64_t  evictions;
+    uint64_t  evicted_bytes;
+};
+
+static inline uint32_t mem_cache_hash(const char *name) {
+    uint32_t h = 2166136261u;       // FNV-1a
+    while (*name) h = (h ^ (uint8_t)*name++) * 16777619u;
+    return h & (MEM_CACHE_BUCKETS - 1);
+}
+
+// Returns -1 if the lock cannot be set up. A budget of 0 keeps nothing.
+static inline int mem_cache_init(MemCache *mc, size_t budget) {
+    memset(mc, 0, sizeof(*mc));
+    mc->budget = budget;
+    return pthread_mutex_init(&mc->lock, NULL) == 0 ? 0 : -1;
+}
+
+static inline int mem_cache_admits(const MemCache *mc, long size) {
+    return size >= 0 && (size_t)size <= mc->budget / 4;
+}
+
+// With the lock held
+static inline void mem_object_unref(MemObject *o) {
+    if (--o->refs > 0) return;
+    free(o->name);
+    free(o->data);
+    free(o);
+}
+
+static inline void mem_cache_unlink(MemCache *mc, MemObject *o) {
+    MemObject **p = &mc->buckets[mem_cache_hash(o->name)];
+    while (*p != o) p = &(*p)->hnext;
+    *p = o->hnext;
+    if (o->prev) o->prev->next = o->next;
+    else mc->head = o->next;
+    if (o->next) o->next->prev = o->prev;
+    else mc->tail = o->prev;
+    o->prev = o->next = o->hnext = NULL;
+    mc->used -= (size_t)o->size;
+    mc->objects--;
+    mem_object_unref(o);
+}
+
+static inline void mem_cache_touch(MemCache *mc, MemObject *o) {
+    if (mc->head == o) return;
+    o->prev->next = o->next;
+    if (o->next) o->next->prev = o->prev;
+    else mc->tail = o->prev;
+    o->prev = NULL;
+    o->next = mc->head;
+    mc->head->prev = o;
+    mc->head = o;
+}
+
+// The object named name with a reference for the caller, or NULL
+static inline MemObject *mem_cache_get(MemCache *mc, const char *name) {
+    pthread_mutex_lock(&mc->lock);
+    MemObject *o = mc->buckets[mem_cache_hash(name)];
+    while (o && strcmp(o->name, name) != 0) o = o->hnext;
+    if (o) {
+        mem_cache_touch(mc, o);
+        o->refs++;
+        mc->hits++;
+    } else {
+        mc->misses++;
+    }
+    pthread_mutex_unlock(&mc->lock);
+    return o;
+}
+
+// Lists size bytes at data (malloc'd, taken over) as name, evicting from the
+// tail to make room, and returns the object with a reference for the caller.
+// An object of the same version already listed under the name (another
+// worker loaded it first) is returned instead; one of another version is
+// replaced. NULL, with data freed, if the object cannot be kept.
+static inline MemObject *mem_cache_put(MemCache *mc, const char *name, char *data, long size, uint64_t version) {
+    MemObject *o = (MemObject *)calloc(1, sizeof(*o));
+    if (!mem_cache_admits(mc, size) || !o || !(o->name = strdup(name))) {
+        free(o);
+        free(data);
+        return NULL;
+    }
+    o->cache = mc;
+    o->data = data;
+    o->size = size;
+    o->version = version;
+    o->refs = 2;        // The cache's and the caller's
+
+    pthread_mutex_lock(&mc->lock);
+    uint32_t b = mem_cache_hash(name);
+    MemObject *have = mc->buckets[b];
+    while (have && strcmp(have->name, name) != 0) have = have->hnext;
+    if (have && have->version != version) {
+        mem_cache_unlink(mc, have);
+        have = NULL;
+    }
+    if (have) {
+        mem_cache_touch(mc, have);
+        have->refs++;
+        pthread_mutex_unlock(&mc->lock);
+        free(o->name);
+        free(o->data);
+        free(o);
+        return have;
+    }
+    while (mc->tail && mc->used + (size_t)size > mc->budget) {
+        mc->evictions++;
+        mc->evicted_bytes += (uint64_t)mc->tail->size;
+        mem_cache_unlink(mc, mc->tail);
+    }
+    o->hnext = mc->buckets[b];
+    mc->buckets[b] = o;
+    o->next = mc->head;
+    if (mc->head) mc->head->prev = o;
+    mc->head = o;
+    if (!mc->tail) mc->tail = o;
+    mc->used += (size_t)size;
+    mc->objects++;
+    pthread_mutex_unlock(&mc->lock);
+    return o;
+}
+
+// Unlists name, whose file has changed or gone, if the listed object is of
+// version (0 = any). Sends under way keep their copy.
+static inline void mem_cache_drop(MemCache *mc, const char *name, uint64_t version) {
+    pthread_mutex_lock(&mc->lock);
+    MemObject *o = mc->buckets[mem_cache_hash(name)];
+    while (o && strcmp(o->name, name) != 0) o = o->hnext;
+    if (o && (version == 0 || o->version == version)) mem_cache_unlink(mc, o);
+    pthread_mutex_unlock(&mc->lock);
+}
+
+// Gives back a reference from mem_cache_get or mem_cache_put; a
+// FileSourceRelease for file_source_memory
+static inline void mem_object_release(void *owner) {
+    MemObject *o = (MemObject *)owner;
+    MemCache *mc = o->cache;
+    pthread_mutex_lock(&mc->lock);
+    mem_object_unref(o);
+    pthread_mutex_unlock(&mc->lock);
+}
+
+// One line of counters
+static inline int mem_cache_format(MemCache *mc, char *out, size_t len) {
+    pthread_mutex_lock(&mc->lock);
+    int n = snprintf(out, len,
+                     "Memory cache: %llu hits, %llu misses, %llu evictions (%llu MB), %u objects, %zu of %zu MB\n",
+                     (unsigned long long)mc->hits, (unsigned long long)mc->misses,
+                     (unsigned long long)mc->evictions, (unsigned long long)(mc->evicted_bytes >> 20), mc->objects,
+                     mc->used >> 20, mc->budget >> 20);
+    pthread_mutex_unlock(&mc->lock);
+    return n;
+}
+
+#endif // MEMCACHE_H
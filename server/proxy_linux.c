@@ -0,0 +1,540 @@
+/***************************************************************************************************
+MIT License - Linux Port (Akamai-Grade CDN Proxy)
+
+Caching proxy on the session engine: hits are served from memory or from the
+cache directory, misses are fetched from the origin without blocking other clients.
+Concurrent misses for one file share a single origin fetch, across all workers,
+and are sent the file while it arrives. The cache directory is kept under a disk
+quota by a persistent index (cacheindex.h), which also tracks how long each file
+stays fresh; stale files are revalidated with a conditional get, in the background
+while they are still served.
+****************************************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "engine.h"
+#include "memcache.h"
+#include "cacheindex.h"
+
+#define ORIGIN_PORT 5001
+#define PROXY_PORT 5002
+#define CACHE_DIR "cache"
+
+// A client get waiting for its file to arrive from the origin
+typedef struct PendingGet {
+    Engine  *engine;          // Worker the client talks to
+    struct sockaddr_in client;
+    uint32_t conn_id;
+    Command  c;
+    struct Flight *flight;    // Set when it is to be sent while the file arrives
+    FILE    *fp;              // Set when the fetched file was not admitted to the cache
+    struct PendingGet *next;
+} PendingGet;
+
+// One origin fetch and every get waiting for it. Once the origin has told
+// the size, the part file is mapped at that size and the gets are sent from
+// the mapping as the fetch's writer fills it (cut-through), never past the
+// bytes it has published in ready. Before that they wait in the list, and
+// if the file cannot be mapped they are served once it is complete. A fetch
+// that revalidates the cached copy asks for the file only if it changed;
+// if it has not, or the origin cannot be reached, the waiters get the copy.
+typedef struct Flight {
+    char        filename[sizeof(((Command *)0)->filename)];
+    char        part_path[256];   // Download target, renamed into place when complete
+    PendingGet *waiters;          // Newest first
+    unsigned    count;            // Gets served by this fetch
+    uint32_t    refs;             // The fetch's and every send's from the mapping, under flights_lock
+    const char *map;              // NULL until the reply
+    long        size;
+    long long   ready;            // Bytes written, published by the fetch's writer; -1 = fetch failed
+    int         revalidating;     // A copy is in the cache
+    CacheMeta   meta;             // What the origin's reply said of the file
+    struct Flight *next;
+} Flight;
+
+static struct sockaddr_in origin_addr;
+static MemCache mem;                // Shared by the workers
+static CacheIndex disk;             // What the cache directory holds, also shared
+static uint64_t disk_hits;          // Bumped by every worker, with relaxed atomics
+static uint64_t origin_fetches;
+static uint64_t joined_fetches;     // Misses that waited on a fetch already running
+static uint64_t stale_hits;         // Served while being revalidated
+
+// Fetches in progress, all workers'. Only a few run at a time, so a list does.
+static pthread_mutex_t flights_lock = PTHREAD_MUTEX_INITIALIZER;
+static Flight *flights;
+
+// Takes over the caller's reference to o
+static void serve_from_memory(Engine *e, const struct sockaddr_in *client, uint32_t conn_id, const Command *c,
+                              MemObject *o) {
+    FileSource src;
+    file_source_memory(&src, o->data, o->size, mem_object_release, o);
+    engine_start_send_source(e, client, conn_id, c, &src);
+}
+
+// Files being read into the memory cache, one thread each
+typedef struct MemLoad {
+    char name[sizeof(((Command *)0)->filename)];
+    struct MemLoad *next;
+} MemLoad;
+
+static pthread_mutex_t loads_lock = PTHREAD_MUTEX_INITIALIZER;
+static MemLoad *loads;
+
+static void mem_load_end(MemLoad *l) {
+    pthread_mutex_lock(&loads_lock);
+    MemLoad **link = &loads;
+    while (*link != l) link = &(*link)->next;
+    *link = l->next;
+    pthread_mutex_unlock(&loads_lock);
+    free(l);
+}
+
+// Reads a cached file into the memory cache, away from the workers' loops.
+// The get that found it on disk is sent from the file meanwhile.
+static void *mem_load(void *arg) {
+    MemLoad *l = arg;
+    char cache_path[256];
+    struct stat st, now;
+    snprintf(cache_path, sizeof(cache_path), "%s/%s", CACHE_DIR, l->name);
+
+    FILE *fp = fopen(cache_path, "rb");
+    long size = fp && fstat(fileno(fp), &st) == 0 ? (long)st.st_size : -1;
+    char *data = mem_cache_admits(&mem, size) ? malloc(size > 0 ? (size_t)size : 1) : NULL;
+    if (data && fread(data, 1, (size_t)size, fp) == (size_t)size) {
+        // Frees data if it fails
+        MemObject *o = mem_cache_put(&mem, l->name, data, size, (uint64_t)st.st_ino);
+        if (o) {
+            // Replaced while we read it: the fetch's drop may have come first
+            if (stat(cache_path, &now) != 0 || now.st_ino != st.st_ino) {
+                mem_cache_drop(&mem, l->name, (uint64_t)st.st_ino);
+            }
+            mem_object_release(o);
+        }
+    } else {
+        free(data);
+    }
+    if (fp) fclose(fp);
+
+    mem_load_end(l);
+    return NULL;
+}
+
+// Starts reading name into memory unless that is under way already
+static void mem_load_start(const char *name) {
+    pthread_t thread;
+    pthread_mutex_lock(&loads_lock);
+    MemLoad *l = loads;
+    while (l && strcmp(l->name, name) != 0) l = l->next;
+    if (l || !(l = calloc(1, sizeof(*l)))) {
+        pthread_mutex_unlock(&loads_lock);
+        return;
+    }
+    snprintf(l->name, sizeof(l->name), "%s", name);
+    l->next = loads;
+    loads = l;
+    pthread_mutex_unlock(&loads_lock);
+
+    if (pthread_create(&thread, NULL, mem_load, l) == 0) {
+        pthread_detach(thread);
+        return;
+    }
+    mem_load_end(l);
+}
+
+// Sends the file in the cache directory, and has a copy read into memory if
+// it is small enough for the memory cache. Returns -1 if the file is not there.
+static int serve_from_cache(Engine *e, const struct sockaddr_in *client, uint32_t conn_id, const Command *c) {
+    char cache_path[256];
+    struct stat st;
+    snprintf(cache_path, sizeof(cache_path), "%s/%s", CACHE_DIR, c->filename);
+
+    FILE *fp = fopen(cache_path, "rb");
+    if (!fp) {
+        printf("[Proxy] Error: File not found in cache after fetch attempt.\n");
+        return -1;
+    }
+    if (fstat(fileno(fp), &st) == 0 && mem_cache_admits(&mem, (long)st.st_size)) mem_load_start(c->filename);
+    printf("[Proxy] Serving %s from Cache...\n", c->filename);
+    engine_start_send(e, client, conn_id, c, fp);
+    return 0;
+}
+
+// A file the disk index evicted is not kept in memory either
+static void on_disk_evict(const char *name) {
+    mem_cache_drop(&mem, name, 0);
+}
+
+static void send_stats(Engine *e, const struct sockaddr_in *to, uint32_t conn_id) {
+    Packet resp;
+    memset(&resp, 0, sizeof(resp));
+    int used = mem_cache_format(&mem, resp.data, DATA_SIZE);
+    if (used >= 0 && used < DATA_SIZE) {
+        used += snprintf(resp.data + used, DATA_SIZE - used,
+                         "Disk cache: %llu hits, %llu fetches from origin, %llu misses joined one, %llu stale hits\n",
+                         (unsigned long long)__atomic_load_n(&disk_hits, __ATOMIC_RELAXED),
+                         (unsigned long long)__atomic_load_n(&origin_fetches, __ATOMIC_RELAXED),
+                         (unsigned long long)__atomic_load_n(&joined_fetches, __ATOMIC_RELAXED),
+                         (unsigned long long)__atomic_load_n(&stale_hits, __ATOMIC_RELAXED));
+    }
+    if (used >= 0 && used < DATA_SIZE) used += cache_index_format(&disk, resp.data + used, DATA_SIZE - used);
+    resp.header.data_len = (uint16_t)(used < DATA_SIZE ? used : DATA_SIZE - 1);
+    resp.header.flags = FLAG_DATA | FLAG_FIN;
+    packet_set_conn_id(&resp.header, conn_id);
+    engine_send(e, to, &resp);
+}
+
+// Unlists f; no get can join it from here on. Returns its waiters.
+static PendingGet *flight_land(Flight *f) {
+    pthread_mutex_lock(&flights_lock);
+    Flight **link = &flights;
+    while (*link != f) link = &(*link)->next;
+    *link = f->next;
+    PendingGet *waiters = f->waiters;
+    f->waiters = NULL;
+    pthread_mutex_unlock(&flights_lock);
+    return waiters;
+}
+
+// Gives back a reference to f; a FileSourceRelease for the sends from its mapping
+static void flight_release(void *owner) {
+    Flight *f = owner;
+    pthread_mutex_lock(&flights_lock);
+    uint32_t refs = --f->refs;
+    pthread_mutex_unlock(&flights_lock);
+    if (refs > 0) return;
+    if (f->map) munmap((void *)f->map, (size_t)f->size);
+    free(f);
+}
+
+// Sends the file from f's mapping as it fills, taking over a reference to f
+static void stream_from_flight(Engine *e, const struct sockaddr_in *client, uint32_t conn_id, const Command *c,
+                               Flight *f) {
+    FileSource src;
+    file_source_memory(&src, f->map, f->size, flight_release, f);
+    src.ready = &f->ready;
+    engine_start_send_source(e, client, conn_id, c, &src);
+}
+
+// Runs on the waiter's own worker (engine_post)
+static void serve_waiter(Engine *e, void *arg) {
+    PendingGet *pg = arg;
+    if (pg->flight) {
+        stream_from_flight(e, &pg->client, pg->conn_id, &pg->c, pg->flight);
+    } else if (pg->fp) {
+        engine_start_send(e, &pg->client, pg->conn_id, &pg->c, pg->fp);
+    } else {
+        serve_from_cache(e, &pg->client, pg->conn_id, &pg->c);
+    }
+    free(pg);
+}
+
+static void hand_to_worker(Engine *e, PendingGet *pg) {
+    if (pg->engine == e) {
+        serve_waiter(e, pg);
+    } else if (engine_post(pg->engine, serve_waiter, pg) != 0) {
+        if (pg->flight) flight_release(pg->flight);
+        if (pg->fp) fclose(pg->fp);
+        free(pg);
+    }
+}
+
+// The origin told the size: start sending to everyone waiting
+static void on_origin_reply(Engine *e, Session *s, const Command *reply) {
+    Flight *f = s->user;
+    f->meta.mtime = reply->mtime;
+    f->meta.etag = reply->etag;
+    f->meta.has_etag = (uint32_t)reply->has_etag;
+    if (reply->unchanged || reply->size <= 0) return;
+    void *map = mmap(NULL, (size_t)reply->size, PROT_READ, MAP_SHARED, s->sink.fd, 0);
+    if (map == MAP_FAILED) return;
+
+    pthread_mutex_lock(&flights_lock);
+    f->map = map;
+    f->size = (long)reply->size;
+    PendingGet *pg = f->waiters;
+    f->waiters = NULL;
+    for (PendingGet *w = pg; w; w = w->next) {
+        w->flight = f;
+        f->refs++;
+    }
+    unsigned waiting = f->count;
+    pthread_mutex_unlock(&flights_lock);
+
+    printf("[Proxy] Streaming %s to %u clients as it arrives from Origin\n", f->filename, waiting);
+    while (pg) {
+        PendingGet *next = pg->next;
+        hand_to_worker(e, pg);
+        pg = next;
+    }
+}
+
+static void on_fetched(Engine *e, Session *s, int ok) {
+    Flight *f = s->user;
+    char cache_path[256];
+    snprintf(cache_path, sizeof(cache_path), "%s/%s", CACHE_DIR, f->filename);
+
+    // Sends from the mapping give up if the file will not be complete
+    if (!ok) __atomic_store_n(&f->ready, -1, __ATOMIC_RELEASE);
+    int unchanged = ok && s->unchanged;
+    if (unchanged) {
+        remove(f->part_path);
+        cache_index_revalidated(&disk, f->filename, &f->meta);
+    } else if (ok) {
+        // Listed before the flight is unlisted, so a later miss finds the file
+        ok = rename(f->part_path, cache_path) == 0;
+        mem_cache_drop(&mem, f->filename, 0);
+    }
+    if (!ok) remove(f->part_path);
+    struct stat st;
+    int kept = unchanged ||
+               (ok && stat(cache_path, &st) == 0 && cache_index_admit(&disk, f->filename, st.st_size, &f->meta));
+    PendingGet *pg = flight_land(f);
+    if (unchanged) {
+        printf("[Proxy] %s unchanged at Origin, cached copy fresh again.\n", f->filename);
+    } else if (kept) {
+        printf("[Proxy] Fetched %s from Origin for %u clients.\n", f->filename, f->count);
+    } else if (ok) {
+        printf("[Proxy] Fetched %s from Origin for %u clients, not caching it.\n", f->filename, f->count);
+    } else if (f->revalidating) {
+        printf("[Proxy] Cannot revalidate %s with origin, serving the stale copy\n", f->filename);
+    } else {
+        printf("[Proxy] Failed to fetch %s from origin\n", f->filename);
+    }
+
+    // Left over only if the file could not be streamed. Ones that are not
+    // kept are opened before they go.
+    while (pg) {
+        PendingGet *next = pg->next;
+        if (ok && !kept) pg->fp = fopen(cache_path, "rb");
+        if (kept || pg->fp || (!ok && f->revalidating)) {
+            hand_to_worker(e, pg);
+        } else {
+            free(pg);
+        }
+        pg = next;
+    }
+    if (ok && !kept) remove(cache_path);
+    flight_release(f);
+}
+
+// Lists a flight for filename with waiters pg (under flights_lock)
+static Flight *flight_new(const char *filename, uint32_t conn_id, PendingGet *pg, int revalidating) {
+    Flight *f = calloc(1, sizeof(*f));
+    if (!f) return NULL;
+    snprintf(f->filename, sizeof(f->filename), "%s", filename);
+    snprintf(f->part_path, sizeof(f->part_path), "%s/%s.part%06x", CACHE_DIR, filename, conn_id);
+    f->waiters = pg;
+    f->count = pg ? 1 : 0;
+    f->refs = 1;
+    f->revalidating = revalidating;
+    f->next = flights;
+    flights = f;
+    return f;
+}
+
+// Starts f's fetch, conditional on held, the copy in the cache, when the
+// origin told its etag
+static void flight_start(Engine *e, Flight *f, const CacheEntry *held) {
+    const uint32_t *etag = held && held->meta.has_etag ? &held->meta.etag : NULL;
+
+    // Download next to the cache entry, publish it on completion. Read as
+    // well as written: sends map it while it downloads.
+    __atomic_add_fetch(&origin_fetches, 1, __ATOMIC_RELAXED);
+    FILE *fp = fopen(f->part_path, "w+b");
+    Session *s = fp ? engine_start_fetch(e, &origin_addr, f->filename, etag, fp, on_fetched, f) : NULL;
+    if (!s) {
+        printf("[Proxy] Failed to fetch from origin\n");
+        if (fp) remove(f->part_path);
+        for (PendingGet *pg = flight_land(f); pg;) {
+            PendingGet *next = pg->next;
+            if (f->revalidating) {
+                hand_to_worker(e, pg);
+            } else {
+                free(pg);
+            }
+            pg = next;
+        }
+        flight_release(f);
+        return;
+    }
+    s->on_reply = on_origin_reply;
+    file_sink_publish(&s->sink, &f->ready);
+}
+
+// Queues the get behind the fetch of its file, starting the fetch if none is
+// running, or sends it what has arrived so far. held is the expired copy in
+// the cache, to revalidate, or NULL on a miss. Returns 1 if the file turned
+// up in the cache, or was revalidated, meanwhile instead.
+static int fetch_or_join(Engine *e, const struct sockaddr_in *from, uint32_t conn_id, const Command *c,
+                         const CacheEntry *held) {
+    PendingGet *pg = calloc(1, sizeof(*pg));
+    if (!pg) return 0;
+    pg->engine = e;
+    pg->client = *from;
+    pg->conn_id = conn_id;
+    pg->c = *c;
+
+    pthread_mutex_lock(&flights_lock);
+    Flight *f = flights;
+    while (f && strcmp(f->filename, c->filename) != 0) f = f->next;
+    if (f) {
+        unsigned waiting = ++f->count;
+        if (f->map) {
+            f->refs++;
+            pthread_mutex_unlock(&flights_lock);
+            free(pg);
+            printf("[Proxy] Cache Miss: %s already coming from Origin, streaming to %u clients\n", c->filename,
+                   waiting);
+            __atomic_add_fetch(&joined_fetches, 1, __ATOMIC_RELAXED);
+            stream_from_flight(e, from, conn_id, c, f);
+            return 0;
+        }
+        pg->next = f->waiters;
+        f->waiters = pg;
+        pthread_mutex_unlock(&flights_lock);
+        printf("[Proxy] Cache Miss: %s already coming from Origin, %u clients waiting\n", c->filename, waiting);
+        __atomic_add_fetch(&joined_fetches, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    // A fetch that landed since the caller looked has listed the file
+    int landed = cache_index_checked(&disk, c->filename) > (held ? held->checked : -1);
+    if (landed || !(f = flight_new(c->filename, conn_id, pg, held != NULL))) {
+        pthread_mutex_unlock(&flights_lock);
+        free(pg);
+        return landed;
+    }
+    pthread_mutex_unlock(&flights_lock);
+
+    if (held) {
+        printf("[Proxy] Cache Expired: Revalidating %s with Origin...\n", c->filename);
+    } else {
+        printf("[Proxy] Cache Miss: Fetching %s from Origin...\n", c->filename);
+    }
+    flight_start(e, f, held);
+    return 0;
+}
+
+// Checks a stale file with the origin in the background, unless a fetch of
+// it is already running
+static void revalidate(Engine *e, uint32_t conn_id, const Command *c, const CacheEntry *held) {
+    pthread_mutex_lock(&flights_lock);
+    Flight *f = flights;
+    while (f && strcmp(f->filename, c->filename) != 0) f = f->next;
+    if (f || cache_index_checked(&disk, c->filename) > held->checked ||
+        !(f = flight_new(c->filename, conn_id, NULL, 1))) {
+        pthread_mutex_unlock(&flights_lock);
+        return;
+    }
+    pthread_mutex_unlock(&flights_lock);
+    printf("[Proxy] %s is stale, revalidating with Origin\n", c->filename);
+    flight_start(e, f, held);
+}
+
+static void on_command(Engine *e, const struct sockaddr_in *from, uint32_t conn_id, const Command *c) {
+    CacheEntry held;
+
+    if (strcmp(c->cmd, "stats") == 0) {
+        send_stats(e, from, conn_id);
+        return;
+    }
+    if (strcmp(c->cmd, "get") != 0) return;
+
+    // Counts memory hits too. Stale files are still served.
+    CacheState state = cache_index_access(&disk, c->filename, &held);
+    if (state == CACHE_STALE) {
+        __atomic_add_fetch(&stale_hits, 1, __ATOMIC_RELAXED);
+        revalidate(e, conn_id, c, &held);
+    }
+    if (state == CACHE_FRESH || state == CACHE_STALE) {
+        MemObject *o = mem_cache_get(&mem, c->filename);
+        if (o) {
+            printf("[Proxy] Memory Hit for %s\n", c->filename);
+            serve_from_memory(e, from, conn_id, c, o);
+            return;
+        }
+    } else if (!fetch_or_join(e, from, conn_id, c, state == CACHE_EXPIRED ? &held : NULL)) {
+        return;
+    }
+    printf("[Proxy] Cache Hit for %s\n", c->filename);
+    __atomic_add_fetch(&disk_hits, 1, __ATOMIC_RELAXED);
+    if (serve_from_cache(e, from, conn_id, c) != 0) {
+        // Removed behind the index's back: fetch it again
+        cache_index_forget(&disk, c->filename);
+        if (fetch_or_join(e, from, conn_id, c, NULL)) serve_from_cache(e, from, conn_id, c);
+    }
+}
+
+int main(int argc, char **argv) {
+    EngineConfig cfg = {PROXY_PORT, 1, 0, 0, 1, 0};
+    long mem_mb = MEM_CACHE_MB;
+    long disk_mb = CACHE_DISK_MB;
+    long ttl = CACHE_TTL_S;
+    long stale = CACHE_STALE_S;
+    const char *args[3];
+    int nargs = 0;
+    int usage = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-offload") == 0) {
+            cfg.offload = 0;
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            cfg.uring = 1;
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            cfg.workers = (unsigned)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--mem-cache") == 0 && i + 1 < argc) {
+            mem_mb = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--disk-cache") == 0 && i + 1 < argc) {
+            disk_mb = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--ttl") == 0 && i + 1 < argc) {
+            ttl = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--stale") == 0 && i + 1 < argc) {
+            stale = atol(argv[++i]);
+        } else if (nargs < 3) {
+            args[nargs++] = argv[i];
+        } else {
+            usage = 1;
+        }
+    }
+    if (usage || nargs == 1 || cfg.workers == 0 || mem_mb < 0 || disk_mb < 0 || ttl < 0 || stale < 0) {
+        printf("Usage: %s [Origin IP] [Origin Port] [Proxy Port] [--no-offload] [--io-uring] [--workers N] "
+               "[--mem-cache MB] [--disk-cache MB] [--ttl SEC] [--stale SEC]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&origin_addr, 0, sizeof(origin_addr));
+    origin_addr.sin_family = AF_INET;
+    origin_addr.sin_port = htons(nargs >= 2 ? atoi(args[1]) : ORIGIN_PORT);
+    origin_addr.sin_addr.s_addr = inet_addr(nargs >= 2 ? args[0] : "127.0.0.1");
+    if (nargs == 3) cfg.port = (uint16_t)atoi(args[2]);
+
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    srand((unsigned)time(NULL) ^ (unsigned)getpid());
+    mkdir(CACHE_DIR, 0755);
+    if (mem_cache_init(&mem, (size_t)mem_mb << 20) != 0) {
+        printf("Cannot set up the memory cache\n");
+        exit(EXIT_FAILURE);
+    }
+    if (cache_index_open(&disk, CACHE_DIR, (int64_t)disk_mb << 20, (uint32_t)ttl, (uint32_t)stale) != 0) {
+        printf("Cannot map the cache index %s/%s\n", CACHE_DIR, CACHE_INDEX_NAME);
+        exit(EXIT_FAILURE);
+    }
+    disk.on_evict = on_disk_evict;
+    printf("Cache index %s: %u files, %lld of %ld MB\n", disk.warm ? "mapped" : "rebuilt from the directory",
+           disk.objects, (long long)(disk.used >> 20), disk_mb);
+
+    printf("Akamai-Grade CDN Proxy (epoll) started on port %u, %ld MB memory cache\n", cfg.port, mem_mb);
+    engine_run_workers(&cfg, on_command);
+    return EXIT_FAILURE;
+}
@@ -17,6 +17,13 @@ Listens on Port 5002.
 #include <direct.h>
 
 #include "../common/protocol.h"
+#include "../common/sack.h"
+#include "../common/cc.h"
+#include "../common/command.h"
+#include "../common/crc32.h"
+#include "../common/filesrc.h"
+#include "../common/rtt.h"
+#include "../common/stats.h"
 
 #pragma comment(lib, "ws2_32.lib")
 
@@ -24,36 +31,17 @@ Listens on Port 5002.
 #define PROXY_PORT 5002
 #define CACHE_DIR "cache"
 
-// Reuse CRC32 from server (duplicated here for simplicity of single-file compilation if needed, or we can link)
-static uint32_t crc32_table[256];
-
-void init_crc32() {
-    uint32_t polynomial = 0xEDB88320;
-    for (uint32_t i = 0; i < 256; i++) {
-        uint32_t c = i;
-        for (int j = 0; j < 8; j++) {
-            if (c & 1) {
-                c = polynomial ^ (c >> 1);
-            } else {
-                c >>= 1;
-            }
-        }
-        crc32_table[i] = c;
-    }
+static void print_error(const char *msg) {
+    fprintf(stderr, "%s: %d\n", msg, WSAGetLastError());
+    exit(EXIT_FAILURE);
 }
 
-uint32_t calculate_crc32(const void *buf, size_t size) {
-    const uint8_t *p = (const uint8_t *)buf;
-    uint32_t crc = 0xFFFFFFFF;
-    for (size_t i = 0; i < size; i++) {
-        crc = crc32_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
-    }
-    return ~crc;
-}
+static ChecksumType csum;  // Checksum of the transfer in progress
 
 void send_packet(SOCKET sfd, struct sockaddr_in *addr, int addr_len, Packet *pkt) {
+    if (csum == CSUM_CRC32C) pkt->header.flags |= FLAG_CRC32C;
     pkt->header.checksum = 0;
-    pkt->header.checksum = calculate_crc32(pkt, sizeof(PacketHeader) + pkt->header.data_len);
+    pkt->header.checksum = packet_crc(pkt);
     sendto(sfd, (char *)pkt, sizeof(PacketHeader) + pkt->header.data_len, 0, (struct sockaddr *)addr, addr_len);
 }
 
@@ -65,6 +53,9 @@ int fetch_from_origin(char *filename) {
     struct sockaddr_in sv_addr;
     
     if ((sfd = socket(AF_INET, SOCK_DGRAM, 0)) == INVALID_SOCKET) return 0;
+
+    int sock_buf = SOCKET_BUFFER_BYTES;
+    setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, (char *)&sock_buf, sizeof(sock_buf));
     
     memset(&sv_addr, 0, sizeof(sv_addr));
     sv_addr.sin_family = AF_INET;
@@ -73,8 +64,12 @@ int fetch_from_origin(char *filename) {
 
     // Send GET request to Origin
     Packet req;
+    Command c;
     memset(&req, 0, sizeof(req));
     sprintf(req.data, "get %s", filename);
+    command_parse(req.data, &c);
+    command_add_default_options(&c, req.data, DATA_SIZE);
+    csum = CSUM_CRC32;
     req.header.data_len = strlen(req.data);
     req.header.flags = FLAG_SYN; // Using SYN/Data for command
     send_packet(sfd, &sv_addr, sizeof(sv_addr), &req);
@@ -88,12 +83,39 @@ int fetch_from_origin(char *filename) {
         return 0;
     }
 
-    uint32_t expected_seq = 1;
+    RecvWindow rw;
+    AckState as;
+    AckPolicy immediate;
+    if (recv_window_init(&rw) != 0) {
+        fclose(fp);
+        closesocket(sfd);
+        return 0;
+    }
+    // ACK every packet until the origin confirms the coalescing asked for
+    ack_policy_default(&immediate);
+    ack_state_init(&as, &immediate);
     Packet pkt;
     Packet ack;
     int success = 0;
 
     while (1) {
+        // Flush a delayed ACK once its timer runs out
+        int64_t ack_wait = ack_wait_us(&as, now_us());
+        if (ack_wait >= 0) {
+            fd_set readfds;
+            struct timeval tv;
+            tv.tv_sec = (long)(ack_wait / 1000000);
+            tv.tv_usec = (long)(ack_wait % 1000000);
+            FD_ZERO(&readfds);
+            FD_SET(sfd, &readfds);
+            if (ack_wait == 0 || select(0, &readfds, NULL, NULL, &tv) == 0) {
+                recv_window_build_ack(&rw, &ack);
+                send_packet(sfd, &sv_addr, sizeof(sv_addr), &ack);
+                ack_on_sent(&as);
+                continue;
+            }
+        }
+
         struct sockaddr_in from_addr;
         int from_len = sizeof(from_addr);
         int len = recvfrom(sfd, (char *)&pkt, sizeof(pkt), 0, (struct sockaddr *)&from_addr, &from_len);
@@ -101,46 +123,47 @@ int fetch_from_origin(char *filename) {
         if (len > 0) {
             uint32_t received_crc = pkt.header.checksum;
             pkt.header.checksum = 0;
-            if (calculate_crc32(&pkt, sizeof(PacketHeader) + pkt.header.data_len) == received_crc) {
+            if (packet_crc(&pkt) == received_crc) {
                 if (pkt.header.flags & FLAG_DATA) {
-                    if (pkt.header.seq_num == expected_seq) {
-                        fwrite(pkt.data, 1, pkt.header.data_len, fp);
-                        
-                        // Send ACK
-                        ack.header.seq_num = 0;
-                        ack.header.ack_num = expected_seq;
-                        ack.header.flags = FLAG_ACK;
-                        ack.header.data_len = 0;
-                        send_packet(sfd, &from_addr, from_len, &ack);
-                        
-                        if (pkt.header.flags & FLAG_FIN) {
-                            success = 1;
-                            break;
-                        }
-                        expected_seq++;
-                    } else if (pkt.header.seq_num < expected_seq) {
-                        ack.header.seq_num = 0;
-                        ack.header.ack_num = pkt.header.seq_num;
-                        ack.header.flags = FLAG_ACK;
-                        ack.header.data_len = 0;
+                    Packet *in_order;
+                    int clean = recv_window_in_order(&rw, &pkt);
+                    clean &= recv_window_accept(&rw, &pkt);
+                    while ((in_order = recv_window_next(&rw)) != NULL) {
+                        fwrite(in_order->data, 1, in_order->header.data_len, fp);
+                    }
+
+                    // Send ACK
+                    if (ack_on_data(&as, clean, recv_window_done(&rw), now_us())) {
+                        recv_window_build_ack(&rw, &ack);
                         send_packet(sfd, &from_addr, from_len, &ack);
+                        ack_on_sent(&as);
+                    }
+
+                    if (recv_window_done(&rw)) {
+                        success = 1;
+                        break;
                     }
+                } else if ((pkt.header.flags & (FLAG_SYN | FLAG_ACK)) == (FLAG_SYN | FLAG_ACK)) {
+                    command_parse_reply(&pkt, &c);
+                    as.policy = c.ack;
+                    csum = c.csum;
                 }
             }
         }
     }
     
+    recv_window_free(&rw);
     fclose(fp);
     closesocket(sfd);
     printf("[Proxy] Fetched %s from Origin.\n", filename);
     return success;
 }
 
-void serve_from_cache(SOCKET sfd, struct sockaddr_in *cl_addr, int addr_len, char *filename) {
+void serve_from_cache(SOCKET sfd, struct sockaddr_in *cl_addr, int addr_len, const Command *c) {
     char cache_path[256];
-    sprintf(cache_path, "%s\\%s", CACHE_DIR, filename);
+    sprintf(cache_path, "%s\\%s", CACHE_DIR, c->filename);
     
-    printf("[Proxy] Serving %s from Cache...\n", filename);
+    printf("[Proxy] Serving %s from Cache...\n", c->filename);
     
     FILE *fp = fopen(cache_path, "rb");
     if (!fp) {
@@ -148,32 +171,50 @@ void serve_from_cache(SOCKET sfd, struct sockaddr_in *cl_addr, int addr_len, cha
         return;
     }
 
-    fseek(fp, 0, SEEK_END);
-    long filesize = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+    FileSource src;
+    int src_ok = file_source_open(&src, fp) == 0;
+    long filesize = src.size;
     uint32_t total_packets = (filesize + DATA_SIZE - 1) / DATA_SIZE;
 
-    uint32_t base = 1;
-    uint32_t next_seq_num = 1;
-    Packet window[MAX_WINDOW_SIZE];
-    int window_valid[MAX_WINDOW_SIZE] = {0};
-
-    while (base <= total_packets) {
-        while (next_seq_num < base + MAX_WINDOW_SIZE && next_seq_num <= total_packets) {
-            int idx = next_seq_num % MAX_WINDOW_SIZE;
-            if (!window_valid[idx] || window[idx].header.seq_num != next_seq_num) {
-                long offset = (next_seq_num - 1) * DATA_SIZE;
-                fseek(fp, offset, SEEK_SET);
-                int bytes_read = fread(window[idx].data, 1, DATA_SIZE, fp);
+    SendWindow sw;
+    RttEstimator rtt;
+    CongestionControl cc;
+    TransferStats st;
+    if (!src_ok || send_window_init(&sw, total_packets) != 0) {
+        file_source_close(&src);
+        return;
+    }
+    rtt_init(&rtt);
+    rtt_set_ack_delay(&rtt, c->ack.delay_us);
+    cc_init(&cc);
+    stats_init(&st);
+    uint64_t timer_start = now_us();   // Retransmission timer, restarted when base advances
+    uint32_t seq;
+
+    while (sw.base <= total_packets) {
+        while (send_window_has_room(&sw, cc_window(&cc)) && send_window_next_lost(&sw, &seq)) {
+            send_packet(sfd, cl_addr, addr_len, &send_window_slot(&sw, seq)->pkt);
+            send_window_sent(&sw, seq, now_us());
+            st.data_packets++;
+            st.retransmits++;
+        }
+
+        while (send_window_can_send(&sw, cc_window(&cc))) {
+            Packet *out = &send_window_slot(&sw, sw.next_seq)->pkt;
+            if (out->header.seq_num != sw.next_seq) {
+                uint16_t bytes_read;
+                const char *payload = file_source_payload(&src, (long)(sw.next_seq - 1) * DATA_SIZE, &bytes_read);
+                memcpy(out->data, payload, bytes_read);
                 
-                window[idx].header.seq_num = next_seq_num;
-                window[idx].header.data_len = bytes_read;
-                window[idx].header.flags = FLAG_DATA;
-                if (next_seq_num == total_packets) window[idx].header.flags |= FLAG_FIN;
-                window_valid[idx] = 1;
+                out->header.seq_num = sw.next_seq;
+                out->header.data_len = bytes_read;
+                out->header.flags = FLAG_DATA;
+                if (sw.next_seq == total_packets) out->header.flags |= FLAG_FIN;
             }
-            send_packet(sfd, cl_addr, addr_len, &window[idx]);
-            next_seq_num++;
+            send_packet(sfd, cl_addr, addr_len, out);
+            if (send_window_sent(&sw, sw.next_seq, now_us())) st.retransmits++;
+            st.data_packets++;
+            send_window_advance(&sw);
         }
 
         Packet ack_pkt;
@@ -182,32 +223,51 @@ void serve_from_cache(SOCKET sfd, struct sockaddr_in *cl_addr, int addr_len, cha
         
         fd_set readfds;
         struct timeval tv;
-        tv.tv_sec = 0;
-        tv.tv_usec = 100000;
+        uint64_t now = now_us();
+        uint64_t deadline = timer_start + rtt.rto_us;
+        uint64_t wait_us = deadline > now ? deadline - now : 0;
+        tv.tv_sec = (long)(wait_us / 1000000);
+        tv.tv_usec = (long)(wait_us % 1000000);
 
         FD_ZERO(&readfds);
         FD_SET(sfd, &readfds);
 
-        int activity = select(0, &readfds, NULL, NULL, &tv);
+        int activity = wait_us > 0 ? select(0, &readfds, NULL, NULL, &tv) : 0;
         if (activity > 0) {
             int len = recvfrom(sfd, (char *)&ack_pkt, sizeof(ack_pkt), 0, (struct sockaddr *)&from_addr, &from_len);
             if (len > 0) {
                  uint32_t received_crc = ack_pkt.header.checksum;
                 ack_pkt.header.checksum = 0;
-                if (calculate_crc32(&ack_pkt, sizeof(PacketHeader) + ack_pkt.header.data_len) == received_crc) {
+                if (packet_crc(&ack_pkt) == received_crc) {
                     if (ack_pkt.header.flags & FLAG_ACK) {
-                        if (ack_pkt.header.ack_num >= base) {
-                            base = ack_pkt.header.ack_num + 1;
+                        uint32_t old_base = sw.base;
+                        uint32_t old_losses = sw.loss_events;
+                        int64_t rtt_us;
+                        st.acks++;
+                        uint32_t newly = send_window_on_ack(&sw, &ack_pkt, now_us(), &rtt_us);
+                        if (rtt_us >= 0) {
+                            rtt_sample(&rtt, (uint32_t)rtt_us);
+                            cc_on_rtt(&cc, (uint32_t)rtt_us);
                         }
+                        if (sw.loss_events != old_losses) cc_on_loss(&cc, &sw);
+                        cc_on_ack(&cc, &sw, newly, rtt.srtt_us, now_us());
+                        if (sw.base != old_base) timer_start = now_us();
                     }
                 }
             }
-        } else {
-            next_seq_num = base;
+        } else if (activity == 0) {
+            printf("[Proxy] Timeout, resending from %d (RTO %u ms)\n", sw.base, rtt.rto_us / 1000);
+            st.timeouts++;
+            rtt_backoff(&rtt);
+            if (send_window_on_timeout(&sw)) cc_on_timeout(&cc, &sw);
+            timer_start = now_us();
         }
     }
-    fclose(fp);
-    printf("[Proxy] Served %s to client.\n", filename);
+    file_source_close(&src);
+    printf("[Proxy] Served %s to client.\n", c->filename);
+    st.bytes = filesize;
+    stats_print_sender("[Proxy] ", &st, &sw, &rtt, &cc);
+    send_window_free(&sw);
 }
 
 int main(int argc, char **argv) {
@@ -224,6 +284,10 @@ int main(int argc, char **argv) {
 
     if ((sfd = socket(AF_INET, SOCK_DGRAM, 0)) == INVALID_SOCKET) print_error("Proxy: socket");
 
+    int sock_buf = SOCKET_BUFFER_BYTES;
+    setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, (char *)&sock_buf, sizeof(sock_buf));
+    setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, (char *)&sock_buf, sizeof(sock_buf));
+
     memset(&sv_addr, 0, sizeof(sv_addr));
     sv_addr.sin_family = AF_INET;
     sv_addr.sin_port = htons(PROXY_PORT);
@@ -241,11 +305,13 @@ int main(int argc, char **argv) {
         if (len > 0) {
             uint32_t received_crc = pkt.header.checksum;
             pkt.header.checksum = 0;
-            if (calculate_crc32(&pkt, sizeof(PacketHeader) + pkt.header.data_len) == received_crc) {
-                char cmd[10], filename[200];
-                sscanf(pkt.data, "%s %s", cmd, filename);
+            if (packet_crc(&pkt) == received_crc) {
+                Command c;
+                command_parse(pkt.data, &c);
+                command_plain(&c);
+                char *filename = c.filename;
                 
-                if (strcmp(cmd, "get") == 0) {
+                if (strcmp(c.cmd, "get") == 0) {
                     char cache_path[256];
                     sprintf(cache_path, "%s\\%s", CACHE_DIR, filename);
                     
@@ -260,7 +326,13 @@ int main(int argc, char **argv) {
                         fclose(test_fp);
                         printf("[Proxy] Cache Hit for %s\n", filename);
                     }
-                    serve_from_cache(sfd, &cl_addr, addr_len, filename);
+                    csum = c.csum;
+                    if (c.has_options) {
+                        Packet reply;
+                        command_build_reply(&c, &reply);
+                        send_packet(sfd, &cl_addr, addr_len, &reply);
+                    }
+                    serve_from_cache(sfd, &cl_addr, addr_len, &c);
                 }
             }
         }
@@ -0,0 +1,390 @@
+/***************************************************************************************************
+MIT License - Linux Port (Akamai-Grade Reliable UDP)
+
+Event-driven server: every get/put runs as a session on one epoll loop
+****************************************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#include "../common/batch.h"
+#include "../common/delta.h"
+#include "engine.h"
+
+#define ETAG_SLOTS 1024         // Remembered file hashes, power of two
+
+// CRC-32C of files already hashed, so that asking for the etag of a file
+// does not cost a pass over it each time. A slot is only trusted while the
+// file has the same inode, size and modification time. Hashing a file takes
+// a pass over all of it, so it runs on a thread of its own and the result
+// comes back to the worker with engine_post; gets that come meanwhile are
+// answered without an etag (a conditional one gets the file).
+typedef struct {
+    char     name[200];
+    dev_t    dev;
+    ino_t    ino;
+    off_t    size;
+    struct timespec mtime;
+    uint32_t etag;
+    int      used;
+    int      hashing;           // A thread is working out etag for this file
+} EtagSlot;
+
+static EtagSlot etag_slots[ETAG_SLOTS];
+static pthread_mutex_t etag_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// A file being hashed: the slot it goes to, once it is still the same file
+typedef struct {
+    Engine  *engine;
+    EtagSlot file;
+} EtagJob;
+
+static EtagSlot *etag_slot(const char *name) {
+    uint32_t h = 2166136261u;       // FNV-1a
+    for (const char *p = name; *p; p++) h = (h ^ (uint8_t)*p) * 16777619u;
+    return &etag_slots[h & (ETAG_SLOTS - 1)];
+}
+
+// The file name as fstat sees it, in slot form, with no etag yet
+static void etag_file(EtagSlot *f, const char *name, const struct stat *st) {
+    memset(f, 0, sizeof(*f));
+    snprintf(f->name, sizeof(f->name), "%s", name);
+    f->dev = st->st_dev;
+    f->ino = st->st_ino;
+    f->size = st->st_size;
+    f->mtime = st->st_mtim;
+}
+
+static int etag_same_file(const EtagSlot *a, const EtagSlot *b) {
+    return strcmp(a->name, b->name) == 0 && a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+// On the worker that asked (engine_post), or on the hashing thread if the
+// post failed: files the slot, unless it has been taken for another file
+static void etag_store(Engine *e, void *arg) {
+    EtagJob *job = arg;
+    EtagSlot *slot = etag_slot(job->file.name);
+    (void)e;
+    pthread_mutex_lock(&etag_lock);
+    if (slot->hashing && etag_same_file(slot, &job->file)) *slot = job->file;
+    pthread_mutex_unlock(&etag_lock);
+    free(job);
+}
+
+static void *etag_hash(void *arg) {
+    EtagJob *job = arg;
+    EtagSlot now;
+    struct stat st;
+    int same = 0;
+    FILE *fp = fopen(job->file.name, "rb");
+    if (fp && fstat(fileno(fp), &st) == 0) {
+        etag_file(&now, job->file.name, &st);
+        same = etag_same_file(&now, &job->file);
+    }
+    // A file changed since is hashed again by the next get that asks
+    job->file.used = same && crc32c_stream(fp, &job->file.etag) == 0;
+    if (fp) fclose(fp);
+    if (engine_post(job->engine, etag_store, job) != 0) etag_store(job->engine, job);
+    return NULL;
+}
+
+// Fills in the mtime and size of the open file fp for the reply to a get
+// that asked for its etag, and the etag too if it is known. If not, starts
+// working it out. Returns -1 if the file cannot be read.
+static int file_etag(Engine *e, FILE *fp, const char *name, Command *c) {
+    struct stat st;
+    EtagSlot file, *slot = etag_slot(name);
+    if (fstat(fileno(fp), &st) != 0) return -1;
+    etag_file(&file, name, &st);
+    c->mtime = (long long)st.st_mtime;
+    c->size = (long long)st.st_size;
+
+    pthread_mutex_lock(&etag_lock);
+    int same = etag_same_file(slot, &file);
+    int known = same && slot->used;
+    uint32_t etag = slot->etag;
+    EtagJob *job = !same || (!slot->used && !slot->hashing) ? calloc(1, sizeof(*job)) : NULL;
+    if (job) {
+        *slot = file;
+        slot->hashing = 1;
+        job->engine = e;
+        job->file = file;
+    }
+    pthread_mutex_unlock(&etag_lock);
+
+    pthread_t thread;
+    if (job && pthread_create(&thread, NULL, etag_hash, job) == 0) {
+        pthread_detach(thread);
+    } else if (job) {
+        pthread_mutex_lock(&etag_lock);
+        if (etag_same_file(slot, &file)) slot->hashing = 0;     // The next get tries again
+        pthread_mutex_unlock(&etag_lock);
+        free(job);
+    }
+    c->etag = known ? etag : 0;
+    c->has_etag = known;
+    return 0;
+}
+
+static void send_listing(Engine *e, const struct sockaddr_in *to, uint32_t conn_id) {
+    Packet resp;
+    size_t used = 0;
+    DIR *dir = opendir(".");
+
+    memset(&resp, 0, sizeof(resp));
+    if (dir) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            size_t len = strlen(entry->d_name);
+            if (used + len + 1 >= DATA_SIZE) break;
+            memcpy(resp.data + used, entry->d_name, len);
+            resp.data[used + len] = '\n';
+            used += len + 1;
+        }
+        closedir(dir);
+    }
+    resp.header.data_len = (uint16_t)used;
+    resp.header.flags = FLAG_DATA | FLAG_FIN;
+    packet_set_conn_id(&resp.header, conn_id);
+    engine_send(e, to, &resp);
+}
+
+static void send_delete_result(Engine *e, const struct sockaddr_in *to, uint32_t conn_id, const char *filename) {
+    Packet resp;
+    int32_t res = remove(filename) == 0 ? 1 : -1;
+
+    memset(&resp, 0, sizeof(resp));
+    memcpy(resp.data, &res, sizeof(res));
+    resp.header.data_len = sizeof(res);
+    resp.header.flags = FLAG_ACK;
+    packet_set_conn_id(&resp.header, conn_id);
+    engine_send(e, to, &resp);
+}
+
+// "mget a,b,c" (batch.h): the files packed into as few packets as they fit,
+// first fit in request order, sent at once with no session behind them
+static void send_small_files(Engine *e, const struct sockaddr_in *to, uint32_t conn_id, const Command *c) {
+    Packet pkts[BATCH_MAX_FILES];
+    char names[sizeof(c->filename)];
+    char buf[BATCH_FILE_MAX + 1];
+    unsigned npkts = 0, nfiles = 0;
+    char *save = NULL;
+
+    snprintf(names, sizeof(names), "%s", c->filename);
+    for (char *name = strtok_r(names, ",", &save); name && nfiles < BATCH_MAX_FILES;
+         name = strtok_r(NULL, ",", &save), nfiles++) {
+        FILE *fp = fopen(name, "rb");
+        size_t len = fp ? fread(buf, 1, sizeof(buf), fp) : 0;
+        uint8_t status = !fp || ferror(fp) ? BATCH_NOT_FOUND : len > BATCH_FILE_MAX ? BATCH_TOO_LARGE : BATCH_OK;
+        if (fp) fclose(fp);
+        if (status != BATCH_OK) len = 0;
+
+        unsigned i = 0;
+        while (i < npkts && batch_add(&pkts[i], (uint8_t)nfiles, status, buf, (uint16_t)len) != 0) i++;
+        if (i == npkts) {
+            memset(&pkts[i].header, 0, sizeof(pkts[i].header));
+            batch_add(&pkts[npkts++], (uint8_t)nfiles, status, buf, (uint16_t)len);
+        }
+    }
+    printf("MGET %u files in %u packets\n", nfiles, npkts);
+    for (unsigned i = 0; i < npkts; i++) {
+        pkts[i].header.seq_num = i + 1;
+        pkts[i].header.ack_num = npkts;
+        pkts[i].header.flags = FLAG_DATA | (i + 1 == npkts ? FLAG_FIN : 0);
+        packet_set_conn_id(&pkts[i].header, conn_id);
+        engine_send(e, to, &pkts[i]);
+    }
+}
+
+static void *apply_delta(void *arg) {
+    char *target = (char *)arg;
+    char delta_path[256];
+    const char *why;
+
+    snprintf(delta_path, sizeof(delta_path), "%s%s", target, DELTA_SUFFIX);
+    if (delta_apply(target, delta_path, &why) == 0) printf("PUT %s: rebuilt from delta\n", target);
+    else printf("PUT %s: delta not applied, %s\n", target, why);
+    free(target);
+    return NULL;
+}
+
+// A delta put is complete: rebuild the file off the event loop. s->user is
+// the name of the file. A broken-off one keeps its delta and journal, so the
+// same put can resume.
+static void on_delta_received(Engine *e, Session *s, int ok) {
+    pthread_t thread;
+    (void)e;
+    if (!ok) {
+        free(s->user);
+    } else if (pthread_create(&thread, NULL, apply_delta, s->user) == 0) {
+        pthread_detach(thread);
+    } else {
+        apply_delta(s->user);
+    }
+    s->user = NULL;
+}
+
+// "sig <file>" being answered: the signature of our copy (delta.h) is built
+// on a thread, as it takes a pass over the whole file, and sent like a get
+// from the worker the command came to
+typedef struct {
+    Engine  *engine;
+    struct sockaddr_in from;
+    uint32_t conn_id;
+    Command  c;
+    FILE    *sig;           // NULL if it cannot be built
+} SigJob;
+
+static void send_signature(Engine *e, void *arg) {
+    SigJob *job = arg;
+    if (job->sig) {
+        printf("SIG %s: %ld bytes of block sums\n", job->c.filename, ftell(job->sig));
+        rewind(job->sig);
+        engine_start_send(e, &job->from, job->conn_id, &job->c, job->sig);
+    }
+    free(job);
+}
+
+static void *build_signature(void *arg) {
+    SigJob *job = arg;
+    FILE *basis = fopen(job->c.filename, "rb");
+    job->sig = tmpfile();
+    if (!job->sig || delta_write_signature(basis, job->sig) != 0) {
+        printf("SIG %s: cannot build signature\n", job->c.filename);
+        if (job->sig) fclose(job->sig);
+        job->sig = NULL;
+    }
+    if (basis) fclose(basis);
+    if (engine_post(job->engine, send_signature, job) != 0) {
+        if (job->sig) fclose(job->sig);
+        free(job);
+    }
+    return NULL;
+}
+
+static void start_signature(Engine *e, const struct sockaddr_in *from, uint32_t conn_id, const Command *c) {
+    pthread_t thread;
+    SigJob *job = calloc(1, sizeof(*job));
+    if (!job) return;
+    job->engine = e;
+    job->from = *from;
+    job->conn_id = conn_id;
+    job->c = *c;
+    if (pthread_create(&thread, NULL, build_signature, job) == 0) {
+        pthread_detach(thread);
+    } else {
+        build_signature(job);
+    }
+}
+
+// A get with etag= learns the file's etag and mtime in the reply. If it
+// named the etag of the file as it stands, the reply is all it gets.
+static void send_file(Engine *e, const struct sockaddr_in *from, uint32_t conn_id, const Command *c) {
+    Command accepted = *c;
+    FILE *fp = fopen(c->filename, "rb");
+    if (!fp) {
+        printf("GET %s: file not found\n", c->filename);
+        return;
+    }
+    if (c->want_etag && file_etag(e, fp, c->filename, &accepted) != 0) {
+        printf("GET %s: cannot read file\n", c->filename);
+        fclose(fp);
+        return;
+    }
+    if (c->has_etag && accepted.has_etag && accepted.etag == c->etag) {
+        Packet reply;
+        Command answer = accepted;
+        fclose(fp);
+        command_plain(&answer);     // Nothing is sent, so no transfer options
+        answer.has_etag = 1;
+        answer.etag = accepted.etag;
+        answer.mtime = accepted.mtime;
+        answer.unchanged = 1;
+        command_build_reply(&answer, &reply);
+        packet_set_conn_id(&reply.header, conn_id);
+        engine_send(e, from, &reply);
+        printf("GET %s: unchanged (etag %08x)\n", c->filename, c->etag);
+        return;
+    }
+    engine_start_send(e, from, conn_id, &accepted, fp);
+}
+
+static void on_command(Engine *e, const struct sockaddr_in *from, uint32_t conn_id, const Command *c) {
+    if (strcmp(c->cmd, "get") == 0) {
+        send_file(e, from, conn_id, c);
+    } else if (strcmp(c->cmd, "mget") == 0) {
+        send_small_files(e, from, conn_id, c);
+    } else if (strcmp(c->cmd, "sig") == 0) {
+        start_signature(e, from, conn_id, c);
+    } else if (strcmp(c->cmd, "put") == 0) {
+        // An upload of the same file (size, etag and mtime) that broke off
+        // earlier picks up from its journal. A delta is received next to the
+        // file and applied at the end.
+        Command accepted = *c;
+        JournalId id = {c->size, c->mtime, c->etag, c->has_etag};
+        if (c->delta && snprintf(accepted.filename, sizeof(accepted.filename), "%s%s", c->filename, DELTA_SUFFIX) >=
+                            (int)sizeof(accepted.filename)) {
+            printf("PUT %s: name too long for a delta\n", c->filename);
+            return;
+        }
+        accepted.offset = journal_resume(accepted.filename, &id);
+        FILE *fp = accepted.offset > 0 ? fopen(accepted.filename, "r+b") : NULL;
+        if (!fp) {
+            accepted.offset = 0;
+            fp = fopen(accepted.filename, "wb");
+        }
+        if (!fp) {
+            printf("PUT %s: cannot create file\n", c->filename);
+            return;
+        }
+        Session *s = engine_start_recv(e, from, conn_id, &accepted, fp);
+        char *target = s && c->delta ? strdup(c->filename) : NULL;
+        if (target) {
+            s->on_done = on_delta_received;
+            s->user = target;
+        }
+    } else if (strcmp(c->cmd, "ls") == 0) {
+        send_listing(e, from, conn_id);
+    } else if (strcmp(c->cmd, "delete") == 0) {
+        send_delete_result(e, from, conn_id, c->filename);
+    }
+}
+
+int main(int argc, char **argv) {
+    EngineConfig cfg = {0, 1, 0, 0, 1, 0};
+    int usage = argc < 2;
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--no-offload") == 0) {
+            cfg.offload = 0;
+        } else if (strcmp(argv[i], "--direct") == 0) {
+            cfg.direct = 1;
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            cfg.uring = 1;
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            cfg.workers = (unsigned)atoi(argv[++i]);
+        } else {
+            usage = 1;
+        }
+    }
+    if (usage || cfg.workers == 0) {
+        printf("Usage: %s [Port Number] [--no-offload] [--direct] [--io-uring] [--workers N]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    cfg.port = (uint16_t)atoi(argv[1]);
+
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    init_crc32();       // The engine's tables are its own; delta sums and etags use this file's
+
+    printf("Akamai-Grade UDP Server (epoll) started on port %s\n", argv[1]);
+    engine_run_workers(&cfg, on_command);
+    return EXIT_FAILURE;
+}
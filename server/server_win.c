@@ -17,60 +17,47 @@ Modified for Windows using Winsock2
 #include <time.h>
 
 #include "../common/protocol.h"
+#include "../common/sack.h"
+#include "../common/cc.h"
+#include "../common/command.h"
+#include "../common/crc32.h"
+#include "../common/filesrc.h"
+#include "../common/rtt.h"
+#include "../common/stats.h"
 
 #pragma comment(lib, "ws2_32.lib")
 
-// CRC32 Table-based implementation
-static uint32_t crc32_table[256];
-
-void init_crc32() {
-    uint32_t polynomial = 0xEDB88320;
-    for (uint32_t i = 0; i < 256; i++) {
-        uint32_t c = i;
-        for (int j = 0; j < 8; j++) {
-            if (c & 1) {
-                c = polynomial ^ (c >> 1);
-            } else {
-                c >>= 1;
-            }
-        }
-        crc32_table[i] = c;
-    }
-}
-
-uint32_t calculate_crc32(const void *buf, size_t size) {
-    const uint8_t *p = (const uint8_t *)buf;
-    uint32_t crc = 0xFFFFFFFF;
-    for (size_t i = 0; i < size; i++) {
-        crc = crc32_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
-    }
-    return ~crc;
-}
-
 static void print_error(const char *msg) {
     fprintf(stderr, "%s: %d\n", msg, WSAGetLastError());
     // Don't exit on error, just log it to keep server alive
 }
 
 // Helper to send a packet with header
+static ChecksumType csum;  // Checksum of the transfer in progress
+
 void send_packet(SOCKET sfd, struct sockaddr_in *addr, int addr_len, Packet *pkt) {
+    if (csum == CSUM_CRC32C) pkt->header.flags |= FLAG_CRC32C;
     pkt->header.checksum = 0;
-    pkt->header.checksum = calculate_crc32(pkt, sizeof(PacketHeader) + pkt->header.data_len);
+    pkt->header.checksum = packet_crc(pkt);
     sendto(sfd, (char *)pkt, sizeof(PacketHeader) + pkt->header.data_len, 0, (struct sockaddr *)addr, addr_len);
 }
 
-void handle_get(SOCKET sfd, struct sockaddr_in *cl_addr, int addr_len, char *filename) {
-    printf("Processing GET %s\n", filename);
-    FILE *fp = fopen(filename, "rb");
+void handle_get(SOCKET sfd, struct sockaddr_in *cl_addr, int addr_len, const Command *c) {
+    printf("Processing GET %s\n", c->filename);
+    FILE *fp = fopen(c->filename, "rb");
     if (!fp) {
         printf("File not found\n");
         // Send error packet (empty data with FIN?) - for now just ignore
         return;
     }
 
-    fseek(fp, 0, SEEK_END);
-    long filesize = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+    FileSource src;
+    if (file_source_open(&src, fp) != 0) {
+        printf("Cannot open %s for sending\n", c->filename);
+        file_source_close(&src);
+        return;
+    }
+    long filesize = src.size;
 
     uint32_t total_packets = (filesize + DATA_SIZE - 1) / DATA_SIZE;
     printf("File size: %ld, Total packets: %d\n", filesize, total_packets);
@@ -81,32 +68,53 @@ void handle_get(SOCKET sfd, struct sockaddr_in *cl_addr, int addr_len, char *fil
     // or we can try a simple window. Let's do Stop-and-Wait for robustness first, then optimize if time permits.
     // Actually, plan said Sliding Window. Let's implement a simple window.
 
-    uint32_t base = 1;
-    uint32_t next_seq_num = 1;
-    Packet window[MAX_WINDOW_SIZE];
-    int window_valid[MAX_WINDOW_SIZE] = {0}; // 1 if packet is loaded
+    SendWindow sw;
+    RttEstimator rtt;
+    CongestionControl cc;
+    TransferStats st;
+    if (send_window_init(&sw, total_packets) != 0) {
+        printf("Cannot allocate send window\n");
+        file_source_close(&src);
+        return;
+    }
+    rtt_init(&rtt);
+    rtt_set_ack_delay(&rtt, c->ack.delay_us);
+    cc_init(&cc);
+    stats_init(&st);
+    uint64_t timer_start = now_us();   // Retransmission timer, restarted when base advances
+    uint32_t seq;
+
+    while (sw.base <= total_packets) {
+        // Resend the holes the receiver reported missing
+        while (send_window_has_room(&sw, cc_window(&cc)) && send_window_next_lost(&sw, &seq)) {
+            printf("Retransmitting packet %d\n", seq);
+            send_packet(sfd, cl_addr, addr_len, &send_window_slot(&sw, seq)->pkt);
+            send_window_sent(&sw, seq, now_us());
+            st.data_packets++;
+            st.retransmits++;
+        }
 
-    while (base <= total_packets) {
         // Fill window
-        while (next_seq_num < base + MAX_WINDOW_SIZE && next_seq_num <= total_packets) {
-            int idx = next_seq_num % MAX_WINDOW_SIZE;
-            if (!window_valid[idx] || window[idx].header.seq_num != next_seq_num) {
+        while (send_window_can_send(&sw, cc_window(&cc))) {
+            Packet *out = &send_window_slot(&sw, sw.next_seq)->pkt;
+            if (out->header.seq_num != sw.next_seq) {
                 // Load packet
-                long offset = (next_seq_num - 1) * DATA_SIZE;
-                fseek(fp, offset, SEEK_SET);
-                int bytes_read = fread(window[idx].data, 1, DATA_SIZE, fp);
+                uint16_t bytes_read;
+                const char *payload = file_source_payload(&src, (long)(sw.next_seq - 1) * DATA_SIZE, &bytes_read);
+                memcpy(out->data, payload, bytes_read);
                 
-                window[idx].header.seq_num = next_seq_num;
-                window[idx].header.data_len = bytes_read;
-                window[idx].header.flags = FLAG_DATA;
-                if (next_seq_num == total_packets) window[idx].header.flags |= FLAG_FIN;
-                window_valid[idx] = 1;
+                out->header.seq_num = sw.next_seq;
+                out->header.data_len = bytes_read;
+                out->header.flags = FLAG_DATA;
+                if (sw.next_seq == total_packets) out->header.flags |= FLAG_FIN;
             }
             
             // Send packet
-            printf("Sending packet %d\n", next_seq_num);
-            send_packet(sfd, cl_addr, addr_len, &window[idx]);
-            next_seq_num++;
+            printf("Sending packet %d\n", sw.next_seq);
+            send_packet(sfd, cl_addr, addr_len, out);
+            if (send_window_sent(&sw, sw.next_seq, now_us())) st.retransmits++;
+            st.data_packets++;
+            send_window_advance(&sw);
         }
 
         // Wait for ACKs
@@ -116,51 +124,95 @@ void handle_get(SOCKET sfd, struct sockaddr_in *cl_addr, int addr_len, char *fil
         
         fd_set readfds;
         struct timeval tv;
-        tv.tv_sec = 0;
-        tv.tv_usec = 100000; // 100ms timeout for fast retransmit check
+        uint64_t now = now_us();
+        uint64_t deadline = timer_start + rtt.rto_us;
+        uint64_t wait_us = deadline > now ? deadline - now : 0;
+        tv.tv_sec = (long)(wait_us / 1000000);
+        tv.tv_usec = (long)(wait_us % 1000000);
 
         FD_ZERO(&readfds);
         FD_SET(sfd, &readfds);
 
-        int activity = select(0, &readfds, NULL, NULL, &tv);
+        int activity = wait_us > 0 ? select(0, &readfds, NULL, NULL, &tv) : 0;
         if (activity > 0) {
             int len = recvfrom(sfd, (char *)&ack_pkt, sizeof(ack_pkt), 0, (struct sockaddr *)&from_addr, &from_len);
             if (len > 0) {
                 uint32_t received_crc = ack_pkt.header.checksum;
                 ack_pkt.header.checksum = 0;
-                if (calculate_crc32(&ack_pkt, sizeof(PacketHeader) + ack_pkt.header.data_len) == received_crc) {
+                if (packet_crc(&ack_pkt) == received_crc) {
                     if (ack_pkt.header.flags & FLAG_ACK) {
                         printf("Received ACK %d\n", ack_pkt.header.ack_num);
-                        if (ack_pkt.header.ack_num >= base) {
-                            base = ack_pkt.header.ack_num + 1;
+                        uint32_t old_base = sw.base;
+                        uint32_t old_losses = sw.loss_events;
+                        int64_t rtt_us;
+                        st.acks++;
+                        uint32_t newly = send_window_on_ack(&sw, &ack_pkt, now_us(), &rtt_us);
+                        if (rtt_us >= 0) {
+                            rtt_sample(&rtt, (uint32_t)rtt_us);
+                            cc_on_rtt(&cc, (uint32_t)rtt_us);
                         }
+                        if (sw.loss_events != old_losses) cc_on_loss(&cc, &sw);
+                        cc_on_ack(&cc, &sw, newly, rtt.srtt_us, now_us());
+                        if (sw.base != old_base) timer_start = now_us();
                     }
                 }
             }
-        } else {
-            // Timeout, Go-Back-N
-            printf("Timeout, resending from %d\n", base);
-            next_seq_num = base;
+        } else if (activity == 0) {
+            // Timeout: Go-Back-N for legacy receivers, holes only for SACK ones
+            printf("Timeout, resending from %d (RTO %u ms)\n", sw.base, rtt.rto_us / 1000);
+            st.timeouts++;
+            rtt_backoff(&rtt);
+            if (send_window_on_timeout(&sw)) cc_on_timeout(&cc, &sw);
+            timer_start = now_us();
         }
     }
-
-    fclose(fp);
+    file_source_close(&src);
     printf("File sent successfully\n");
+    st.bytes = filesize;
+    stats_print_sender("", &st, &sw, &rtt, &cc);
+    send_window_free(&sw);
 }
 
-void handle_put(SOCKET sfd, struct sockaddr_in *cl_addr, int addr_len, char *filename) {
-    printf("Processing PUT %s\n", filename);
-    FILE *fp = fopen(filename, "wb");
+void handle_put(SOCKET sfd, struct sockaddr_in *cl_addr, int addr_len, const Command *c) {
+    printf("Processing PUT %s\n", c->filename);
+    FILE *fp = fopen(c->filename, "wb");
     if (!fp) {
         printf("Cannot create file\n");
         return;
     }
 
-    uint32_t expected_seq = 1;
+    RecvWindow rw;
+    AckState as;
+    TransferStats st;
+    if (recv_window_init(&rw) != 0) {
+        printf("Cannot allocate receive window\n");
+        fclose(fp);
+        return;
+    }
+    ack_state_init(&as, &c->ack);
+    stats_init(&st);
     Packet pkt;
     Packet ack;
     
     while (1) {
+        // Flush a delayed ACK once its timer runs out
+        int64_t ack_wait = ack_wait_us(&as, now_us());
+        if (ack_wait >= 0) {
+            fd_set readfds;
+            struct timeval tv;
+            tv.tv_sec = (long)(ack_wait / 1000000);
+            tv.tv_usec = (long)(ack_wait % 1000000);
+            FD_ZERO(&readfds);
+            FD_SET(sfd, &readfds);
+            if (ack_wait == 0 || select(0, &readfds, NULL, NULL, &tv) == 0) {
+                recv_window_build_ack(&rw, &ack);
+                send_packet(sfd, cl_addr, addr_len, &ack);
+                ack_on_sent(&as);
+                st.acks++;
+                continue;
+            }
+        }
+
         struct sockaddr_in from_addr;
         int from_len = sizeof(from_addr);
         int len = recvfrom(sfd, (char *)&pkt, sizeof(pkt), 0, (struct sockaddr *)&from_addr, &from_len);
@@ -168,31 +220,30 @@ void handle_put(SOCKET sfd, struct sockaddr_in *cl_addr, int addr_len, char *fil
         if (len > 0) {
             uint32_t received_crc = pkt.header.checksum;
             pkt.header.checksum = 0;
-            if (calculate_crc32(&pkt, sizeof(PacketHeader) + pkt.header.data_len) == received_crc) {
+            if (packet_crc(&pkt) == received_crc) {
                 if (pkt.header.flags & FLAG_DATA) {
-                    if (pkt.header.seq_num == expected_seq) {
-                        fwrite(pkt.data, 1, pkt.header.data_len, fp);
-                        printf("Received packet %d\n", expected_seq);
-                        
-                        // Send ACK
-                        ack.header.seq_num = 0;
-                        ack.header.ack_num = expected_seq;
-                        ack.header.flags = FLAG_ACK;
-                        ack.header.data_len = 0;
-                        send_packet(sfd, &from_addr, from_len, &ack);
-                        
-                        if (pkt.header.flags & FLAG_FIN) {
-                            printf("Received FIN\n");
-                            break;
-                        }
-                        expected_seq++;
-                    } else if (pkt.header.seq_num < expected_seq) {
-                        // Resend ACK for old packet
-                        ack.header.seq_num = 0;
-                        ack.header.ack_num = pkt.header.seq_num;
-                        ack.header.flags = FLAG_ACK;
-                        ack.header.data_len = 0;
+                    // Buffer out-of-order packets, write whatever is now contiguous
+                    Packet *in_order;
+                    int clean = recv_window_in_order(&rw, &pkt);
+                    clean &= recv_window_accept(&rw, &pkt);
+                    st.data_packets++;
+                    while ((in_order = recv_window_next(&rw)) != NULL) {
+                        fwrite(in_order->data, 1, in_order->header.data_len, fp);
+                        st.bytes += in_order->header.data_len;
+                        printf("Received packet %d\n", in_order->header.seq_num);
+                    }
+
+                    // Cumulative ACK + SACK bitmap, coalesced while data arrives in order
+                    if (ack_on_data(&as, clean, recv_window_done(&rw), now_us())) {
+                        recv_window_build_ack(&rw, &ack);
                         send_packet(sfd, &from_addr, from_len, &ack);
+                        ack_on_sent(&as);
+                        st.acks++;
+                    }
+
+                    if (recv_window_done(&rw)) {
+                        printf("Received FIN\n");
+                        break;
                     }
                 }
             } else {
@@ -200,8 +251,10 @@ void handle_put(SOCKET sfd, struct sockaddr_in *cl_addr, int addr_len, char *fil
             }
         }
     }
+    recv_window_free(&rw);
     fclose(fp);
     printf("File received successfully\n");
+    stats_print_receiver("", &st, &as.policy);
 }
 
 int main(int argc, char **argv) {
@@ -226,6 +279,11 @@ int main(int argc, char **argv) {
     if ((sfd = socket(AF_INET, SOCK_DGRAM, 0)) == INVALID_SOCKET)
         print_error("Server: socket");
 
+    // Room for a full congestion window in both directions
+    int sock_buf = SOCKET_BUFFER_BYTES;
+    setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, (char *)&sock_buf, sizeof(sock_buf));
+    setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, (char *)&sock_buf, sizeof(sock_buf));
+
     memset(&sv_addr, 0, sizeof(sv_addr));
     sv_addr.sin_family = AF_INET;
     sv_addr.sin_port = htons(atoi(argv[1]));
@@ -245,16 +303,25 @@ int main(int argc, char **argv) {
             // Check if it's a new protocol packet
             uint32_t received_crc = pkt.header.checksum;
             pkt.header.checksum = 0;
-            if (calculate_crc32(&pkt, sizeof(PacketHeader) + pkt.header.data_len) == received_crc) {
+            if (packet_crc(&pkt) == received_crc) {
                 // It's our protocol
-                char cmd[10], filename[200];
-                sscanf(pkt.data, "%s %s", cmd, filename);
+                Command c;
+                command_parse(pkt.data, &c);
+                command_plain(&c);
+                csum = c.csum;
+
+                // Confirm negotiated options; clients that sent none expect no reply
+                if (c.has_options && (strcmp(c.cmd, "get") == 0 || strcmp(c.cmd, "put") == 0)) {
+                    Packet reply;
+                    command_build_reply(&c, &reply);
+                    send_packet(sfd, &cl_addr, addr_len, &reply);
+                }
                 
-                if (strcmp(cmd, "get") == 0) {
-                    handle_get(sfd, &cl_addr, addr_len, filename);
-                } else if (strcmp(cmd, "put") == 0) {
-                    handle_put(sfd, &cl_addr, addr_len, filename);
-                } else if (strcmp(cmd, "ls") == 0) {
+                if (strcmp(c.cmd, "get") == 0) {
+                    handle_get(sfd, &cl_addr, addr_len, &c);
+                } else if (strcmp(c.cmd, "put") == 0) {
+                    handle_put(sfd, &cl_addr, addr_len, &c);
+                } else if (strcmp(c.cmd, "ls") == 0) {
                     // Implement LS
                      WIN32_FIND_DATA findFileData;
                     HANDLE hFind = FindFirstFile(".\\*", &findFileData);
@@ -274,8 +341,8 @@ int main(int argc, char **argv) {
                     resp.header.data_len = strlen(file_list);
                     resp.header.flags = FLAG_DATA | FLAG_FIN;
                     send_packet(sfd, &cl_addr, addr_len, &resp);
-                } else if (strcmp(cmd, "delete") == 0) {
-                     int res = remove(filename);
+                } else if (strcmp(c.cmd, "delete") == 0) {
+                     int res = remove(c.filename);
                      Packet resp;
                      memset(&resp, 0, sizeof(resp));
                      *(int*)resp.data = (res == 0) ? 1 : -1;
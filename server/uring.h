@@ -0,0 +1,267 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// Just enough io_uring for the engine, on the raw system calls (no liburing):
+// one submission/completion ring pair, a ring of provided buffers that the
+// kernel fills on its own (multishot recvmsg), and multishot poll. Every
+// piece is probed at setup; callers fall back to epoll when setup fails.
+
+typedef struct Uring {
+    int       fd;
+    unsigned  sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void     *sq_map;
+    void     *cq_map;
+    size_t    sq_map_len;
+    size_t    cq_map_len;
+    size_t    sqes_len;
+    unsigned  sq_local_tail;    // SQEs prepared; published to the kernel on submit
+    unsigned  pending;          // Prepared and not yet submitted
+
+    // Provided buffers: the kernel picks one per received datagram
+    struct io_uring_buf_ring *br;
+    size_t    br_len;
+    char     *bufs;
+    unsigned  buf_count;        // Power of two
+    unsigned  buf_size;
+    uint16_t  buf_group;
+    uint16_t  br_tail;
+} Uring;
+
+static inline int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg,
+                              size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static inline void uring_free(Uring *u) {
+    if (u->br) {
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = u->buf_group;
+        syscall(__NR_io_uring_register, u->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(u->br, u->br_len);
+    }
+    free(u->bufs);
+    if (u->sqes) munmap(u->sqes, u->sqes_len);
+    if (u->cq_map && u->cq_map != u->sq_map) munmap(u->cq_map, u->cq_map_len);
+    if (u->sq_map) munmap(u->sq_map, u->sq_map_len);
+    if (u->fd >= 0) close(u->fd);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+// Returns -1 (errno set) if the kernel has no usable io_uring.
+static inline int uring_init(Uring *u, unsigned entries, unsigned cq_entries) {
+    struct io_uring_params p;
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = cq_entries;
+    u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0) return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        uring_free(u);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    u->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (u->cq_map_len > u->sq_map_len) u->sq_map_len = u->cq_map_len;
+    u->cq_map_len = u->sq_map_len;
+    u->sq_map = mmap(NULL, u->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                     IORING_OFF_SQ_RING);
+    if (u->sq_map == MAP_FAILED) {
+        u->sq_map = NULL;
+        uring_free(u);
+        return -1;
+    }
+    u->cq_map = u->sq_map;
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        uring_free(u);
+        return -1;
+    }
+
+    char *sq = u->sq_map;
+    char *cq = u->cq_map;
+    u->sq_entries = p.sq_entries;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    u->sq_local_tail = *u->sq_tail;
+    return 0;
+}
+
+// Registers count buffers of size bytes (count a power of two) as group.
+// Returns -1 where provided buffer rings are unsupported (before 5.19).
+static inline int uring_buffers_init(Uring *u, unsigned count, unsigned size, uint16_t group) {
+    struct io_uring_buf_reg reg;
+
+    u->br_len = count * sizeof(struct io_uring_buf);
+    void *br = mmap(NULL, u->br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (br == MAP_FAILED) return -1;
+    if (posix_memalign((void **)&u->bufs, 4096, (size_t)count * size) != 0) {
+        u->bufs = NULL;
+        munmap(br, u->br_len);
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)br;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        munmap(br, u->br_len);
+        return -1;
+    }
+    u->br = br;
+    u->buf_count = count;
+    u->buf_size = size;
+    u->buf_group = group;
+    u->br_tail = 0;
+    for (unsigned i = 0; i < count; i++) {
+        struct io_uring_buf *b = &u->br->bufs[i];
+        b->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)i * size);
+        b->len = size;
+        b->bid = (uint16_t)i;
+    }
+    u->br_tail = (uint16_t)count;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static inline char *uring_buffer(const Uring *u, uint16_t bid) {
+    return u->bufs + (size_t)bid * u->buf_size;
+}
+
+// Hands a buffer back to the kernel; visible after uring_buffers_publish()
+static inline void uring_buffer_put(Uring *u, uint16_t bid) {
+    struct io_uring_buf *b = &u->br->bufs[u->br_tail & (u->buf_count - 1)];
+    b->addr = (uint64_t)(uintptr_t)uring_buffer(u, bid);
+    b->len = u->buf_size;
+    b->bid = bid;
+    u->br_tail++;
+}
+
+static inline void uring_buffers_publish(Uring *u) {
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+// Submits whatever was prepared and, unless wait_nr is 0, waits for that
+// many completions or timeout_ms (-1 = no limit). Returns -1 on errors other
+// than a timeout or a signal.
+static inline int uring_submit(Uring *u, unsigned wait_nr, int timeout_ms) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+    memset(&arg, 0, sizeof(arg));
+    if (wait_nr && timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    flags |= IORING_ENTER_EXT_ARG;
+
+    int r = uring_enter(u->fd, u->pending, wait_nr, flags, &arg, sizeof(arg));
+    if (r >= 0) {
+        u->pending -= (unsigned)r < u->pending ? (unsigned)r : u->pending;
+        return 0;
+    }
+    return errno == ETIME || errno == EINTR || errno == EBUSY ? 0 : -1;
+}
+
+// Next free SQE, zeroed. Submits first when the queue is full.
+static inline struct io_uring_sqe *uring_sqe(Uring *u) {
+    if (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) uring_submit(u, 0, 0);
+    unsigned idx = u->sq_local_tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    u->sq_local_tail++;
+    u->pending++;
+    return sqe;
+}
+
+// Multishot recvmsg into provided buffers: one completion per datagram (or
+// GRO buffer) until the buffers run out. msg only gives the name and control
+// sizes and must stay valid while armed.
+static inline void uring_prep_recvmsg_multishot(Uring *u, int fd, struct msghdr *msg, uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = u->buf_group;
+    sqe->user_data = user_data;
+}
+
+// Multishot poll for readability
+static inline void uring_prep_poll_multishot(Uring *u, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = user_data;
+}
+
+static inline struct io_uring_cqe *uring_peek(Uring *u, unsigned i) {
+    unsigned head = *u->cq_head + i;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &u->cqes[head & *u->cq_mask];
+}
+
+static inline void uring_seen(Uring *u, unsigned n) {
+    __atomic_store_n(u->cq_head, *u->cq_head + n, __ATOMIC_RELEASE);
+}
+
+// A multishot recvmsg buffer holds io_uring_recvmsg_out, then the name and
+// control areas sized as in the armed msghdr, then the payload. Returns the
+// payload; *ctrl gets a msghdr over the control messages for CMSG_FIRSTHDR.
+static inline char *uring_recvmsg_payload(char *buf, const struct msghdr *armed, struct sockaddr_in **from,
+                                          struct msghdr *ctrl, unsigned *len) {
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+    char *name = buf + sizeof(*out);
+    char *control = name + armed->msg_namelen;
+
+    *from = (struct sockaddr_in *)name;
+    memset(ctrl, 0, sizeof(*ctrl));
+    ctrl->msg_control = control;
+    ctrl->msg_controllen = out->controllen;
+    *len = out->payloadlen;
+    return control + armed->msg_controllen;
+}
+
+#endif // URING_H
@@ -12,6 +12,8 @@ const FLAG_ACK  = 0x02;
 const FLAG_FIN  = 0x04;
 const FLAG_DATA = 0x08;
 
+const RECV_WINDOW_DEFAULT = 64;
+
 // CRC32 Table
 const crcTable = new Int32Array(256);
 (function() {
@@ -46,11 +48,21 @@ class UdpClientWin {
     try { this.sock.close(); } catch (_) {}
   }
 
+  // Packets we can absorb past the last ACK: the socket receive buffer is the
+  // only buffering in front of the in-order writes in get().
+  recvWindow() {
+    try {
+      return Math.min(0xFFFF, Math.max(1, Math.floor(this.sock.getRecvBufferSize() / PACKET_SIZE)));
+    } catch (_) {
+      return RECV_WINDOW_DEFAULT; // Socket not bound yet
+    }
+  }
+
   createPacket(seqNum, ackNum, flags, dataBuf) {
     const pkt = Buffer.alloc(PACKET_SIZE);
     pkt.writeUInt32LE(seqNum, 0);
     pkt.writeUInt32LE(ackNum, 4);
-    pkt.writeUInt16LE(10, 8); // Window Size
+    pkt.writeUInt16LE(this.recvWindow(), 8); // Window Size
     const dataLen = dataBuf ? dataBuf.length : 0;
     pkt.writeUInt16LE(dataLen, 10);
     pkt.writeUInt8(flags, 16);